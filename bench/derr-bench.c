@@ -0,0 +1,240 @@
+// derr-bench.c - Misura costo per chiamata e throughput di derr_log()
+// gcc -O2 -pthread -rdynamic derr-bench.c -o derr-bench
+//
+// Uso: derr-bench [-t max_thread] [-n chiamate_per_thread] [config ...]
+//
+// Per ogni configurazione e per 1, 2, 4, ... max_thread thread riporta le
+// chiamate al secondo complessive, i percentili di latenza per chiamata (ns,
+// compreso il costo di clock_gettime, vedi la riga "vuoto") e quante volte un
+// thread ha trovato occupato il lock di un sink. stderr è rediretto su
+// /dev/null durante le misure; i risultati vanno su stdout.
+
+#define DERR_IMPLEMENTATION
+#include "../derr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct bench_config {
+    const char *name;
+    const char *desc;
+    int  (*setup)(void);          // 0 = ok, -1 = configurazione non disponibile
+    void (*teardown)(void);
+    void (*call)(int i);
+    int    explicit_only;         // lenta senza demone: solo se richiesta per nome
+} bench_config;
+
+static char bench_tmp[256];           // file temporaneo dei sink file/binario
+static FILE *bench_file;
+
+// ---- Chiamate misurate ----
+static void call_empty(int i) { (void)i; }
+static void call_debug(int i) { DERR_DEBUG("richiesta %d: cache miss", i); }
+static void call_info(int i) { DERR_INFO("richiesta %d completata in %d us", i, i & 1023); }
+static void call_errno(int i) { derr_log_errno(DERR_ERROR, ECONNRESET, "invio della risposta %d fallito", i); }
+static void call_kv(int i) {
+    derr_log_kv(DERR_INFO, "richiesta completata", DERR_KV_INT("id", i), DERR_KV_STR("metodo", "GET"),
+                DERR_KV_UINT("us", (unsigned)(i & 1023)));
+}
+
+// ---- Configurazioni ----
+static void reset_defaults(void) {
+    derr_set_min_level(DERR_DEBUG);
+    derr_enable_color(0);
+    derr_enable_stderr(1);
+    derr_set_encoder(DERR_ENC_TEXT);
+}
+
+static int setup_none(void) { reset_defaults(); return 0; }
+static void teardown_none(void) {}
+
+static int setup_filtered(void) { reset_defaults(); derr_set_min_level(DERR_WARN); return 0; }
+static int setup_color(void) { reset_defaults(); derr_enable_color(1); return 0; }
+static int setup_json(void) { reset_defaults(); derr_set_encoder(DERR_ENC_JSON); return 0; }
+
+static int setup_file(void) {
+    reset_defaults();
+    derr_enable_stderr(0);
+    if (!(bench_file = fopen(bench_tmp, "w"))) return -1;
+    derr_set_log_file(bench_file);
+    return 0;
+}
+static void teardown_file(void) {
+    derr_set_log_file(NULL);
+    fclose(bench_file);
+    bench_file = NULL;
+    remove(bench_tmp);
+}
+
+static int setup_syslog(void) {
+    reset_defaults();
+    derr_enable_stderr(0);
+    derr_use_syslog(1);
+    return 0;
+}
+static void teardown_syslog(void) { derr_use_syslog(0); }
+
+static int setup_async(void) {
+    reset_defaults();
+    return derr_async_start(1u << 16);
+}
+static void teardown_async(void) { derr_async_stop(); derr_async_set_deferred(0); }
+
+static int setup_deferred(void) {
+    reset_defaults();
+    derr_async_set_deferred(1);
+    return derr_async_start(1u << 16);
+}
+
+static int setup_binary(void) {
+    reset_defaults();
+    derr_enable_stderr(0);
+    return derr_binary_open(bench_tmp, DERR_DEBUG);
+}
+static void teardown_binary(void) { derr_binary_close(); remove(bench_tmp); }
+
+static const bench_config bench_configs[] = {
+    { "vuoto",    "solo clock_gettime (costo della misura)", setup_none,     teardown_none,   call_empty, 0 },
+    { "filtrato", "DERR_DEBUG sotto il livello minimo",      setup_filtered, teardown_none,   call_debug, 0 },
+    { "stderr",   "INFO su stderr (/dev/null)",              setup_none,     teardown_none,   call_info,  0 },
+    { "colori",   "INFO su stderr con colori ANSI",          setup_color,    teardown_none,   call_info,  0 },
+    { "errno",    "ERROR con errno e strerror",              setup_none,     teardown_none,   call_errno, 0 },
+    { "kv",       "INFO con tre campi strutturati",          setup_none,     teardown_none,   call_kv,    0 },
+    { "json",     "INFO con encoder JSON",                   setup_json,     teardown_none,   call_info,  0 },
+    { "file",     "INFO solo sul sink file",                 setup_file,     teardown_file,   call_info,  0 },
+    { "syslog",   "INFO solo su syslog(3)",                  setup_syslog,   teardown_syslog, call_info,  1 },
+    { "async",    "INFO su stderr in modalità asincrona",    setup_async,    teardown_async,  call_info,  0 },
+    { "differita", "async, formattazione sullo scrittore",  setup_deferred, teardown_async,  call_info,  0 },
+    { "binario",  "INFO solo nel log binario",               setup_binary,   teardown_binary, call_info,  0 },
+};
+#define NCONFIGS ((int)(sizeof bench_configs / sizeof bench_configs[0]))
+
+// ---- Misura ----
+typedef struct bench_thread {
+    pthread_t       th;
+    const bench_config *cfg;
+    int             calls;
+    unsigned       *lat;          // ns per chiamata
+} bench_thread;
+
+static int bench_go;                  // partenza simultanea dei thread
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static void *bench_main(void *arg) {
+    bench_thread *t = (bench_thread *)arg;
+    while (!__atomic_load_n(&bench_go, __ATOMIC_ACQUIRE)) sched_yield();
+    for (int i = 0; i < t->calls; i++) {
+        unsigned long long a = now_ns();
+        t->cfg->call(i);
+        unsigned long long d = now_ns() - a;
+        t->lat[i] = d > 0xffffffffull ? 0xffffffffu : (unsigned)d;
+    }
+    return NULL;
+}
+
+static int cmp_u(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long contention_total(void) {
+    unsigned long long c = 0;
+    for (int i = 0; i < DERR_MAX_SINKS; i++) c += derr_sink_contention(i);
+    return c;
+}
+
+static void run(const bench_config *cfg, int nthreads, int calls, unsigned *lat) {
+    bench_thread th[64];
+    unsigned long long c0 = contention_total();
+    __atomic_store_n(&bench_go, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < nthreads; i++) {
+        th[i].cfg = cfg;
+        th[i].calls = calls;
+        th[i].lat = lat + (size_t)i * (size_t)calls;
+        pthread_create(&th[i].th, NULL, bench_main, &th[i]);
+    }
+    unsigned long long t0 = now_ns();
+    __atomic_store_n(&bench_go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < nthreads; i++) pthread_join(th[i].th, NULL);
+    derr_flush();                 // in asincrono conta anche lo svuotamento della coda
+    unsigned long long wall = now_ns() - t0;
+
+    size_t n = (size_t)nthreads * (size_t)calls;
+    qsort(lat, n, sizeof *lat, cmp_u);
+    printf("%-9s %3d %13.0f %7u %7u %7u %9u %9llu\n", cfg->name, nthreads,
+           (double)n * 1e9 / (double)(wall ? wall : 1),
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1],
+           contention_total() - c0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = ncpu > 0 ? (int)(ncpu < 8 ? ncpu : 8) : 4;
+    int calls = 100000;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp(argv[first], "-t") && first + 1 < argc) max_threads = atoi(argv[++first]);
+        else if (!strcmp(argv[first], "-n") && first + 1 < argc) calls = atoi(argv[++first]);
+        else {
+            fprintf(stderr, "uso: %s [-t max_thread] [-n chiamate_per_thread] [config ...]\nconfig:\n", argv[0]);
+            for (int i = 0; i < NCONFIGS; i++)
+                fprintf(stderr, "  %-9s %s%s\n", bench_configs[i].name, bench_configs[i].desc,
+                        bench_configs[i].explicit_only ? " (solo se richiesta)" : "");
+            return 2;
+        }
+    }
+    if (max_threads < 1 || max_threads > 64 || calls < 1) {
+        fprintf(stderr, "%s: -t deve essere fra 1 e 64, -n positivo\n", argv[0]);
+        return 2;
+    }
+    for (int i = first; i < argc; i++) {
+        int ok = 0;
+        for (int c = 0; c < NCONFIGS; c++) ok |= !strcmp(argv[i], bench_configs[c].name);
+        if (!ok) { fprintf(stderr, "%s: configurazione sconosciuta '%s'\n", argv[0], argv[i]); return 2; }
+    }
+
+    unsigned *lat = (unsigned *)malloc((size_t)max_threads * (size_t)calls * sizeof *lat);
+    if (!lat) { perror("malloc"); return 1; }
+    snprintf(bench_tmp, sizeof bench_tmp, "/tmp/derr-bench.%ld", (long)getpid());
+    derr_set_program_name("derr-bench");
+
+    // stderr su /dev/null; l'originale serve per i messaggi del benchmark
+    fflush(stderr);
+    int saved = dup(2), devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devnull < 0) { perror("/dev/null"); return 1; }
+    dup2(devnull, 2);
+    close(devnull);
+    FILE *err = fdopen(saved, "w");
+
+    printf("%-9s %3s %13s %7s %7s %7s %9s %9s\n", "config", "thr", "chiamate/s", "p50", "p99", "p999", "max", "contesa");
+    for (int c = 0; c < NCONFIGS; c++) {
+        const bench_config *cfg = &bench_configs[c];
+        int selected = first == argc && !cfg->explicit_only;
+        for (int i = first; i < argc; i++) selected |= !strcmp(argv[i], cfg->name);
+        if (!selected) continue;
+        if (cfg->setup() != 0) {
+            fprintf(err, "%s: configurazione %s non disponibile: %s\n", argv[0], cfg->name, strerror(errno));
+            continue;
+        }
+        for (int t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2)
+            run(cfg, t, calls, lat);
+        cfg->teardown();
+    }
+
+    fflush(stderr);
+    dup2(saved, 2);
+    fclose(err);
+    free(lat);
+    return 0;
+}
@@ -11,6 +11,7 @@
 //  - Backtrace su crash/livello FATAL (POSIX execinfo)
 //  - Opzione colori ANSI
 //  - Thread‑safe (best‑effort) via mutex POSIX; fallback lock‑free
+//  - Modalità asincrona opzionale: coda MPSC lock‑free + thread scrittore
 //  - Header‑only: includi questo file; definisci DERR_IMPLEMENTATION in un .c UNA volta
 //
 // Uso rapido:
@@ -33,8 +34,10 @@
 
 #if defined(_MSC_VER)
   #define DERR_INLINE __inline
+  #define DERR_TLS    __declspec(thread)
 #else
   #define DERR_INLINE inline
+  #define DERR_TLS    __thread
 #endif
 
 #include <stdio.h>
@@ -43,6 +46,8 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -62,8 +67,39 @@ void derr_set_program_name(const char *name);
 void derr_set_min_level(derr_level lvl);
 void derr_enable_color(int enable);
 void derr_set_timestamp_utc(int use_utc);
-void derr_set_log_file(FILE *fp);     // NULL = disabilita file extra
+
+// Formato del timestamp: ISO‑8601 con ms (default), µs o ns, oppure epoch grezzo
+typedef enum derr_ts_format {
+    DERR_TS_MS,          // 2025-08-20T14:32:10.123
+    DERR_TS_US,          // 2025-08-20T14:32:10.123456
+    DERR_TS_NS,          // 2025-08-20T14:32:10.123456789
+    DERR_TS_EPOCH_MS,    // 1724164330.123
+    DERR_TS_EPOCH_US,    // 1724164330.123456
+    DERR_TS_EPOCH_NS     // 1724164330.123456789
+} derr_ts_format;
+void derr_set_timestamp_format(derr_ts_format fmt);
+// Linux: usa CLOCK_REALTIME_COARSE (più economico, risoluzione ~1‑4 ms)
+void derr_set_timestamp_coarse(int enable);
+void derr_set_log_file(FILE *fp);     // NULL = disabilita file extra (chiude quello di derr_open_log_file)
+// File di log gestito dalla libreria, con rotazione: quando supera max_bytes o
+// è aperto da più di max_age_s secondi diventa <path>.1 (i precedenti scalano
+// fino a <path>.<keep>), e si riparte da un file nuovo. 0 = criterio assente.
+// La rotazione avviene sotto il lock del solo sink file. 0 = ok, -1 = errore (errno)
+int  derr_open_log_file(const char *path, size_t max_bytes, unsigned max_age_s, unsigned keep);
+// POSIX: comprime i file ruotati con gzip (processo esterno, da un thread a parte)
+void derr_set_log_compress(int enable);
+// Riapre il file al prossimo record (rotazione esterna); async‑signal‑safe
+void derr_reopen_log_file(void);
+// POSIX: su SIGHUP chiama derr_reopen_log_file() (poi l'eventuale handler precedente)
+int  derr_reopen_on_sighup(int enable);
 void derr_set_include_errno_details(int enable);
+// Tetto alla lunghezza del messaggio formattato (default 1 MiB, 0 = default);
+// oltre il tetto il messaggio viene troncato e terminato da "..."
+void derr_set_max_message_size(size_t bytes);
+// Nome simbolico di un errno ("ECONNRESET"), NULL se sconosciuto
+const char *derr_errno_name(int errnum);
+// Svuota la cache errno → messaggio (da chiamare dopo setlocale)
+void derr_errno_cache_reset(void);
 
 // POSIX: invia anche a syslog (LOG_USER). NOP su non‑POSIX.
 void derr_use_syslog(int enable);
@@ -72,26 +108,332 @@ void derr_use_syslog(int enable);
 void derr_log(derr_level lvl, const char *fmt, ...) __attribute__((format(printf,2,3)));
 void derr_log_errno(derr_level lvl, int errnum, const char *fmt, ...) __attribute__((format(printf,3,4)));
 
-// Convenienze
-#define DERR_DEBUG(...) derr_log(DERR_DEBUG, __VA_ARGS__)
-#define DERR_INFO(...)   derr_log(DERR_INFO,  __VA_ARGS__)
-#define DERR_WARN(...)   derr_log(DERR_WARN,  __VA_ARGS__)
-#define DERR_ERROR(...)  derr_log(DERR_ERROR, __VA_ARGS__)
+// Soglia a tempo di compilazione: le macro sotto questo livello (valore
+// numerico: DEBUG=10 ... FATAL=50) spariscono, ma il formato resta
+// controllato dal compilatore tramite un printf morto.
+#ifndef DERR_COMPILE_MIN_LEVEL
+  #define DERR_COMPILE_MIN_LEVEL 0
+#endif
+
+// Stato letto a ogni chiamata, su una cache line propria (lontana dai lock).
+// Esportato per i controlli inline nelle macro; solo lettura: usare i setter.
+typedef struct derr_hot_ {
+    int      min_level;    // soglia runtime effettiva (derr_set_min_level e sink)
+    int      rl_default;   // != 0 se è attivo un limite globale
+    int      text_min;     // interno: soglia dei sink testuali
+    unsigned cfg;          // interno: flag e formati impacchettati
+    unsigned mod_gen;      // interno: cambia a ogni modifica delle soglie (livelli per modulo)
+    unsigned sample[5];    // campionamento 1 su N per DEBUG..FATAL (0 = tutti)
+} derr_hot_;
+extern derr_hot_ derr_g_hot;
+
+// Se il livello è filtrato gli argomenti non vengono nemmeno valutati.
+static DERR_INLINE int derr_level_enabled(derr_level lvl){
+    return (int)lvl >= __atomic_load_n(&derr_g_hot.min_level, __ATOMIC_RELAXED);
+}
+
+// ----- Campi strutturati -----
+// Campi tipizzati registrati senza passare da printf:
+//   derr_log_kv(DERR_INFO, "richiesta servita", DERR_KV_INT("req_id", id), DERR_KV_STR("peer", p));
+// Le stringhe sono copiate nel record (anche in modalità asincrona).
+typedef enum derr_kv_type {
+    DERR_KV_T_END,
+    DERR_KV_T_INT,
+    DERR_KV_T_UINT,
+    DERR_KV_T_DOUBLE,
+    DERR_KV_T_BOOL,
+    DERR_KV_T_STR
+} derr_kv_type;
+
+typedef struct derr_kv {
+    const char  *key;
+    derr_kv_type type;
+    union { long long i; unsigned long long u; double d; const char *s; } v;
+} derr_kv;
+
+static DERR_INLINE derr_kv derr_kv_make_(const char *k, derr_kv_type t){
+    derr_kv kv; kv.key = k; kv.type = t; kv.v.u = 0; return kv;
+}
+static DERR_INLINE derr_kv derr_kv_i_(const char *k, long long v){ derr_kv kv = derr_kv_make_(k, DERR_KV_T_INT); kv.v.i = v; return kv; }
+static DERR_INLINE derr_kv derr_kv_u_(const char *k, unsigned long long v){ derr_kv kv = derr_kv_make_(k, DERR_KV_T_UINT); kv.v.u = v; return kv; }
+static DERR_INLINE derr_kv derr_kv_d_(const char *k, double v){ derr_kv kv = derr_kv_make_(k, DERR_KV_T_DOUBLE); kv.v.d = v; return kv; }
+static DERR_INLINE derr_kv derr_kv_b_(const char *k, int v){ derr_kv kv = derr_kv_make_(k, DERR_KV_T_BOOL); kv.v.i = v != 0; return kv; }
+static DERR_INLINE derr_kv derr_kv_s_(const char *k, const char *v){ derr_kv kv = derr_kv_make_(k, DERR_KV_T_STR); kv.v.s = v; return kv; }
+
+#define DERR_KV_INT(k, v)    derr_kv_i_((k), (long long)(v))
+#define DERR_KV_UINT(k, v)   derr_kv_u_((k), (unsigned long long)(v))
+#define DERR_KV_DOUBLE(k, v) derr_kv_d_((k), (double)(v))
+#define DERR_KV_BOOL(k, v)   derr_kv_b_((k), (v) ? 1 : 0)
+#define DERR_KV_STR(k, v)    derr_kv_s_((k), (v))
+#define DERR_KV_END          derr_kv_make_(NULL, DERR_KV_T_END)
+
+#define DERR_KV_MAX 32   // campi per record (gli eccedenti sono ignorati)
+
+// Campi passati per valore e chiusi da DERR_KV_END (lo aggiunge derr_log_kv)
+void derr_log_kvl(derr_level lvl, const char *msg, ...);
+void derr_log_kva(derr_level lvl, const char *msg, const derr_kv *kv, size_t n);
+#define derr_log_kv(lvl, ...) \
+    (derr_level_enabled(lvl) ? derr_log_kvl((lvl), __VA_ARGS__, DERR_KV_END) : (void)0)
+
+// Codifica della riga per tutti i sink testuali. TEXT è il formato classico
+// (i campi seguono il messaggio come chiave=valore); JSON e logfmt producono
+// una riga per record, senza colori.
+typedef enum derr_encoder {
+    DERR_ENC_TEXT,
+    DERR_ENC_JSON,
+    DERR_ENC_LOGFMT
+} derr_encoder;
+void derr_set_encoder(derr_encoder enc);
+
+// ----- Contesto per thread (MDC) -----
+// Campi del thread corrente aggiunti a ogni record: il valore è formattato una
+// volta sola al push, poi copiato nella riga. Gestiti a pila (push/pop).
+// 0 = ok, -1 = spazio esaurito (errno = ENOSPC, vedi DERR_CTX_BYTES / DERR_CTX_DEPTH)
+int  derr_ctx_push(const char *key, const char *fmt, ...)
+#if defined(__GNUC__) || defined(__clang__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+int  derr_ctx_push_kv(derr_kv field);       // valore tipizzato (numeri restano numeri in JSON)
+void derr_ctx_pop(void);
+void derr_ctx_clear(void);
+
+// Id piccolo e stabile del thread corrente (1, 2, ... in ordine di primo uso)
+unsigned derr_thread_id(void);
+// Mostra l'id del thread nel prefisso: "prog[3]:" (JSON/logfmt: campo tid)
+void derr_set_thread_id(int enable);
+
+// ----- Punto di chiamata, rate limiting e soppressione dei duplicati -----
+// Descrittore per punto di chiamata (una static per espansione di macro): la
+// posizione nel sorgente è fissata dal compilatore e arriva ai sink come
+// puntatore, senza formattazione (vedi derr_set_source_location).
+// Rate limit: token bucket (GCRA) senza lock; il percorso soppresso costa una
+// lettura dell'orologio, un confronto e un incremento atomico.
+typedef struct derr_site {
+    const char        *file;            // __FILE__
+    const char        *func;            // __func__
+    int                line;            // __LINE__
+    unsigned long long rl_tat;          // istante teorico del prossimo record (ns)
+    unsigned long long rl_suppressed;   // soppressi dall'ultimo record emesso
+    unsigned long long mod_cache;       // generazione << 32 | soglia testuale << 8 | soglia
+    int                static_fmt;      // formato letterale: la formattazione differita ne tiene il puntatore
+} derr_site;
+#define DERR_SITE_INIT_ { __FILE__, __func__, __LINE__, 0, 0, 0, 0 }
+// Come sopra con il formato (primo argomento di __VA_ARGS__): solo un letterale
+// è costante per il compilatore, un char * qualsiasi no
+#define DERR_FMT_ARG_(f, ...) f
+#define DERR_SITE_INIT_FMT_(...) { __FILE__, __func__, __LINE__, 0, 0, 0, \
+                                   __builtin_constant_p(DERR_FMT_ARG_(__VA_ARGS__, 0)) }
+
+// 1 se il record può passare. burst/per_sec = 0 usano il default globale.
+// Al primo record ammesso dopo una soppressione emette un avviso con il conteggio.
+int  derr_ratelimit_allow(derr_site *site, derr_level lvl, unsigned burst, unsigned per_sec);
+// Limite applicato a tutte le macro DERR_* (0 = disattivato, default)
+void derr_set_default_ratelimit(unsigned burst, unsigned per_sec);
+// Collassa record identici consecutivi in "messaggio precedente ripetuto N volte"
+void derr_set_dedup(int enable);
+// Mostra file:riga nei sink testuali ("prog: main.c:42: msg"; JSON/logfmt:
+// campi file, line, func). I sink personalizzati la ricevono sempre in
+// derr_record.file/line/func per i record emessi dalle macro.
+void derr_set_source_location(int enable);
+
+static DERR_INLINE int derr_site_allow_(derr_site *site, derr_level lvl){
+    return !__atomic_load_n(&derr_g_hot.rl_default, __ATOMIC_RELAXED) || derr_ratelimit_allow(site, lvl, 0, 0);
+}
+
+// ----- Livelli per modulo -----
+// Un modulo ha una soglia propria che sostituisce quella di derr_set_min_level
+// per le sue chiamate. Il modulo di un'unità di traduzione si sceglie prima
+// dell'include:
+//   #define DERR_MODULE_NAME "net"
+//   #include "derr.h"
+// oppure per chiamata con DERR_MODULE_LOG("net", DERR_DEBUG, ...).
+// Ogni punto di chiamata tiene in derr_site la soglia risolta del suo modulo:
+// finché nessuno cambia livelli o sink il controllo è una load del contatore di
+// generazione e un confronto. Senza modulo vale la soglia globale.
+#ifndef DERR_MODULE_NAME
+  #define DERR_MODULE_NAME ((const char *)0)
+#endif
+#define DERR_MODULE_MAX      64    // moduli con un livello impostato
+#define DERR_MODULE_NAME_MAX 32    // byte del nome, terminatore compreso
+
+// 0 = ok, -1 = nome vuoto o troppo lungo (EINVAL) o tabella piena (ENOSPC)
+int  derr_set_module_level(const char *module, derr_level lvl);
+// Elenco "net=debug,db=warn"; un livello senza nome ("warn") è quello globale.
+// Livelli: debug, info, warn, error, fatal o numerici. Le voci valide sono
+// applicate comunque; -1 (EINVAL) se almeno una non lo è.
+// DERR_LEVELS nell'ambiente è applicata prima del primo record o della prima
+// impostazione dei livelli; le chiamate esplicite successive hanno la precedenza.
+int  derr_set_module_levels(const char *spec);
+// Livello impostato per il modulo, o quello globale se non ne ha uno
+derr_level derr_get_module_level(const char *module);
+// Rimuove tutti i livelli per modulo (tornano alla soglia globale)
+void derr_clear_module_levels(void);
+
+// Interni delle macro. Un site senza modulo (mod_cache == 0) usa la soglia globale.
+unsigned long long derr_module_resolve_(derr_site *site, const char *module);
+void derr_log_site_(derr_site *site, derr_level lvl, const char *fmt, ...) __attribute__((format(printf,3,4)));
+void derr_log_errno_site_(derr_site *site, derr_level lvl, int errnum, const char *fmt, ...)
+    __attribute__((format(printf,4,5)));
+
+static DERR_INLINE int derr_module_enabled_(derr_site *site, const char *module, derr_level lvl){
+    if(!module) return derr_level_enabled(lvl);
+    unsigned long long c = __atomic_load_n(&site->mod_cache, __ATOMIC_ACQUIRE);
+    if((unsigned)(c >> 32) != __atomic_load_n(&derr_g_hot.mod_gen, __ATOMIC_ACQUIRE))
+        c = derr_module_resolve_(site, module);
+    return (int)lvl >= (int)(c & 0xffu);
+}
+
+// ----- Campionamento -----
+// DERR_INFO_SAMPLED(1000, ...) emette in media un record ogni 1000 chiamate;
+// derr_set_sampling(DERR_INFO, 1000) fa lo stesso per tutte le macro di quel
+// livello. La scelta usa un xorshift per thread (nessuno stato condiviso): le
+// chiamate scartate non valutano gli argomenti né entrano in derr_log.
+// Il record emesso porta il tasso (sample_rate=N, derr_record.sample_rate)
+// per poter riscalare i conteggi a valle.
+// 0 = ok, -1 = livello non campionabile (FATAL) o ignoto (EINVAL). rate 0/1 = tutti.
+int derr_set_sampling(derr_level lvl, unsigned rate);
+void derr_log_sampled_(derr_site *site, unsigned rate, derr_level lvl, const char *fmt, ...)
+    __attribute__((format(printf,4,5)));
+
+// Interno di derr.hpp: argomenti già serializzati come nel log binario ('i'
+// i64, 'u' u64, 'f' double, 'p' u64, 's' u32 len + byte) nell'ordine delle
+// conversioni di fmt, formato printf con durata statica. sample 0 = tasso del livello.
+void derr_log_packed_(derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum,
+                      const char *fmt, const void *args, size_t len);
+
+// 1 con probabilità 1/rate
+static DERR_INLINE int derr_sample_(unsigned rate){
+    static DERR_TLS unsigned derr_rng_;
+    if(rate <= 1) return 1;
+    unsigned x = derr_rng_;
+    if(!x) x = (unsigned)(((unsigned long long)(uintptr_t)&derr_rng_ * 0x9E3779B97F4A7C15ull) >> 32) | 1u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    derr_rng_ = x;
+    return (((unsigned long long)x * rate) >> 32) == 0;
+}
+static DERR_INLINE unsigned derr_level_rate_(derr_level lvl){
+    int i = (int)lvl / 10 - 1;
+    return __atomic_load_n(&derr_g_hot.sample[i < 0 ? 0 : i > 4 ? 4 : i], __ATOMIC_RELAXED);
+}
+#define derr_level_sample_(lvl) derr_sample_(derr_level_rate_(lvl))
+
+#define DERR_LOG_MOD_(mod, lvl, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_FMT_(__VA_ARGS__); \
+    if(derr_module_enabled_(&derr_site_, (mod), (lvl)) && derr_level_sample_(lvl) \
+       && derr_site_allow_(&derr_site_, (lvl))){ \
+        derr_log_site_(&derr_site_, (lvl), __VA_ARGS__); \
+    } \
+} while(0)
+#define DERR_LOG_ERRNO_MOD_(mod, lvl, err, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_FMT_(__VA_ARGS__); \
+    if(derr_module_enabled_(&derr_site_, (mod), (lvl)) && derr_level_sample_(lvl) \
+       && derr_site_allow_(&derr_site_, (lvl))){ \
+        derr_log_errno_site_(&derr_site_, (lvl), (err), __VA_ARGS__); \
+    } \
+} while(0)
+#define DERR_LOG_IF_(lvl, ...)            DERR_LOG_MOD_(DERR_MODULE_NAME, (lvl), __VA_ARGS__)
+#define DERR_LOG_ERRNO_IF_(lvl, err, ...) DERR_LOG_ERRNO_MOD_(DERR_MODULE_NAME, (lvl), (err), __VA_ARGS__)
+#define DERR_LOG_RL_(lvl, burst, per_sec, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_FMT_(__VA_ARGS__); \
+    if(derr_module_enabled_(&derr_site_, DERR_MODULE_NAME, (lvl)) && derr_level_sample_(lvl) \
+       && derr_ratelimit_allow(&derr_site_, (lvl), (burst), (per_sec))){ \
+        derr_log_site_(&derr_site_, (lvl), __VA_ARGS__); \
+    } \
+} while(0)
+#define DERR_LOG_ERRNO_RL_(lvl, burst, per_sec, err, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_FMT_(__VA_ARGS__); \
+    if(derr_module_enabled_(&derr_site_, DERR_MODULE_NAME, (lvl)) && derr_level_sample_(lvl) \
+       && derr_ratelimit_allow(&derr_site_, (lvl), (burst), (per_sec))){ \
+        derr_log_errno_site_(&derr_site_, (lvl), (err), __VA_ARGS__); \
+    } \
+} while(0)
+#define DERR_LOG_SAMPLED_(lvl, rate, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_FMT_(__VA_ARGS__); \
+    if(derr_module_enabled_(&derr_site_, DERR_MODULE_NAME, (lvl))){ \
+        unsigned derr_rate_ = (unsigned)(rate); \
+        if(derr_sample_(derr_rate_) && derr_site_allow_(&derr_site_, (lvl))) \
+            derr_log_sampled_(&derr_site_, derr_rate_, (lvl), __VA_ARGS__); \
+    } \
+} while(0)
+// Modulo esplicito per una singola chiamata (livello a runtime)
+#define DERR_MODULE_LOG(mod, lvl, ...)            DERR_LOG_MOD_((mod), (lvl), __VA_ARGS__)
+#define DERR_MODULE_LOG_ERRNO(mod, lvl, err, ...) DERR_LOG_ERRNO_MOD_((mod), (lvl), (err), __VA_ARGS__)
+#define DERR_DISCARD_(...) do { if(0) printf(__VA_ARGS__); } while(0)
+#define DERR_DISCARD_ERRNO_(err, ...) do { if(0){ (void)(err); printf(__VA_ARGS__); } } while(0)
+#define DERR_DISCARD_SAMPLED_(rate, ...) do { if(0){ (void)(rate); printf(__VA_ARGS__); } } while(0)
+#define DERR_DISCARD_RL_(burst, per_sec, ...) do { if(0){ (void)(burst); (void)(per_sec); printf(__VA_ARGS__); } } while(0)
+#define DERR_DISCARD_ERRNO_RL_(burst, per_sec, err, ...) do { \
+    if(0){ (void)(burst); (void)(per_sec); (void)(err); printf(__VA_ARGS__); } \
+} while(0)
 
-#define DERR_DEBUG_ERRNO(err, ...) derr_log_errno(DERR_DEBUG, (err), __VA_ARGS__)
-#define DERR_INFO_ERRNO(err,  ...) derr_log_errno(DERR_INFO,  (err), __VA_ARGS__)
-#define DERR_WARN_ERRNO(err,  ...) derr_log_errno(DERR_WARN,  (err), __VA_ARGS__)
-#define DERR_ERROR_ERRNO(err, ...) derr_log_errno(DERR_ERROR, (err), __VA_ARGS__)
+// Convenienze. Le varianti _RATELIMITED(burst, per_sec, ...) ammettono al più
+// 'burst' record di fila e poi 'per_sec' al secondo per punto di chiamata;
+// le _SAMPLED(rate, ...) un record ogni 'rate' chiamate in media.
+#if DERR_COMPILE_MIN_LEVEL <= 10
+  #define DERR_DEBUG(...)                       DERR_LOG_IF_(DERR_DEBUG, __VA_ARGS__)
+  #define DERR_DEBUG_ERRNO(err, ...)            DERR_LOG_ERRNO_IF_(DERR_DEBUG, (err), __VA_ARGS__)
+  #define DERR_DEBUG_RATELIMITED(b, r, ...)     DERR_LOG_RL_(DERR_DEBUG, (b), (r), __VA_ARGS__)
+  #define DERR_DEBUG_ERRNO_RATELIMITED(b, r, err, ...) DERR_LOG_ERRNO_RL_(DERR_DEBUG, (b), (r), (err), __VA_ARGS__)
+  #define DERR_DEBUG_SAMPLED(rate, ...)            DERR_LOG_SAMPLED_(DERR_DEBUG, (rate), __VA_ARGS__)
+#else
+  #define DERR_DEBUG(...)                       DERR_DISCARD_(__VA_ARGS__)
+  #define DERR_DEBUG_ERRNO(err, ...)            DERR_DISCARD_ERRNO_((err), __VA_ARGS__)
+  #define DERR_DEBUG_RATELIMITED(b, r, ...)     DERR_DISCARD_RL_((b), (r), __VA_ARGS__)
+  #define DERR_DEBUG_ERRNO_RATELIMITED(b, r, err, ...) DERR_DISCARD_ERRNO_RL_((b), (r), (err), __VA_ARGS__)
+  #define DERR_DEBUG_SAMPLED(rate, ...)            DERR_DISCARD_SAMPLED_((rate), __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 20
+  #define DERR_INFO(...)                       DERR_LOG_IF_(DERR_INFO, __VA_ARGS__)
+  #define DERR_INFO_ERRNO(err, ...)            DERR_LOG_ERRNO_IF_(DERR_INFO, (err), __VA_ARGS__)
+  #define DERR_INFO_RATELIMITED(b, r, ...)     DERR_LOG_RL_(DERR_INFO, (b), (r), __VA_ARGS__)
+  #define DERR_INFO_ERRNO_RATELIMITED(b, r, err, ...) DERR_LOG_ERRNO_RL_(DERR_INFO, (b), (r), (err), __VA_ARGS__)
+  #define DERR_INFO_SAMPLED(rate, ...)             DERR_LOG_SAMPLED_(DERR_INFO, (rate), __VA_ARGS__)
+#else
+  #define DERR_INFO(...)                       DERR_DISCARD_(__VA_ARGS__)
+  #define DERR_INFO_ERRNO(err, ...)            DERR_DISCARD_ERRNO_((err), __VA_ARGS__)
+  #define DERR_INFO_RATELIMITED(b, r, ...)     DERR_DISCARD_RL_((b), (r), __VA_ARGS__)
+  #define DERR_INFO_ERRNO_RATELIMITED(b, r, err, ...) DERR_DISCARD_ERRNO_RL_((b), (r), (err), __VA_ARGS__)
+  #define DERR_INFO_SAMPLED(rate, ...)             DERR_DISCARD_SAMPLED_((rate), __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 30
+  #define DERR_WARN(...)                       DERR_LOG_IF_(DERR_WARN, __VA_ARGS__)
+  #define DERR_WARN_ERRNO(err, ...)            DERR_LOG_ERRNO_IF_(DERR_WARN, (err), __VA_ARGS__)
+  #define DERR_WARN_RATELIMITED(b, r, ...)     DERR_LOG_RL_(DERR_WARN, (b), (r), __VA_ARGS__)
+  #define DERR_WARN_ERRNO_RATELIMITED(b, r, err, ...) DERR_LOG_ERRNO_RL_(DERR_WARN, (b), (r), (err), __VA_ARGS__)
+  #define DERR_WARN_SAMPLED(rate, ...)             DERR_LOG_SAMPLED_(DERR_WARN, (rate), __VA_ARGS__)
+#else
+  #define DERR_WARN(...)                       DERR_DISCARD_(__VA_ARGS__)
+  #define DERR_WARN_ERRNO(err, ...)            DERR_DISCARD_ERRNO_((err), __VA_ARGS__)
+  #define DERR_WARN_RATELIMITED(b, r, ...)     DERR_DISCARD_RL_((b), (r), __VA_ARGS__)
+  #define DERR_WARN_ERRNO_RATELIMITED(b, r, err, ...) DERR_DISCARD_ERRNO_RL_((b), (r), (err), __VA_ARGS__)
+  #define DERR_WARN_SAMPLED(rate, ...)             DERR_DISCARD_SAMPLED_((rate), __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 40
+  #define DERR_ERROR(...)                       DERR_LOG_IF_(DERR_ERROR, __VA_ARGS__)
+  #define DERR_ERROR_ERRNO(err, ...)            DERR_LOG_ERRNO_IF_(DERR_ERROR, (err), __VA_ARGS__)
+  #define DERR_ERROR_RATELIMITED(b, r, ...)     DERR_LOG_RL_(DERR_ERROR, (b), (r), __VA_ARGS__)
+  #define DERR_ERROR_ERRNO_RATELIMITED(b, r, err, ...) DERR_LOG_ERRNO_RL_(DERR_ERROR, (b), (r), (err), __VA_ARGS__)
+  #define DERR_ERROR_SAMPLED(rate, ...)            DERR_LOG_SAMPLED_(DERR_ERROR, (rate), __VA_ARGS__)
+#else
+  #define DERR_ERROR(...)                       DERR_DISCARD_(__VA_ARGS__)
+  #define DERR_ERROR_ERRNO(err, ...)            DERR_DISCARD_ERRNO_((err), __VA_ARGS__)
+  #define DERR_ERROR_RATELIMITED(b, r, ...)     DERR_DISCARD_RL_((b), (r), __VA_ARGS__)
+  #define DERR_ERROR_ERRNO_RATELIMITED(b, r, err, ...) DERR_DISCARD_ERRNO_RL_((b), (r), (err), __VA_ARGS__)
+  #define DERR_ERROR_SAMPLED(rate, ...)            DERR_DISCARD_SAMPLED_((rate), __VA_ARGS__)
+#endif
 
 // Errori fatali (escono dal programma)
 #define DIE(...) do { \
-    derr_log(DERR_FATAL, __VA_ARGS__); \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    derr_log_site_(&derr_site_, DERR_FATAL, __VA_ARGS__); \
     derr_flush(); \
     exit(EXIT_FAILURE); \
 } while(0)
 
 #define DIE_ERRNO(...) do { \
-    derr_log_errno(DERR_FATAL, errno, __VA_ARGS__); \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    derr_log_errno_site_(&derr_site_, DERR_FATAL, errno, __VA_ARGS__); \
     derr_flush(); \
     exit(EXIT_FAILURE); \
 } while(0)
@@ -99,7 +441,8 @@ void derr_log_errno(derr_level lvl, int errnum, const char *fmt, ...) __attribut
 // Assert runtime con messaggio (non disattivabile con NDEBUG)
 #define DASSERT(cond, ...) do { \
     if(!(cond)) { \
-        derr_log_errno(DERR_FATAL, errno, "Assert failed: %s — " __VA_ARGS__, #cond); \
+        static derr_site derr_site_ = DERR_SITE_INIT_; \
+        derr_log_errno_site_(&derr_site_, DERR_FATAL, errno, "Assert failed: %s — " __VA_ARGS__, #cond); \
         derr_flush(); \
         abort(); \
     } \
@@ -108,9 +451,236 @@ void derr_log_errno(derr_level lvl, int errnum, const char *fmt, ...) __attribut
 // Guard per chiamate che ritornano -1 su errore, usa errno corrente
 #define DTRY(expr) do { if(((expr)) == -1) DIE_ERRNO("%s failed", #expr); } while(0)
 
-// Forza flush di tutti gli stream gestiti
+// Forza flush di tutti gli stream gestiti (in modalità asincrona svuota prima la coda)
 void derr_flush(void);
 
+// ----- Sink -----
+// Ogni record, già formattato una volta, viene passato ai sink registrati il
+// cui livello minimo lo ammette. Se nessun sink vuole un livello, il record
+// non viene nemmeno formattato. I sink 0..2 sono quelli predefiniti.
+typedef enum derr_sink_id {
+    DERR_SINK_STDERR,
+    DERR_SINK_FILE,
+    DERR_SINK_SYSLOG
+} derr_sink_id;
+
+typedef struct derr_record {
+    derr_level      level;
+    struct timespec ts;          // timestamp grezzo
+    const char     *ts_str;      // timestamp formattato
+    size_t          ts_len;
+    const char     *msg;         // messaggio dell'utente (non terminato; con escape in JSON/logfmt)
+    size_t          msg_len;
+    int             has_errno;   // errno presente e dettagli abilitati
+    int             errnum;
+    const char     *errstr;      // strerror (non terminato), NULL senza errno
+    size_t          errstr_len;
+    const char     *errname;     // nome simbolico ("ECONNRESET"), NULL se ignoto
+    const char     *file;        // posizione nel sorgente, NULL se assente
+    int             line;
+    const char     *func;
+    unsigned        tid;         // derr_thread_id() del thread che ha emesso il record
+    const char     *text;        // riga completa secondo l'encoder (senza colori, con '\n')
+    size_t          text_len;
+    unsigned        sample_rate; // emesso 1 volta su N chiamate (1 = non campionato)
+} derr_record;
+
+// Flag dei sink
+#define DERR_SINK_THREADSAFE 1u   // write può essere chiamata in parallelo: nessun lock
+#define DERR_SINK_IDLE_FLUSH 2u   // flush chiamata anche dallo scrittore asincrono a coda vuota
+
+typedef struct derr_sink_vtable {
+    void   (*write)(void *ctx, const derr_record *rec);
+    void   (*flush)(void *ctx);    // opzionale: derr_flush()
+    void   (*close)(void *ctx);    // opzionale: derr_remove_sink()
+    unsigned flags;
+} derr_sink_vtable;
+
+#define DERR_MAX_SINKS 16
+
+// Registra un sink; ritorna l'id (>= 0) o -1 (errno = ENOSPC / EINVAL).
+// I sink senza DERR_SINK_THREADSAFE sono serializzati da un lock proprio.
+int  derr_add_sink(const derr_sink_vtable *vt, void *ctx, derr_level min);
+// Rimuove il sink (attende le scritture in corso, poi chiama close).
+// Sui sink predefiniti equivale a disabilitarli.
+int  derr_remove_sink(int id);
+int  derr_set_sink_level(int id, derr_level min);
+void derr_enable_stderr(int enable);     // stderr è attivo di default
+
+// ----- Politica di flush del file -----
+typedef enum derr_flush_mode {
+    DERR_FLUSH_EVERY_RECORD,    // fflush a ogni record (default)
+    DERR_FLUSH_BYTES,           // fflush quando i byte in attesa raggiungono 'bytes'
+    DERR_FLUSH_INTERVAL         // fflush ogni 'interval_ms' da un thread dedicato (POSIX)
+} derr_flush_mode;
+
+typedef struct derr_flush_policy {
+    derr_flush_mode mode;
+    size_t          bytes;            // soglia per DERR_FLUSH_BYTES
+    unsigned        interval_ms;      // periodo per DERR_FLUSH_INTERVAL
+    derr_level      immediate_level;  // da qui in su flush immediato (tipico: DERR_ERROR)
+    int             datasync;         // POSIX: fdatasync() dopo ogni flush (log di audit)
+} derr_flush_policy;
+
+// NULL = politica di default. Il buffer effettivo è quello dello stream
+// (setvbuf prima di derr_set_log_file per soglie oltre BUFSIZ).
+// derr_flush() e quindi DIE/DASSERT scaricano (e sincronizzano) sempre.
+// 0 = ok, -1 = errore (errno)
+int derr_set_file_flush_policy(const derr_flush_policy *pol);
+
+// ----- Sink su file mappato in memoria (POSIX) -----
+// I writer riservano spazio con un fetch‑add sull'offset del segmento e vi
+// copiano la riga: nessuna syscall né lock. A segmento pieno si passa al
+// successivo (<path>.NNNNNN, pre‑allocato in anticipo) e il precedente viene
+// troncato alla lunghezza usata. Ritorna l'id del sink o -1 (errno).
+int derr_add_mmap_sink(const char *path, size_t segment_bytes, derr_level min);
+
+// ----- Log binario (POSIX) -----
+// In modalità binaria il chiamante non esegue vsnprintf: registra solo l'id del
+// formato (il testo del formato viene scritto una volta per stringa), livello,
+// timestamp grezzo, errno e i byte degli argomenti. Il testo si ricostruisce
+// offline con tools/derr-decode. Funziona con le macro DERR_* esistenti.
+// Un file per processo; i sink testuali restano attivi secondo i loro livelli.
+int  derr_binary_open(const char *path, derr_level min);   // 0 = ok, -1 = errore (errno)
+void derr_binary_close(void);
+// Decodifica un flusso binario in righe di testo; 0 = ok, -1 = flusso non valido
+int  derr_binary_decode(FILE *in, FILE *out);
+
+// ----- Flight recorder (POSIX) -----
+// Ogni thread conserva gli ultimi 'records' record (da 'min' in su, anche sotto
+// il livello di output) in un ring proprio, senza lock né sink. Sui FATAL
+// (DIE, DIE_ERRNO, DASSERT) i ring di tutti i thread sono stampati su stderr
+// dopo il backtrace. Messaggi oltre DERR_FLIGHT_MSG byte sono troncati.
+// records = 0 disattiva. 0 = ok, -1 = errore (errno)
+int  derr_flight_recorder_enable(size_t records, derr_level min);
+// Scrive il contenuto dei ring su fd; async‑signal‑safe (usabile da un handler)
+void derr_flight_recorder_dump(int fd);
+
+// ----- Crash handler (POSIX) -----
+// Opzionale: installa handler per SIGSEGV, SIGBUS, SIGFPE, SIGILL e SIGABRT su
+// uno stack alternativo pre‑allocato (del thread chiamante). L'handler non
+// alloca e non prende lock: usa solo write() e backtrace_symbols_fd().
+// Scrive le righe ancora in coda in modalità asincrona, il backtrace e il
+// flight recorder, poi ripristina l'handler precedente e rilancia il segnale.
+// 0 = ok, -1 = errore (errno)
+int derr_install_crash_handler(void);
+
+// ----- stderr non bloccante (POSIX) -----
+// Mette stderr in O_NONBLOCK (vale per tutta la descrizione del file, anche se
+// condivisa con altri processi) con un buffer di riserva di spill_bytes: se il
+// lettore non tiene il passo le righe vanno nel buffer e, a buffer pieno, sono
+// scartate e contate; quando il pipe si svuota viene scritto un avviso con il
+// numero di record persi. I FATAL restano bloccanti. 0 = torna bloccante.
+// 0 = ok, -1 = errore (errno)
+int derr_set_stderr_nonblocking(size_t spill_bytes);
+unsigned long long derr_stderr_dropped(void);
+
+// ----- Sink syslog / journald su socket datagram (POSIX) -----
+// Scrive direttamente sul socket (path NULL = "/dev/log" o il socket del
+// journal) con intestazioni pronte e, in modalità asincrona, più record per
+// sendmmsg(). Il socket è non bloccante: con ENOBUFS/EAGAIN i record vengono
+// scartati e contati, il chiamante non attende. Ritorna l'id del sink o -1 (errno).
+typedef enum derr_syslog_proto {
+    DERR_SYSLOG_RFC3164,   // /dev/log: "<PRI>Mmm dd hh:mm:ss prog[pid]: msg"
+    DERR_SYSLOG_JOURNAL    // /run/systemd/journal/socket: campi KEY=VALUE nativi
+} derr_syslog_proto;
+int derr_add_syslog_socket_sink(const char *path, derr_syslog_proto proto, derr_level min);
+unsigned long long derr_syslog_socket_dropped(int sink);
+
+// ----- Sink di rete (POSIX) -----
+// Ogni record è incorniciato subito (RFC 5424 o GELF 1.1) e copiato in una coda
+// di buffer_bytes (0 = 1 MiB); un thread del sink la spedisce a lotti su una
+// connessione TCP persistente, o in datagrammi UDP, riconnettendosi con backoff
+// esponenziale. A coda piena vale la politica di derr_async_set_overflow(), ma
+// con il collettore irraggiungibile i record nuovi sono scartati anche con
+// DERR_OVERFLOW_BLOCK: derr_log() non resta mai fermo su una rete giù.
+// La connessione è aperta in background. Ritorna l'id del sink o -1 (errno).
+typedef enum derr_net_transport { DERR_NET_TCP, DERR_NET_UDP } derr_net_transport;
+typedef enum derr_net_format {
+    DERR_NET_RFC5424,   // syslog; su TCP con octet counting (RFC 6587)
+    DERR_NET_GELF       // JSON GELF 1.1; su TCP terminato da '\0'
+} derr_net_format;
+int derr_add_net_sink(const char *host, const char *port, derr_net_transport tr,
+                      derr_net_format fmt, size_t buffer_bytes, derr_level min);
+unsigned long long derr_net_dropped(int sink);
+
+// Numero di volte in cui un thread ha trovato occupato il lock del sink
+unsigned long long derr_sink_contention(int sink);
+
+// ----- Modalità asincrona (POSIX) -----
+// I produttori formattano il record e lo accodano in un ring lock‑free
+// limitato; un thread dedicato lo scrive sui sink. I FATAL restano sincroni
+// (dopo aver svuotato la coda) per conservare backtrace e ordine.
+typedef enum derr_overflow {
+    DERR_OVERFLOW_BLOCK,        // il produttore attende uno slot libero
+    DERR_OVERFLOW_DROP_NEWEST,  // scarta il record corrente
+    DERR_OVERFLOW_DROP_OLDEST   // scarta il record più vecchio in coda (il corrente
+                                // se quello è già in mano allo scrittore)
+} derr_overflow;
+
+// capacity viene arrotondata alla potenza di 2 successiva. 0 = ok, -1 = errore (errno)
+int  derr_async_start(size_t capacity);
+void derr_async_stop(void);             // svuota la coda e termina il thread
+void derr_async_set_overflow(derr_overflow policy);
+// Formattazione differita: il chiamante copia solo formato, argomenti (le
+// stringhe per valore), timestamp grezzo e contesto; vsnprintf, timestamp,
+// strerror e encoder girano sul thread scrittore. Vale solo per le macro
+// DERR_* con formato letterale (e per derr.hpp): derr_log() e le altre
+// funzioni, o un formato in una variabile, formattano subito. %ls e long
+// double perdono il dettaglio come nel log binario. Senza modalità asincrona
+// non ha effetto.
+void derr_async_set_deferred(int enable);
+// I messaggi che non stanno nello slot della coda prendono memoria da chunk
+// per thread produttore (bump allocation, nessuna malloc a regime), resi in
+// blocco dallo scrittore. chunk_bytes: dimensione di un chunk (default 64 KiB,
+// i record più grandi vanno su heap); max_bytes: tetto complessivo (default
+// 8 MiB, oltre il messaggio è troncato). 0 = ok, -1 = coda attiva (EBUSY) o
+// valori non validi (EINVAL). Non POSIX: ENOSYS.
+int  derr_async_set_arena(size_t chunk_bytes, size_t max_bytes);
+unsigned long long derr_async_dropped(void);
+
+// ----- fork() e ring condiviso fra processi (POSIX) -----
+// La libreria registra handler pthread_atfork: fork() attende i lock interni
+// (configurazione, coda, sink), che nel figlio ritornano liberi. Nel figlio
+// ripartono scrittore asincrono, flush periodico e thread dei sink di rete;
+// ciò che era in coda nel padre lo scrive il padre. I sink mmap restano del
+// padre: nel figlio sono disattivati.
+//
+// Ring condiviso: chiamata nel processo principale prima dei fork(), mappa
+// una regione anonima condivisa di slots righe da slot_bytes byte (0 = 4096
+// e 1024). Nei figli ogni record già formattato (FATAL esclusi) va nel ring
+// invece che nei loro sink; un thread del principale lo scrive sui propri.
+// Ring pieno: il record è scartato, il figlio non attende mai. Le righe più
+// lunghe di uno slot sono troncate. 0 = ok, -1 con errno: EBUSY (già attivo o
+// processo figlio), EINVAL, ENOMEM. Non POSIX: ENOSYS.
+int  derr_shm_start(size_t slots, size_t slot_bytes);
+void derr_shm_stop(void);               // principale: svuota il ring; figlio: torna ai propri sink
+unsigned long long derr_shm_dropped(void);   // totale di tutti i processi
+
+// ----- Statistiche -----
+// Contatori per thread (il percorso caldo non scrive memoria condivisa),
+// sommati solo da derr_get_stats(). "filtered" conta le chiamate scartate per
+// livello dentro la libreria: le macro DERR_* filtrano prima della chiamata.
+#define DERR_STATS_LEVELS 5                // DEBUG, INFO, WARN, ERROR, FATAL
+typedef struct derr_stats {
+    unsigned long long emitted[DERR_STATS_LEVELS];  // indice: livello / 10 - 1
+    unsigned long long filtered;
+    unsigned long long suppressed;         // rate limiting e duplicati
+    unsigned long long dropped;            // coda asincrona, stderr non bloccante, sink socket e rete, ring condiviso
+    unsigned long long sink_records[DERR_MAX_SINKS];
+    unsigned long long sink_bytes[DERR_MAX_SINKS];  // lunghezza della riga consegnata al sink
+    unsigned long long lock_waits;         // acquisizioni contese dei lock dei sink
+    unsigned long long lock_wait_ns;       // tempo complessivo di attesa su quei lock
+    unsigned long long max_write_ns;       // scrittura su sink più lenta (solo con il timing attivo)
+    unsigned long long arena_bytes;        // memoria dei chunk della coda asincrona (allocata)
+    unsigned long long arena_limit;        // tetto impostato con derr_async_set_arena
+    unsigned long long arena_truncated;    // messaggi troncati per tetto raggiunto
+    unsigned long long arena_heap;         // messaggi più grandi di un chunk, passati da heap
+} derr_stats;
+void derr_get_stats(derr_stats *st);
+// Misura la durata di ogni scrittura sui sink (due letture dell'orologio in più)
+void derr_set_stats_timing(int enable);
+
 #ifdef __cplusplus
 }
 #endif
@@ -136,32 +706,84 @@ extern "C" {
   #include <sys/time.h>
   #include <sys/utsname.h>
   #include <sys/stat.h>
+  #include <sys/uio.h>
+  #include <sys/mman.h>
+  #include <limits.h>
   #include <fcntl.h>
   #include <dlfcn.h>
   #include <signal.h>
   #include <syslog.h>
+  #include <sched.h>
+  #include <poll.h>
+  #include <spawn.h>
+  #include <sys/wait.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <netdb.h>
+  #if defined(__linux__)
+    #include <sys/syscall.h>
+  #endif
 #else
   #define DERR_POSIX 0
 #endif
 
 // Stato globale (minimo e coeso)
+#define DERR_DEFAULT_MAX_MESSAGE (1u << 20)
+
+// Configurazione del percorso caldo: una parola letta con una sola load
+// acquire, così ogni record vede un'istantanea coerente anche se un altro
+// thread sta cambiando impostazioni. I setter la aggiornano con una CAS.
+#define DERR_CFG_COLOR      (1u << 0)
+#define DERR_CFG_UTC        (1u << 1)
+#define DERR_CFG_COARSE     (1u << 2)
+#define DERR_CFG_ERRNO      (1u << 3)    // derr_set_include_errno_details
+#define DERR_CFG_TID        (1u << 4)
+#define DERR_CFG_DEDUP      (1u << 5)
+#define DERR_CFG_SRC        (1u << 6)    // derr_set_source_location
+#define DERR_CFG_DEFER      (1u << 7)    // derr_async_set_deferred
+#define DERR_CFG_TS_SHIFT   8            // derr_ts_format, 4 bit
+#define DERR_CFG_ENC_SHIFT  12           // derr_encoder, 4 bit
+#define DERR_CFG_SHM        (1u << 16)   // processo figlio con ring condiviso (derr_shm_start)
+#define DERR_CFG_TS(c)      ((int)(((c) >> DERR_CFG_TS_SHIFT) & 0xfu))
+#define DERR_CFG_ENC(c)     ((int)(((c) >> DERR_CFG_ENC_SHIFT) & 0xfu))
+
+derr_hot_ derr_g_hot __attribute__((aligned(64))) = {
+    DERR_DEBUG, 0, DERR_DEBUG,
+    DERR_CFG_COLOR | DERR_CFG_ERRNO | ((unsigned)DERR_TS_MS << DERR_CFG_TS_SHIFT)
+        | ((unsigned)DERR_ENC_TEXT << DERR_CFG_ENC_SHIFT),
+    1, { 0 }
+};
+
+static DERR_INLINE unsigned cfg_get(void){ return __atomic_load_n(&derr_g_hot.cfg, __ATOMIC_ACQUIRE); }
+
+static void cfg_set(unsigned mask, unsigned val){
+    unsigned c = __atomic_load_n(&derr_g_hot.cfg, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&derr_g_hot.cfg, &c, (c & ~mask) | (val & mask), 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+}
+
+// Stato scritto di rado; il mutex non condivide la cache line con il percorso caldo
 static struct derr_state {
-    const char *progname;
-    derr_level  min_level;
-    int         color;
-    int         utc;
-    int         include_errno;
+    const char *progname;      // puntatore atomico
+    size_t      max_message;   // tetto per il messaggio formattato (byte)
     FILE       *file;
     int         use_syslog;
+    unsigned    rl_burst;      // rate limit globale (vedi derr_set_default_ratelimit)
+    unsigned    rl_per_sec;
 #if DERR_POSIX
     pthread_mutex_t mu;
 #endif
-} g_derr = { NULL, DERR_DEBUG, 1, 0, 1, NULL, 0
+} g_derr = { NULL, DERR_DEFAULT_MAX_MESSAGE, NULL, 0, 0, 0
 #if DERR_POSIX
 , PTHREAD_MUTEX_INITIALIZER
 #endif
 };
 
+static DERR_INLINE const char *prog_name(void){
+    const char *p = __atomic_load_n(&g_derr.progname, __ATOMIC_ACQUIRE);
+    return p ? p : "program";
+}
+
 static DERR_INLINE const char *level_str(derr_level l){
     switch(l){
         case DERR_DEBUG: return "DEBUG";
@@ -173,8 +795,8 @@ static DERR_INLINE const char *level_str(derr_level l){
     }
 }
 
-static DERR_INLINE const char *level_color(derr_level l){
-    if(!g_derr.color) return "";
+static DERR_INLINE const char *level_color(derr_level l, unsigned cfg){
+    if(!(cfg & DERR_CFG_COLOR)) return "";
     switch(l){
         case DERR_DEBUG: return "\x1b[2m";       // dim
         case DERR_INFO:  return "\x1b[0m";       // reset
@@ -185,18 +807,72 @@ static DERR_INLINE const char *level_color(derr_level l){
     }
 }
 
-static DERR_INLINE const char *color_reset(){ return g_derr.color ? "\x1b[0m" : ""; }
+static DERR_INLINE const char *color_reset(unsigned cfg){ return cfg & DERR_CFG_COLOR ? "\x1b[0m" : ""; }
+
+// Scrive v in decimale su esattamente w cifre (con zeri a sinistra)
+static DERR_INLINE void put_digits(char *p, unsigned long v, int w){
+    while(w-- > 0){ p[w] = (char)('0' + v % 10); v /= 10; }
+}
+
+// Intero senza segno in decimale; ritorna il numero di caratteri scritti
+static size_t put_u64(char *p, unsigned long long v){
+    char tmp[20]; size_t n = 0;
+    do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while(v);
+    for(size_t i = 0; i < n; i++) p[i] = tmp[n - 1 - i];
+    return n;
+}
+
+static void ts_capture(struct timespec *ts, unsigned cfg){
+#if defined(CLOCK_REALTIME_COARSE)
+    if(cfg & DERR_CFG_COARSE){ clock_gettime(CLOCK_REALTIME_COARSE, ts); return; }
+#else
+    (void)cfg;
+#endif
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+// Cache per‑thread della parte "YYYY-MM-DDTHH:MM:SS": localtime_r (che in glibc
+// può prendere il lock del fuso orario) e la conversione servono una volta al
+// secondo; per il resto si riscrivono solo le cifre frazionarie.
+static DERR_TLS struct derr_ts_cache {
+    time_t   sec;
+    unsigned key;      // 1 + utc al momento del calcolo (0 = vuota)
+    char     prefix[20];
+} tl_ts;
 
-static void ts_now(char *buf, size_t n){
-    struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
-    time_t sec = ts.tv_sec; struct tm tmv;
-    if(g_derr.utc) gmtime_r(&sec, &tmv); else localtime_r(&sec, &tmv);
-    // ISO 8601 con millisecondi
-    int ms = (int)(ts.tv_nsec/1000000);
-    snprintf(buf, n, "%04d-%02d-%02dT%02d:%02d:%02d.%03d%s",
-             tmv.tm_year+1900, tmv.tm_mon+1, tmv.tm_mday,
-             tmv.tm_hour, tmv.tm_min, tmv.tm_sec, ms,
-             g_derr.utc?"Z":"");
+// Formatta ts in buf (almeno 40 byte) secondo cfg; ritorna la lunghezza
+static size_t ts_format(const struct timespec *ts, char *buf, unsigned cfg){
+    int fmt = DERR_CFG_TS(cfg);
+    int utc = (cfg & DERR_CFG_UTC) != 0;
+    int digits = (fmt == DERR_TS_NS || fmt == DERR_TS_EPOCH_NS) ? 9
+               : (fmt == DERR_TS_US || fmt == DERR_TS_EPOCH_US) ? 6 : 3;
+    unsigned long frac = (unsigned long)ts->tv_nsec / (digits == 9 ? 1 : digits == 6 ? 1000 : 1000000);
+    size_t n;
+
+    if(fmt >= DERR_TS_EPOCH_MS){
+        n = put_u64(buf, (unsigned long long)ts->tv_sec);
+    } else {
+        unsigned key = 1u + (unsigned)utc;
+        if(tl_ts.sec != ts->tv_sec || tl_ts.key != key){
+            time_t sec = ts->tv_sec; struct tm tmv;
+            if(utc) gmtime_r(&sec, &tmv); else localtime_r(&sec, &tmv);
+            char *p = tl_ts.prefix;
+            put_digits(p, (unsigned long)(tmv.tm_year + 1900), 4); p[4] = '-';
+            put_digits(p + 5, (unsigned long)(tmv.tm_mon + 1), 2); p[7] = '-';
+            put_digits(p + 8, (unsigned long)tmv.tm_mday, 2);      p[10] = 'T';
+            put_digits(p + 11, (unsigned long)tmv.tm_hour, 2);     p[13] = ':';
+            put_digits(p + 14, (unsigned long)tmv.tm_min, 2);      p[16] = ':';
+            put_digits(p + 17, (unsigned long)tmv.tm_sec, 2);
+            tl_ts.sec = ts->tv_sec; tl_ts.key = key;
+        }
+        memcpy(buf, tl_ts.prefix, 19);
+        n = 19;
+    }
+    buf[n++] = '.';
+    put_digits(buf + n, frac, digits); n += (size_t)digits;
+    if(utc && fmt < DERR_TS_EPOCH_MS) buf[n++] = 'Z';
+    buf[n] = 0;
+    return n;
 }
 
 // strerror portabile e thread‑safe in un buffer utente
@@ -211,8 +887,13 @@ static void strerror_portable(int errnum, char *buf, size_t n){
 #endif
 }
 
+// Lock di configurazione (non usato nel percorso di scrittura)
+#if DERR_POSIX
+static void fork_init_once(void);
+#endif
 static void lock(){
 #if DERR_POSIX
+    fork_init_once();
     pthread_mutex_lock(&g_derr.mu);
 #endif
 }
@@ -222,116 +903,4698 @@ static void unlock(){
 #endif
 }
 
-static void vemit(derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
-    if(lvl < g_derr.min_level) return;
+// ---- Statistiche ----
+// Un blocco di contatori per thread, scritto solo dal proprietario (load e
+// store relaxed: nessuna istruzione locked, nessuna cache line condivisa) e
+// sommato da derr_get_stats(). Il blocco di un thread terminato viene adottato
+// dal prossimo thread nuovo: i contatori sono cumulativi e i totali non cambiano.
+struct derr_tstats {
+    unsigned long long  emitted[DERR_STATS_LEVELS];
+    unsigned long long  filtered, suppressed;
+    unsigned long long  sink_records[DERR_MAX_SINKS], sink_bytes[DERR_MAX_SINKS];
+    unsigned long long  lock_waits, lock_wait_ns, max_write_ns;
+    struct derr_tstats *next;
+    int                 used;
+} __attribute__((aligned(64)));
 
-    char tbuf[40]; ts_now(tbuf, sizeof tbuf);
+static struct derr_tstats  g_stats_shared;   // senza TLS distruttibile o memoria: condiviso
+static struct derr_tstats *g_stats_list;
+static int                 g_stats_timing;
+static DERR_TLS struct derr_tstats *tl_stats;
 
-    // Buffer principale per il messaggio formattato dall'utente
-    char msg[2048];
-    vsnprintf(msg, sizeof msg, fmt, ap);
+#if DERR_POSIX
+static pthread_key_t  g_stats_key;
+static pthread_once_t g_stats_once = PTHREAD_ONCE_INIT;
+static void stats_release(void *p){ __atomic_store_n(&((struct derr_tstats *)p)->used, 0, __ATOMIC_RELEASE); }
+static void stats_key_init(void){ pthread_key_create(&g_stats_key, stats_release); }
+#endif
 
-    // Se presente errno, formattalo
-    char ebuf[256] = {0};
-    if(has_errno && g_derr.include_errno){
-        strerror_portable(errnum, ebuf, sizeof ebuf);
+static struct derr_tstats *stats_attach(void){
+#if DERR_POSIX
+    pthread_once(&g_stats_once, stats_key_init);
+    struct derr_tstats *t;
+    for(t = __atomic_load_n(&g_stats_list, __ATOMIC_ACQUIRE); t; t = t->next){
+        int zero = 0;
+        if(!__atomic_load_n(&t->used, __ATOMIC_RELAXED)
+           && __atomic_compare_exchange_n(&t->used, &zero, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+    if(!t){
+        void *mem = NULL;
+        if(posix_memalign(&mem, 64, sizeof *t) != 0) return tl_stats = &g_stats_shared;
+        t = (struct derr_tstats *)mem;
+        memset(t, 0, sizeof *t);
+        t->used = 1;
+        struct derr_tstats *top = __atomic_load_n(&g_stats_list, __ATOMIC_ACQUIRE);
+        do t->next = top;
+        while(!__atomic_compare_exchange_n(&g_stats_list, &top, t, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
     }
+    pthread_setspecific(g_stats_key, t);
+    return tl_stats = t;
+#else
+    return tl_stats = &g_stats_shared;
+#endif
+}
 
-    const char *pname = g_derr.progname ? g_derr.progname : "program";
-    const char *c = level_color(lvl);
-    const char *r = color_reset();
+static DERR_INLINE struct derr_tstats *stats_tl(void){ return tl_stats ? tl_stats : stats_attach(); }
 
-    lock();
+static DERR_INLINE void stat_add(unsigned long long *c, unsigned long long v){
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
 
-    // Stampa su stderr
-    if(has_errno && g_derr.include_errno)
-        fprintf(stderr, "%s%s%s [%s] %s: %s (errno=%d)\n", c, tbuf, r, level_str(lvl), pname, msg, errnum);
-    else
-        fprintf(stderr, "%s%s%s [%s] %s: %s\n", c, tbuf, r, level_str(lvl), pname, msg);
+static DERR_INLINE void stat_level(unsigned long long *c, derr_level lvl){
+    int i = (int)lvl / 10 - 1;
+    stat_add(&c[i < 0 ? 0 : i >= DERR_STATS_LEVELS ? DERR_STATS_LEVELS - 1 : i], 1);
+}
 
-    if(has_errno && g_derr.include_errno)
-        fprintf(stderr, "%s        -> %s%s\n", c, ebuf, r);
+static unsigned long long stats_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+}
 
-    // File opzionale
-    if(g_derr.file){
-        if(has_errno && g_derr.include_errno)
-            fprintf(g_derr.file, "%s [%s] %s: %s (errno=%d)\n        -> %s\n", tbuf, level_str(lvl), pname, msg, errnum, ebuf);
-        else
-            fprintf(g_derr.file, "%s [%s] %s: %s\n", tbuf, level_str(lvl), pname, msg);
-        fflush(g_derr.file);
-    }
+// Lock per‑sink, ciascuno sulla propria cache line, con contatore di contesa
+struct derr_lock {
+#if DERR_POSIX
+    pthread_mutex_t    mu;
+#endif
+    unsigned long long contended;
+} __attribute__((aligned(64)));
 
+static void dlock(struct derr_lock *l){
 #if DERR_POSIX
-    // Syslog opzionale
-    if(g_derr.use_syslog){
-        int sl;
-        switch(lvl){
-            case DERR_DEBUG: sl = LOG_DEBUG; break;
-            case DERR_INFO:  sl = LOG_INFO; break;
-            case DERR_WARN:  sl = LOG_WARNING; break;
-            case DERR_ERROR: sl = LOG_ERR; break;
-            case DERR_FATAL: sl = LOG_CRIT; break;
-            default: sl = LOG_INFO; break;
-        }
-        if(has_errno && g_derr.include_errno)
-            syslog(sl, "%s: %s (errno=%d) -> %s", pname, msg, errnum, ebuf);
-        else
-            syslog(sl, "%s: %s", pname, msg);
+    if(pthread_mutex_trylock(&l->mu) != 0){
+        __atomic_fetch_add(&l->contended, 1, __ATOMIC_RELAXED);
+        struct derr_tstats *t = stats_tl();
+        unsigned long long t0 = stats_ns();
+        pthread_mutex_lock(&l->mu);
+        stat_add(&t->lock_waits, 1);
+        stat_add(&t->lock_wait_ns, stats_ns() - t0);
     }
+#else
+    (void)l;
+#endif
+}
+static void dunlock(struct derr_lock *l){
+#if DERR_POSIX
+    pthread_mutex_unlock(&l->mu);
+#else
+    (void)l;
 #endif
+}
 
-    // Backtrace sui FATAL (dove disponibile)
-#if DERR_POSIX && defined(EXECINFO_H) || (defined(__linux__) && !defined(__ANDROID__))
-    if(lvl >= DERR_FATAL){
-        void *bt[128];
-        int n = backtrace(bt, 128);
-        if(n > 0){
-            fprintf(stderr, "%sBacktrace (%d frames):%s\n", c, n, r);
-            backtrace_symbols_fd(bt, n, fileno(stderr));
-            fputc('\n', stderr);
-        }
-    }
+// Atomiche (builtin GCC/Clang: valide sia in C sia in C++)
+#define DERR_LOAD(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DERR_STORE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define DERR_FADD(p, v)    __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define DERR_CAS(p, e, d)  __atomic_compare_exchange_n((p), (e), (d), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+// Per gli handshake store→load fra due thread ("pubblico X, poi guardo Y"):
+// release/acquire non li ordina, seq_cst sì
+#define DERR_LOAD_SC(p)     __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define DERR_STORE_SC(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+// ---- Cache di strerror ----
+// errno → (messaggio, nome simbolico), popolata alla prima occorrenza di ogni
+// valore e letta senza lock. Una voce invalidata (cambio di locale) viene
+// sostituita ma non liberata: un lettore potrebbe averla ancora in mano.
+#define DERR_ERRNO_CACHE 256
+
+static const struct derr_errname { int num; const char *name; } g_errnames[] = {
+#ifdef EPERM
+    { EPERM, "EPERM" },
 #endif
+#ifdef ENOENT
+    { ENOENT, "ENOENT" },
+#endif
+#ifdef ESRCH
+    { ESRCH, "ESRCH" },
+#endif
+#ifdef EINTR
+    { EINTR, "EINTR" },
+#endif
+#ifdef EIO
+    { EIO, "EIO" },
+#endif
+#ifdef ENXIO
+    { ENXIO, "ENXIO" },
+#endif
+#ifdef E2BIG
+    { E2BIG, "E2BIG" },
+#endif
+#ifdef ENOEXEC
+    { ENOEXEC, "ENOEXEC" },
+#endif
+#ifdef EBADF
+    { EBADF, "EBADF" },
+#endif
+#ifdef ECHILD
+    { ECHILD, "ECHILD" },
+#endif
+#ifdef EAGAIN
+    { EAGAIN, "EAGAIN" },
+#endif
+#ifdef ENOMEM
+    { ENOMEM, "ENOMEM" },
+#endif
+#ifdef EACCES
+    { EACCES, "EACCES" },
+#endif
+#ifdef EFAULT
+    { EFAULT, "EFAULT" },
+#endif
+#ifdef ENOTBLK
+    { ENOTBLK, "ENOTBLK" },
+#endif
+#ifdef EBUSY
+    { EBUSY, "EBUSY" },
+#endif
+#ifdef EEXIST
+    { EEXIST, "EEXIST" },
+#endif
+#ifdef EXDEV
+    { EXDEV, "EXDEV" },
+#endif
+#ifdef ENODEV
+    { ENODEV, "ENODEV" },
+#endif
+#ifdef ENOTDIR
+    { ENOTDIR, "ENOTDIR" },
+#endif
+#ifdef EISDIR
+    { EISDIR, "EISDIR" },
+#endif
+#ifdef EINVAL
+    { EINVAL, "EINVAL" },
+#endif
+#ifdef ENFILE
+    { ENFILE, "ENFILE" },
+#endif
+#ifdef EMFILE
+    { EMFILE, "EMFILE" },
+#endif
+#ifdef ENOTTY
+    { ENOTTY, "ENOTTY" },
+#endif
+#ifdef ETXTBSY
+    { ETXTBSY, "ETXTBSY" },
+#endif
+#ifdef EFBIG
+    { EFBIG, "EFBIG" },
+#endif
+#ifdef ENOSPC
+    { ENOSPC, "ENOSPC" },
+#endif
+#ifdef ESPIPE
+    { ESPIPE, "ESPIPE" },
+#endif
+#ifdef EROFS
+    { EROFS, "EROFS" },
+#endif
+#ifdef EMLINK
+    { EMLINK, "EMLINK" },
+#endif
+#ifdef EPIPE
+    { EPIPE, "EPIPE" },
+#endif
+#ifdef EDOM
+    { EDOM, "EDOM" },
+#endif
+#ifdef ERANGE
+    { ERANGE, "ERANGE" },
+#endif
+#ifdef EDEADLK
+    { EDEADLK, "EDEADLK" },
+#endif
+#ifdef ENAMETOOLONG
+    { ENAMETOOLONG, "ENAMETOOLONG" },
+#endif
+#ifdef ENOLCK
+    { ENOLCK, "ENOLCK" },
+#endif
+#ifdef ENOSYS
+    { ENOSYS, "ENOSYS" },
+#endif
+#ifdef ENOTEMPTY
+    { ENOTEMPTY, "ENOTEMPTY" },
+#endif
+#ifdef ELOOP
+    { ELOOP, "ELOOP" },
+#endif
+#ifdef ENOMSG
+    { ENOMSG, "ENOMSG" },
+#endif
+#ifdef EIDRM
+    { EIDRM, "EIDRM" },
+#endif
+#ifdef ENOSTR
+    { ENOSTR, "ENOSTR" },
+#endif
+#ifdef ENODATA
+    { ENODATA, "ENODATA" },
+#endif
+#ifdef ETIME
+    { ETIME, "ETIME" },
+#endif
+#ifdef ENOSR
+    { ENOSR, "ENOSR" },
+#endif
+#ifdef ENOLINK
+    { ENOLINK, "ENOLINK" },
+#endif
+#ifdef EPROTO
+    { EPROTO, "EPROTO" },
+#endif
+#ifdef EMULTIHOP
+    { EMULTIHOP, "EMULTIHOP" },
+#endif
+#ifdef EBADMSG
+    { EBADMSG, "EBADMSG" },
+#endif
+#ifdef EOVERFLOW
+    { EOVERFLOW, "EOVERFLOW" },
+#endif
+#ifdef EILSEQ
+    { EILSEQ, "EILSEQ" },
+#endif
+#ifdef EUSERS
+    { EUSERS, "EUSERS" },
+#endif
+#ifdef ENOTSOCK
+    { ENOTSOCK, "ENOTSOCK" },
+#endif
+#ifdef EDESTADDRREQ
+    { EDESTADDRREQ, "EDESTADDRREQ" },
+#endif
+#ifdef EMSGSIZE
+    { EMSGSIZE, "EMSGSIZE" },
+#endif
+#ifdef EPROTOTYPE
+    { EPROTOTYPE, "EPROTOTYPE" },
+#endif
+#ifdef ENOPROTOOPT
+    { ENOPROTOOPT, "ENOPROTOOPT" },
+#endif
+#ifdef EPROTONOSUPPORT
+    { EPROTONOSUPPORT, "EPROTONOSUPPORT" },
+#endif
+#ifdef ESOCKTNOSUPPORT
+    { ESOCKTNOSUPPORT, "ESOCKTNOSUPPORT" },
+#endif
+#ifdef EOPNOTSUPP
+    { EOPNOTSUPP, "EOPNOTSUPP" },
+#endif
+#ifdef EPFNOSUPPORT
+    { EPFNOSUPPORT, "EPFNOSUPPORT" },
+#endif
+#ifdef EAFNOSUPPORT
+    { EAFNOSUPPORT, "EAFNOSUPPORT" },
+#endif
+#ifdef EADDRINUSE
+    { EADDRINUSE, "EADDRINUSE" },
+#endif
+#ifdef EADDRNOTAVAIL
+    { EADDRNOTAVAIL, "EADDRNOTAVAIL" },
+#endif
+#ifdef ENETDOWN
+    { ENETDOWN, "ENETDOWN" },
+#endif
+#ifdef ENETUNREACH
+    { ENETUNREACH, "ENETUNREACH" },
+#endif
+#ifdef ENETRESET
+    { ENETRESET, "ENETRESET" },
+#endif
+#ifdef ECONNABORTED
+    { ECONNABORTED, "ECONNABORTED" },
+#endif
+#ifdef ECONNRESET
+    { ECONNRESET, "ECONNRESET" },
+#endif
+#ifdef ENOBUFS
+    { ENOBUFS, "ENOBUFS" },
+#endif
+#ifdef EISCONN
+    { EISCONN, "EISCONN" },
+#endif
+#ifdef ENOTCONN
+    { ENOTCONN, "ENOTCONN" },
+#endif
+#ifdef ESHUTDOWN
+    { ESHUTDOWN, "ESHUTDOWN" },
+#endif
+#ifdef ETOOMANYREFS
+    { ETOOMANYREFS, "ETOOMANYREFS" },
+#endif
+#ifdef ETIMEDOUT
+    { ETIMEDOUT, "ETIMEDOUT" },
+#endif
+#ifdef ECONNREFUSED
+    { ECONNREFUSED, "ECONNREFUSED" },
+#endif
+#ifdef EHOSTDOWN
+    { EHOSTDOWN, "EHOSTDOWN" },
+#endif
+#ifdef EHOSTUNREACH
+    { EHOSTUNREACH, "EHOSTUNREACH" },
+#endif
+#ifdef EALREADY
+    { EALREADY, "EALREADY" },
+#endif
+#ifdef EINPROGRESS
+    { EINPROGRESS, "EINPROGRESS" },
+#endif
+#ifdef ESTALE
+    { ESTALE, "ESTALE" },
+#endif
+#ifdef EDQUOT
+    { EDQUOT, "EDQUOT" },
+#endif
+#ifdef ECANCELED
+    { ECANCELED, "ECANCELED" },
+#endif
+#ifdef EOWNERDEAD
+    { EOWNERDEAD, "EOWNERDEAD" },
+#endif
+#ifdef ENOTRECOVERABLE
+    { ENOTRECOVERABLE, "ENOTRECOVERABLE" },
+#endif
+#ifdef ENOTSUP
+    { ENOTSUP, "ENOTSUP" },
+#endif
+#ifdef EWOULDBLOCK
+    { EWOULDBLOCK, "EWOULDBLOCK" },
+#endif
+#ifdef EDEADLOCK
+    { EDEADLOCK, "EDEADLOCK" },
+#endif
+};
 
-    unlock();
+// Nome simbolico (prima voce della tabella per i sinonimi); solo letture di
+// dati statici, quindi usabile anche da un signal handler
+static const char *errno_name(int e){
+    for(size_t i = 0; i < sizeof g_errnames / sizeof g_errnames[0]; i++)
+        if(g_errnames[i].num == e) return g_errnames[i].name;
+    return NULL;
 }
 
-// ---- Implementazioni API ----
-void derr_set_program_name(const char *name){ g_derr.progname = name; }
-void derr_set_min_level(derr_level lvl){ g_derr.min_level = lvl; }
-void derr_enable_color(int enable){ g_derr.color = enable ? 1 : 0; }
-void derr_set_timestamp_utc(int use_utc){ g_derr.utc = use_utc ? 1 : 0; }
-void derr_set_log_file(FILE *fp){ g_derr.file = fp; }
-void derr_set_include_errno_details(int enable){ g_derr.include_errno = enable ? 1 : 0; }
+struct derr_errent {
+    unsigned    gen;
+    const char *name;
+    size_t      len;
+    char       *msg;       // segue la struttura nella stessa allocazione
+};
 
-void derr_use_syslog(int enable){
-#if DERR_POSIX
-    if(enable && !g_derr.use_syslog){
-        openlog(g_derr.progname ? g_derr.progname : "program", LOG_CONS|LOG_PID, LOG_USER);
-        g_derr.use_syslog = 1;
-    } else if(!enable && g_derr.use_syslog){
-        closelog(); g_derr.use_syslog = 0;
+static struct derr_errent *g_errtab[DERR_ERRNO_CACHE];
+static unsigned g_err_gen = 1;
+
+static const struct derr_errent *errno_info(int e){
+    if(e < 0 || e >= DERR_ERRNO_CACHE) return NULL;
+    unsigned gen = DERR_LOAD(&g_err_gen);
+    struct derr_errent *cur = DERR_LOAD(&g_errtab[e]);
+    if(cur && cur->gen == gen) return cur;
+
+    char tmp[256];
+    strerror_portable(e, tmp, sizeof tmp);
+    size_t len = strlen(tmp);
+    struct derr_errent *n = (struct derr_errent *)malloc(sizeof *n + len + 1);
+    if(!n) return NULL;
+    n->gen = gen; n->name = errno_name(e); n->len = len;
+    n->msg = (char *)(n + 1);
+    memcpy(n->msg, tmp, len + 1);
+    if(!DERR_CAS(&g_errtab[e], &cur, n)){
+        // Un altro thread ha appena inserito la voce: vale la sua
+        free(n);
+        return cur;
     }
-#else
-    (void)enable; // no‑op su non POSIX
+    return n;
+}
+
+// Record già formattato, pronto per i sink. La riga completa (testo semplice)
+// è assemblata una sola volta:
+//   <ts> [<LVL>] <prog>: <msg>[ (errno=N[ NOME])]\n[        -> <strerror>\n]
+// Gli offset permettono di produrre la variante a colori senza riformattare.
+// Con gli encoder JSON e logfmt la riga è una sola (detail_off == len, ts_len == 0).
+// Il buffer parte da una zona inline (nessuna malloc nel caso comune) e
+// cresce geometricamente solo se un messaggio non ci sta.
+struct derr_rec {
+    derr_record pub;         // vista per i sink (valida dopo rec_fill)
+    derr_level lvl;
+    int        show_errno;   // errno presente e dettagli abilitati
+    int        errnum;
+    int        enc;          // derr_encoder usato per la riga
+    unsigned   cfg;          // istantanea della configurazione (colori per stderr)
+    int        owned;        // line è su heap (1), in un chunk dell'arena (2) o inline (0)
+    int        arena;        // cresce nell'arena del thread (slot della coda asincrona)
+    struct derr_achunk *chunk;   // chunk che contiene line se owned == 2
+    size_t     ts_len;       // line[0, ts_len) = timestamp
+    size_t     msg_off;      // line[msg_off, msg_off+msg_len) = messaggio utente
+    size_t     msg_len;
+    size_t     detail_off;   // inizio riga "-> strerror" (== len se assente)
+    size_t     len;
+    size_t     cap;
+    char      *line;
+};
+
+// Spazio riservato dopo il messaggio per il suffisso errno e strerror
+#define DERR_LINE_TAIL 320
+
+static void rec_init(struct derr_rec *r, char *inl, size_t n){
+    r->line = inl; r->cap = n; r->owned = 0; r->len = 0; r->arena = 0; r->chunk = NULL;
+}
+
+#if DERR_POSIX
+static int  arena_reserve(struct derr_rec *r, size_t need);
+static void arena_free(struct derr_achunk *c, size_t n);
+#endif
+
+// Riporta il record al buffer inline liberando l'eventuale heap
+static void rec_reset(struct derr_rec *r, char *inl, size_t n){
+    int arena = r->arena;
+    if(r->owned == 1) free(r->line);
+#if DERR_POSIX
+    else if(r->owned == 2) arena_free(r->chunk, r->cap);
 #endif
+    rec_init(r, inl, n);
+    r->arena = arena;
 }
 
-void derr_log(derr_level lvl, const char *fmt, ...){
-    va_list ap; va_start(ap, fmt); vemit(lvl, 0, 0, fmt, ap); va_end(ap);
+// Garantisce cap >= need; 0 se l'allocazione fallisce (si tronca)
+static int rec_reserve(struct derr_rec *r, size_t need){
+    if(need <= r->cap) return 1;
+#if DERR_POSIX
+    if(r->arena && r->owned != 1) return arena_reserve(r, need);
+#endif
+    size_t nc = r->cap * 2;
+    if(nc < need) nc = need;
+    char *p;
+    if(r->owned){
+        p = (char *)realloc(r->line, nc);
+        if(!p) return 0;
+    } else {
+        p = (char *)malloc(nc);
+        if(!p) return 0;
+        memcpy(p, r->line, r->len);
+    }
+    r->line = p; r->cap = nc; r->owned = 1;
+    return 1;
 }
 
-void derr_log_errno(derr_level lvl, int errnum, const char *fmt, ...){
-    va_list ap; va_start(ap, fmt); vemit(lvl, 1, errnum, fmt, ap); va_end(ap);
+static DERR_INLINE void rec_put(struct derr_rec *r, const char *s, size_t n){
+    if(!rec_reserve(r, r->len + n + 1)) n = r->cap - 1 - r->len;
+    memcpy(r->line + r->len, s, n); r->len += n;
 }
+static DERR_INLINE void rec_puts(struct derr_rec *r, const char *s){ rec_put(r, s, strlen(s)); }
 
-void derr_flush(void){
-    lock();
-    fflush(stderr);
-    if(g_derr.file) fflush(g_derr.file);
-    unlock();
+static const char g_hex[] = "0123456789abcdef";
+
+// Stringa con escape JSON (", \ e caratteri di controllo; UTF‑8 invariato)
+static void rec_put_json(struct derr_rec *r, const char *s, size_t n){
+    size_t run = 0;
+    for(size_t i = 0; i < n; i++){
+        unsigned char c = (unsigned char)s[i];
+        if(c >= 0x20 && c != '"' && c != '\\') continue;
+        rec_put(r, s + run, i - run);
+        run = i + 1;
+        char e[6] = { '\\', 0, 0, 0, 0, 0 };
+        switch(c){
+            case '"':  e[1] = '"';  rec_put(r, e, 2); break;
+            case '\\': e[1] = '\\'; rec_put(r, e, 2); break;
+            case '\n': e[1] = 'n';  rec_put(r, e, 2); break;
+            case '\r': e[1] = 'r';  rec_put(r, e, 2); break;
+            case '\t': e[1] = 't';  rec_put(r, e, 2); break;
+            default:
+                e[1] = 'u'; e[2] = '0'; e[3] = '0'; e[4] = g_hex[c >> 4]; e[5] = g_hex[c & 15];
+                rec_put(r, e, 6);
+                break;
+        }
+    }
+    rec_put(r, s + run, n - run);
 }
 
+static int json_clean(const char *s, size_t n){
+    for(size_t i = 0; i < n; i++){
+        unsigned char c = (unsigned char)s[i];
+        if(c < 0x20 || c == '"' || c == '\\') return 0;
+    }
+    return 1;
+}
+
+// Valore logfmt: tra virgolette (con escape) solo se contiene spazi, '=' o '"'
+static void rec_put_logfmt(struct derr_rec *r, const char *s, size_t n){
+    int quote = n == 0;
+    for(size_t i = 0; i < n && !quote; i++){
+        unsigned char c = (unsigned char)s[i];
+        quote = c <= ' ' || c == '"' || c == '=' || c == '\\';
+    }
+    if(!quote){ rec_put(r, s, n); return; }
+    rec_put(r, "\"", 1); rec_put_json(r, s, n); rec_put(r, "\"", 1);
+}
+
+static void rec_put_i64(struct derr_rec *r, long long v){
+    char b[24]; size_t k = 0;
+    if(v < 0){ b[k++] = '-'; k += put_u64(b + k, 0ull - (unsigned long long)v); }
+    else k = put_u64(b, (unsigned long long)v);
+    rec_put(r, b, k);
+}
+
+// Interi esatti senza snprintf; altrimenti la rappresentazione più corta fra
+// %.15g e %.17g che rilegge lo stesso valore
+static void rec_put_double(struct derr_rec *r, double d, int json){
+    if(d != d){ rec_puts(r, json ? "null" : "NaN"); return; }
+    if(d - d != 0){ rec_puts(r, json ? "null" : d > 0 ? "+Inf" : "-Inf"); return; }
+    if(d > -1e15 && d < 1e15 && d == (double)(long long)d){ rec_put_i64(r, (long long)d); return; }
+    char b[32];
+    int n = snprintf(b, sizeof b, "%.15g", d);
+    if(strtod(b, NULL) != d) n = snprintf(b, sizeof b, "%.17g", d);
+    if(n > 0) rec_put(r, b, (size_t)n);
+}
+
+static void rec_put_value(struct derr_rec *r, const derr_kv *kv, int enc){
+    switch(kv->type){
+        case DERR_KV_T_INT:    rec_put_i64(r, kv->v.i); break;
+        case DERR_KV_T_UINT: { char b[24]; rec_put(r, b, put_u64(b, kv->v.u)); break; }
+        case DERR_KV_T_DOUBLE: rec_put_double(r, kv->v.d, enc == DERR_ENC_JSON); break;
+        case DERR_KV_T_BOOL:   rec_puts(r, kv->v.i ? "true" : "false"); break;
+        case DERR_KV_T_STR:
+            if(!kv->v.s){ rec_puts(r, enc == DERR_ENC_JSON ? "null" : "(null)"); break; }
+            if(enc == DERR_ENC_JSON){
+                rec_put(r, "\"", 1); rec_put_json(r, kv->v.s, strlen(kv->v.s)); rec_put(r, "\"", 1);
+            } else rec_put_logfmt(r, kv->v.s, strlen(kv->v.s));
+            break;
+        default: rec_puts(r, "null"); break;
+    }
+}
+
+// " chiave=valore" per ogni campo (TEXT e logfmt)
+static void rec_put_fields(struct derr_rec *r, const derr_kv *kv, size_t n, int enc){
+    for(size_t i = 0; i < n; i++){
+        if(!kv[i].key) continue;
+        if(enc == DERR_ENC_JSON){
+            rec_put(r, ",\"", 2); rec_put_json(r, kv[i].key, strlen(kv[i].key)); rec_put(r, "\":", 2);
+        } else {
+            rec_put(r, " ", 1); rec_puts(r, kv[i].key); rec_put(r, "=", 1);
+        }
+        rec_put_value(r, &kv[i], enc);
+    }
+}
+
+// ---- Contesto per thread e id del thread ----
+// Ogni campo è reso subito in due forme: " k=v" (TEXT e logfmt) e ,"k":v
+// (JSON); rec_build copia la forma che serve con un solo memcpy.
+#ifndef DERR_CTX_BYTES
+#define DERR_CTX_BYTES 512
+#endif
+#ifndef DERR_CTX_DEPTH
+#define DERR_CTX_DEPTH 16
+#endif
+
+static DERR_TLS struct derr_ctx {
+    int    depth;
+    size_t txt_len, json_len;
+    size_t txt_mark[DERR_CTX_DEPTH], json_mark[DERR_CTX_DEPTH];
+    char   txt[DERR_CTX_BYTES];
+    char   json[DERR_CTX_BYTES + DERR_CTX_BYTES / 4];
+} tl_ctx;
+
+static DERR_TLS unsigned tl_tid;
+static unsigned g_next_tid;
+
+static DERR_INLINE unsigned thread_id(void){
+    if(!tl_tid) tl_tid = DERR_FADD(&g_next_tid, 1) + 1;
+    return tl_tid;
+}
+
+static int ctx_push(const derr_kv *kv){
+    struct derr_ctx *c = &tl_ctx;
+    if(c->depth >= DERR_CTX_DEPTH){ errno = ENOSPC; return -1; }
+    char inl[DERR_CTX_BYTES + DERR_CTX_BYTES / 4];
+    struct derr_rec t;
+    rec_init(&t, inl, sizeof inl);
+    rec_put_fields(&t, kv, 1, DERR_ENC_TEXT);
+    size_t tl = t.len;
+    int ok = !t.owned && tl + c->txt_len <= sizeof c->txt;
+    if(ok) memcpy(c->txt + c->txt_len, t.line, tl);
+    t.len = 0;
+    rec_put_fields(&t, kv, 1, DERR_ENC_JSON);
+    ok = ok && !t.owned && t.len + c->json_len <= sizeof c->json;
+    if(ok) memcpy(c->json + c->json_len, t.line, t.len);
+    size_t jl = t.len;
+    rec_reset(&t, inl, sizeof inl);
+    if(!ok){ errno = ENOSPC; return -1; }
+    c->txt_mark[c->depth] = c->txt_len; c->json_mark[c->depth] = c->json_len;
+    c->depth++;
+    c->txt_len += tl; c->json_len += jl;
+    return 0;
+}
+
+// Messaggio dell'utente, formattato direttamente nel buffer della riga (o
+// copiato se app == NULL). Se non ci sta si cresce una volta sola (fino a
+// max_message) e si riprova. Ritorna 1 se troncato.
+static int rec_put_msg(struct derr_rec *r, const char *fmt, va_list *app){
+    r->msg_off = r->len;
+    size_t maxm = __atomic_load_n(&g_derr.max_message, __ATOMIC_RELAXED);
+    if(!app){
+        size_t n = strlen(fmt);
+        int trunc = n > maxm;
+        if(trunc) n = maxm;
+        rec_put(r, fmt, n);
+        r->msg_len = r->len - r->msg_off;
+        return trunc || r->msg_len < n;
+    }
+    size_t room = r->cap > r->len + DERR_LINE_TAIL ? r->cap - r->len - DERR_LINE_TAIL : 0;
+    if(room > maxm + 1) room = maxm + 1;
+    va_list aq; va_copy(aq, *app);
+    int m = vsnprintf(r->line + r->len, room, fmt, aq);
+    va_end(aq);
+    if(m < 0) m = 0;
+    size_t want = (size_t)m;
+    int trunc = want > maxm;
+    if(trunc) want = maxm;
+    if(want >= room && rec_reserve(r, r->len + want + 1 + DERR_LINE_TAIL)){
+        room = want + 1;
+        vsnprintf(r->line + r->len, room, fmt, *app);
+    }
+    r->msg_len = want < room ? want : (room ? room - 1 : 0);
+    if(r->msg_len < (size_t)m) trunc = 1;
+    r->len += r->msg_len;
+    return trunc;
+}
+
+// Sostituisce line[off, len) con la sua versione con escape JSON; il caso
+// comune (nessun carattere da proteggere) non copia nulla
+static void rec_escape_tail(struct derr_rec *r, size_t off){
+    size_t n = r->len - off;
+    if(json_clean(r->line + off, n)) return;
+    char tmp[512];
+    char *raw = n <= sizeof tmp ? tmp : (char *)malloc(n);
+    if(!raw){ r->len = off; return; }
+    memcpy(raw, r->line + off, n);
+    r->len = off;
+    rec_put_json(r, raw, n);
+    if(raw != tmp) free(raw);
+}
+
+// Ciò che rec_build prende dal thread chiamante: per i record a formattazione
+// differita (modalità asincrona) è catturato dal produttore
+struct derr_origin {
+    struct timespec ts;
+    unsigned        tid;
+    unsigned        cfg;
+    const char     *ctx;       // contesto MDC già nella forma dell'encoder di cfg
+    size_t          ctx_len;
+};
+
+// Assembla il record con l'encoder corrente. fmt è un formato printf se
+// app != NULL, altrimenti il messaggio letterale; kv/nkv i campi strutturati;
+// site il punto di chiamata (NULL per i record interni e le funzioni dirette),
+// sample il tasso di campionamento (0/1 = nessuno); o NULL = thread corrente.
+static void rec_build_at(struct derr_rec *r, const struct derr_origin *o, const derr_site *site, unsigned sample,
+                         derr_level lvl, int has_errno, int errnum,
+                         const char *fmt, va_list *app, const derr_kv *kv, size_t nkv){
+    unsigned cfg = o ? o->cfg : cfg_get();
+    int enc = DERR_CFG_ENC(cfg);
+    r->lvl = lvl;
+    r->show_errno = has_errno && (cfg & DERR_CFG_ERRNO);
+    r->errnum = errnum;
+    r->enc = enc;
+    r->cfg = cfg;
+    const char *prog = prog_name();
+    const struct derr_errent *ei = r->show_errno ? errno_info(errnum) : NULL;
+    char num[24]; size_t nk = 0;
+    if(r->show_errno){
+        if(errnum < 0){ num[nk++] = '-'; nk += put_u64(num + nk, (unsigned long long)-(long long)errnum); }
+        else nk = put_u64(num, (unsigned long long)errnum);
+    }
+    char ebuf[256];
+    const char *es = NULL; size_t elen = 0;
+    if(r->show_errno){
+        if(ei){ es = ei->msg; elen = ei->len; }
+        else { strerror_portable(errnum, ebuf, sizeof ebuf); es = ebuf; elen = strlen(ebuf); }
+    }
+    size_t es_off = 0, es_len = 0;
+
+    unsigned tid = o ? o->tid : thread_id();
+    int show_tid = (cfg & DERR_CFG_TID) != 0;
+    char tidb[24]; size_t tidn = put_u64(tidb, tid);
+    const char *ctx = o ? o->ctx : enc == DERR_ENC_JSON ? tl_ctx.json : tl_ctx.txt;
+    size_t ctx_len = o ? o->ctx_len : enc == DERR_ENC_JSON ? tl_ctx.json_len : tl_ctx.txt_len;
+    int show_src = site && (cfg & DERR_CFG_SRC);
+    char lineb[24]; size_t linen = show_src ? put_u64(lineb, (unsigned long long)(unsigned)site->line) : 0;
+    char smpb[24]; size_t smpn = sample > 1 ? put_u64(smpb, sample) : 0;
+
+    struct timespec now;
+    if(o) now = o->ts; else ts_capture(&now, cfg);
+    r->len = 0;
+    rec_reserve(r, 128);
+    size_t ts_off = 0, ts_n;
+
+    if(enc == DERR_ENC_JSON){
+        rec_put(r, "{\"ts\":\"", 7);
+        ts_off = r->len;
+        ts_n = ts_format(&now, r->line + r->len, cfg); r->len += ts_n;
+        rec_put(r, "\",\"level\":\"", 11); rec_puts(r, level_str(lvl));
+        rec_put(r, "\",\"prog\":\"", 10); rec_put_json(r, prog, strlen(prog));
+        if(show_tid){ rec_put(r, "\",\"tid\":", 8); rec_put(r, tidb, tidn); rec_put(r, ",\"msg\":\"", 8); }
+        else rec_put(r, "\",\"msg\":\"", 9);
+        int trunc = rec_put_msg(r, fmt, app);
+        rec_escape_tail(r, r->msg_off);
+        r->msg_len = r->len - r->msg_off;
+        if(trunc) rec_put(r, "...", 3);
+        rec_put(r, "\"", 1);
+        if(r->show_errno){
+            rec_put(r, ",\"errno\":", 9); rec_put(r, num, nk);
+            if(ei && ei->name){ rec_put(r, ",\"errname\":\"", 12); rec_puts(r, ei->name); rec_put(r, "\"", 1); }
+            rec_put(r, ",\"error\":\"", 10);
+            es_off = r->len; rec_put_json(r, es, elen); es_len = r->len - es_off;
+            rec_put(r, "\"", 1);
+        }
+        if(show_src){
+            rec_put(r, ",\"file\":\"", 9); rec_put_json(r, site->file, strlen(site->file));
+            rec_put(r, "\",\"line\":", 9); rec_put(r, lineb, linen);
+            rec_put(r, ",\"func\":\"", 9); rec_put_json(r, site->func, strlen(site->func));
+            rec_put(r, "\"", 1);
+        }
+        rec_put(r, ctx, ctx_len);
+        rec_put_fields(r, kv, nkv, enc);
+        if(smpn){ rec_put(r, ",\"sample_rate\":", 15); rec_put(r, smpb, smpn); }
+        rec_put(r, "}\n", 2);
+        r->ts_len = 0;
+        r->detail_off = r->len;
+    } else if(enc == DERR_ENC_LOGFMT){
+        rec_put(r, "ts=", 3);
+        ts_off = r->len;
+        ts_n = ts_format(&now, r->line + r->len, cfg); r->len += ts_n;
+        rec_put(r, " level=", 7); rec_puts(r, level_str(lvl));
+        rec_put(r, " prog=", 6); rec_put_logfmt(r, prog, strlen(prog));
+        if(show_tid){ rec_put(r, " tid=", 5); rec_put(r, tidb, tidn); }
+        rec_put(r, " msg=\"", 6);
+        int trunc = rec_put_msg(r, fmt, app);
+        rec_escape_tail(r, r->msg_off);
+        r->msg_len = r->len - r->msg_off;
+        if(trunc) rec_put(r, "...", 3);
+        rec_put(r, "\"", 1);
+        if(r->show_errno){
+            rec_put(r, " errno=", 7); rec_put(r, num, nk);
+            if(ei && ei->name){ rec_put(r, " errname=", 9); rec_puts(r, ei->name); }
+            rec_put(r, " error=\"", 8);
+            es_off = r->len; rec_put_json(r, es, elen); es_len = r->len - es_off;
+            rec_put(r, "\"", 1);
+        }
+        if(show_src){
+            rec_put(r, " file=", 6); rec_put_logfmt(r, site->file, strlen(site->file));
+            rec_put(r, " line=", 6); rec_put(r, lineb, linen);
+            rec_put(r, " func=", 6); rec_put_logfmt(r, site->func, strlen(site->func));
+        }
+        rec_put(r, ctx, ctx_len);
+        rec_put_fields(r, kv, nkv, enc);
+        if(smpn){ rec_put(r, " sample_rate=", 13); rec_put(r, smpb, smpn); }
+        rec_put(r, "\n", 1);
+        r->ts_len = 0;
+        r->detail_off = r->len;
+    } else {
+        r->len = r->ts_len = ts_n = ts_format(&now, r->line, cfg);
+        rec_put(r, " [", 2);
+        rec_puts(r, level_str(lvl));
+        rec_put(r, "] ", 2);
+        rec_puts(r, prog);
+        if(show_tid){ rec_put(r, "[", 1); rec_put(r, tidb, tidn); rec_put(r, "]", 1); }
+        rec_put(r, ": ", 2);
+        if(show_src){
+            rec_puts(r, site->file); rec_put(r, ":", 1); rec_put(r, lineb, linen); rec_put(r, ": ", 2);
+        }
+        if(rec_put_msg(r, fmt, app)) rec_put(r, "...", 3);
+        rec_put(r, ctx, ctx_len);
+        rec_put_fields(r, kv, nkv, enc);
+        if(smpn){ rec_put(r, " sample_rate=", 13); rec_put(r, smpb, smpn); }
+        if(r->show_errno){
+            rec_put(r, " (errno=", 8); rec_put(r, num, nk);
+            if(ei && ei->name){ rec_put(r, " ", 1); rec_puts(r, ei->name); }
+            rec_put(r, ")", 1);
+        }
+        rec_put(r, "\n", 1);
+        r->detail_off = r->len;
+        if(r->show_errno){
+            rec_put(r, "        -> ", 11);
+            es_off = r->len; rec_put(r, es, elen); es_len = r->len - es_off;
+            rec_put(r, "\n", 1);
+        }
+    }
+    r->line[r->len] = 0;
+
+    derr_record *p = &r->pub;
+    p->level = lvl;
+    p->ts = now;
+    p->ts_str = r->line + ts_off; p->ts_len = ts_n;
+    p->msg = r->line + r->msg_off; p->msg_len = r->msg_len;
+    p->has_errno = r->show_errno; p->errnum = errnum;
+    p->errstr = r->show_errno ? r->line + es_off : NULL;
+    p->errstr_len = es_len;
+    p->errname = ei ? ei->name : NULL;
+    if(site){ p->file = site->file; p->line = site->line; p->func = site->func; }
+    else { p->file = NULL; p->line = 0; p->func = NULL; }
+    p->tid = tid;
+    p->text = r->line; p->text_len = r->len;
+    p->sample_rate = sample > 1 ? sample : 1;
+}
+
+static void rec_build(struct derr_rec *r, const derr_site *site, unsigned sample, derr_level lvl, int has_errno,
+                      int errnum, const char *fmt, va_list *app, const derr_kv *kv, size_t nkv){
+    rec_build_at(r, NULL, site, sample, lvl, has_errno, errnum, fmt, app, kv, nkv);
+}
+
+static void rec_fill(struct derr_rec *r, derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
+    va_list aq; va_copy(aq, ap);
+    rec_build(r, NULL, 0, lvl, has_errno, errnum, fmt, &aq, NULL, 0);
+    va_end(aq);
+}
+
+// Scrive i frammenti su fd con una sola writev() (ripete solo se parziale)
+#if DERR_POSIX
+static void write_iov(int fd, struct iovec *iov, int cnt){
+    while(cnt > 0){
+        ssize_t w = writev(fd, iov, cnt);
+        if(w < 0){ if(errno == EINTR) continue; return; }
+        while(cnt > 0 && (size_t)w >= iov->iov_len){ w -= (ssize_t)iov->iov_len; iov++; cnt--; }
+        if(cnt > 0){ iov->iov_base = (char *)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+}
+#define DERR_IOV(v, i, p, n) ((v)[i].iov_base = (void *)(p), (v)[i].iov_len = (n))
+#endif
+
+// ---- stderr non bloccante ----
+// Stato protetto dal lock del sink stderr. Il buffer di riserva è lineare:
+// [off, off+len) in attesa di essere scritto.
+#if DERR_POSIX
+static struct derr_nb {
+    int                on;
+    int                blocking;     // temporaneamente bloccante (FATAL, disattivazione)
+    int                saved_flags;  // flag di stderr prima dell'attivazione
+    char              *buf;
+    size_t             cap, off, len;
+    unsigned long long pending;      // scartati non ancora notificati
+    unsigned long long dropped;      // totale scartati
+} g_nb;
+
+// Scrive quanto possibile del buffer di riserva; 1 se è vuoto
+static int nb_pump(void){
+    while(g_nb.len){
+        ssize_t w = write(STDERR_FILENO, g_nb.buf + g_nb.off, g_nb.len);
+        if(w < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            g_nb.len = 0; break;     // errore vero: niente da recuperare
+        }
+        g_nb.off += (size_t)w; g_nb.len -= (size_t)w;
+    }
+    g_nb.off = 0;
+    return 1;
+}
+
+// Accoda al buffer i frammenti a partire dal byte skip; 0 se non c'è spazio
+static int nb_spill(const struct iovec *v, int cnt, size_t skip){
+    size_t n = 0;
+    for(int i = 0; i < cnt; i++) n += v[i].iov_len;
+    n -= skip;
+    if(g_nb.off + g_nb.len + n > g_nb.cap){
+        if(g_nb.len + n > g_nb.cap) return 0;
+        memmove(g_nb.buf, g_nb.buf + g_nb.off, g_nb.len);
+        g_nb.off = 0;
+    }
+    char *d = g_nb.buf + g_nb.off + g_nb.len;
+    for(int i = 0; i < cnt; i++){
+        size_t l = v[i].iov_len;
+        const char *b = (const char *)v[i].iov_base;
+        if(skip >= l){ skip -= l; continue; }
+        b += skip; l -= skip; skip = 0;
+        memcpy(d, b, l); d += l;
+    }
+    g_nb.len += n;
+    return 1;
+}
+
+static void write_stderr(const struct derr_rec *rec);
+
+// Buffer svuotato dopo delle perdite: avviso con il conteggio
+static void nb_notice(void){
+    if(g_nb.len || !g_nb.pending) return;
+    unsigned long long n = g_nb.pending;
+    g_nb.pending = 0;
+    char inl[256];
+    struct derr_rec r; rec_init(&r, inl, sizeof inl);
+    char msg[80]; size_t k = put_u64(msg, n);
+    memcpy(msg + k, " record scartati: stderr non pronto", 36);
+    rec_build(&r, NULL, 0, DERR_WARN, 0, 0, msg, NULL, NULL, 0);
+    write_stderr(&r);
+    rec_reset(&r, inl, sizeof inl);
+}
+
+static void nb_writev(struct iovec *v, int cnt){
+    size_t total = 0;
+    for(int i = 0; i < cnt; i++) total += v[i].iov_len;
+    if(!nb_pump()){
+        if(!nb_spill(v, cnt, 0)){ g_nb.pending++; DERR_FADD(&g_nb.dropped, 1); }
+        return;
+    }
+    ssize_t w;
+    do w = writev(STDERR_FILENO, v, cnt); while(w < 0 && errno == EINTR);
+    if(w < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK) return;
+        w = 0;
+    }
+    if((size_t)w < total && !nb_spill(v, cnt, (size_t)w)){
+        // Riga già iniziata: la si chiude per non incollarla alla successiva
+        if(w > 0){ struct iovec nl; DERR_IOV(&nl, 0, "\n", 1); nb_spill(&nl, 1, 0); }
+        g_nb.pending++; DERR_FADD(&g_nb.dropped, 1);
+        return;
+    }
+    nb_notice();
+}
+
+static void stderr_writev(struct iovec *v, int cnt){
+    if(g_nb.on && !g_nb.blocking) nb_writev(v, cnt);
+    else write_iov(STDERR_FILENO, v, cnt);
+}
+
+// Torna (temporaneamente) bloccante e svuota il buffer di riserva
+static void nb_block(int on){
+    if(!g_nb.on) return;
+    int fl = fcntl(STDERR_FILENO, F_GETFL);
+    if(on){
+        g_nb.blocking = 1;
+        if(fl >= 0) fcntl(STDERR_FILENO, F_SETFL, fl & ~O_NONBLOCK);
+        if(g_nb.len){
+            struct iovec v; DERR_IOV(&v, 0, g_nb.buf + g_nb.off, g_nb.len);
+            write_iov(STDERR_FILENO, &v, 1);
+            g_nb.off = g_nb.len = 0;
+        }
+    } else {
+        if(fl >= 0) fcntl(STDERR_FILENO, F_SETFL, fl | O_NONBLOCK);
+        g_nb.blocking = 0;
+    }
+}
+
+// Attende (al più ms) che il buffer di riserva venga scritto
+static void nb_drain_wait(int ms){
+    while(g_nb.on && !nb_pump() && ms > 0){
+        struct pollfd pf; pf.fd = STDERR_FILENO; pf.events = POLLOUT; pf.revents = 0;
+        int t = ms < 20 ? ms : 20;
+        poll(&pf, 1, t);
+        ms -= t;
+    }
+    if(g_nb.on) nb_notice();
+}
+#endif
+
+static void write_stderr(const struct derr_rec *rec){
+    const char *c = rec->enc == DERR_ENC_TEXT ? level_color(rec->lvl, rec->cfg) : "";
+    const char *r = color_reset(rec->cfg);
+    const char *ln = rec->line;
+    size_t ts = rec->ts_len, dt = rec->detail_off, len = rec->len;
+#if DERR_POSIX
+    struct iovec v[8]; int k = 0;
+    if(*c){
+        DERR_IOV(v, k, c, strlen(c)); k++;
+        DERR_IOV(v, k, ln, ts); k++;
+        DERR_IOV(v, k, r, strlen(r)); k++;
+        DERR_IOV(v, k, ln + ts, dt - ts); k++;
+        if(dt < len){
+            // la riga di dettaglio è colorata per intero, '\n' dopo il reset
+            DERR_IOV(v, k, c, strlen(c)); k++;
+            DERR_IOV(v, k, ln + dt, len - 1 - dt); k++;
+            DERR_IOV(v, k, r, strlen(r)); k++;
+            DERR_IOV(v, k, "\n", 1); k++;
+        }
+    } else {
+        DERR_IOV(v, k, ln, len); k++;
+    }
+    stderr_writev(v, k);
+#else
+    if(*c){
+        fprintf(stderr, "%s%.*s%s%.*s", c, (int)ts, ln, r, (int)(dt - ts), ln + ts);
+        if(dt < len) fprintf(stderr, "%s%.*s%s\n", c, (int)(len - 1 - dt), ln + dt, r);
+    } else {
+        fwrite(ln, 1, len, stderr);
+    }
+#endif
+}
+
+// ---- Registro dei sink ----
+struct derr_sink {
+    struct derr_lock        lk;
+    const derr_sink_vtable *vt;
+    void                   *ctx;
+    int                     min;        // livello minimo del sink
+    int                     active;
+    int                     builtin;    // mai chiuso: niente conteggio inflight
+    int                     inflight;   // write e flush in corso (sink_pin)
+};
+
+static struct derr_sink g_sinks[DERR_MAX_SINKS];
+static int              g_nsinks;      // slot usati (gli attivi hanno active=1)
+
+// Stato del log binario (vedi "Log binario" più sotto)
+struct derr_fmt_ent {
+    const char *fmt;      // chiave (puntatore al formato), NULL = libera
+    unsigned    id;
+    int         ready;    // record di definizione già scritto
+};
+#define DERR_FMT_TABLE 4096
+
+static struct derr_binlog {
+    int                  fd;        // -1 = chiuso
+    int                  min;
+    unsigned             next_id;
+    struct derr_fmt_ent *tab;
+    __attribute__((aligned(64))) int inflight;   // scritture in corso (vedi close)
+} g_bin = { -1, DERR_FATAL + 1, 0, NULL, 0 };
+
+// Flight recorder: ring per‑thread in una lista globale, mai liberati. Il ring
+// di un thread terminato resta leggibile; oltre DERR_FLIGHT_RINGS ring i nuovi
+// thread riusano quelli dei thread terminati.
+#ifndef DERR_FLIGHT_MSG
+#define DERR_FLIGHT_MSG 224
+#endif
+#ifndef DERR_FLIGHT_RINGS
+#define DERR_FLIGHT_RINGS 64
+#endif
+
+struct derr_fr_slot {
+    unsigned long long seq;      // posizione + 1 a scrittura completata (0 = in corso)
+    int64_t            sec;
+    uint32_t           nsec;
+    unsigned char      lvl;
+    unsigned char      has_errno;
+    uint16_t           len;
+    int32_t            errnum;
+    char               msg[DERR_FLIGHT_MSG];
+};
+
+struct derr_fr_ring {
+    struct derr_fr_ring *next;
+    int                  used;     // assegnato a un thread vivo
+    unsigned             id;       // derr_thread_id() del proprietario
+    size_t               n;
+    unsigned long long   head;     // record scritti (solo il proprietario scrive)
+    struct derr_fr_slot *slot;
+};
+
+static struct derr_flight {
+    size_t               n;        // 0 = disattivato
+    int                  min;
+    unsigned             nrings;
+    long                 tz_off;   // scarto dell'ora locale (s), per il dump
+    struct derr_fr_ring *rings;
+} g_fr = { 0, DERR_FATAL + 1, 0, 0, NULL };
+
+// Minimo effettivo = max(livello globale, minimo fra i sink attivi): ciò che
+// sta sotto non viene formattato e le macro non valutano gli argomenti.
+// Il log binario abbassa la soglia generale ma non quella testuale.
+static int g_user_min = DERR_DEBUG;
+
+static void thresholds(int user, int *eff_out, int *text_out){
+    int lo = DERR_FATAL + 1;
+    for(int i = 0; i < g_nsinks; i++)
+        if(__atomic_load_n(&g_sinks[i].active, __ATOMIC_RELAXED) && g_sinks[i].min < lo) lo = g_sinks[i].min;
+    // FATAL passa sempre: DIE/DASSERT devono comunque arrivare a vemit()
+    if(lo > DERR_FATAL) lo = DERR_FATAL;
+    int text = user > lo ? user : lo;
+    int eff = text;
+    if(__atomic_load_n(&g_bin.fd, __ATOMIC_RELAXED) >= 0){
+        int b = user > g_bin.min ? user : g_bin.min;
+        if(b < eff) eff = b;
+    }
+    // Il flight recorder cattura anche sotto il livello globale
+    if(__atomic_load_n(&g_fr.n, __ATOMIC_RELAXED) && g_fr.min < eff) eff = g_fr.min;
+    *eff_out = eff; *text_out = text;
+}
+
+// Chiamata con lock(): ogni cambio invalida le soglie in cache nei derr_site
+static void recompute_threshold(void){
+    int eff, text;
+    thresholds(g_user_min, &eff, &text);
+    __atomic_store_n(&derr_g_hot.text_min, text, __ATOMIC_RELAXED);
+    __atomic_store_n(&derr_g_hot.min_level, eff, __ATOMIC_RELAXED);
+    unsigned gen = __atomic_load_n(&derr_g_hot.mod_gen, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&derr_g_hot.mod_gen, gen ? gen : 1, __ATOMIC_RELEASE);   // 0 = site mai risolto
+}
+
+// ---- Livelli per modulo ----
+// Tabella piccola, letta solo quando un derr_site deve risolvere di nuovo.
+static struct derr_module {
+    char name[DERR_MODULE_NAME_MAX];
+    int  level;
+} g_mods[DERR_MODULE_MAX];
+static int g_nmods;
+
+static int mod_find(const char *name){
+    for(int i = 0; i < g_nmods; i++) if(!strcmp(g_mods[i].name, name)) return i;
+    return -1;
+}
+
+static void mods_env_load(void);   // DERR_LEVELS, una volta
+
+// Livello da nome ("debug", "WARN", "warning", "30"); -1 se ignoto
+static int level_parse(const char *s, size_t n){
+    static const struct { const char *name; int lvl; } names[] = {
+        {"debug", DERR_DEBUG}, {"info", DERR_INFO}, {"warn", DERR_WARN}, {"warning", DERR_WARN},
+        {"error", DERR_ERROR}, {"fatal", DERR_FATAL}
+    };
+    if(n && s[0] >= '0' && s[0] <= '9'){
+        int v = 0;
+        for(size_t i = 0; i < n; i++){
+            if(s[i] < '0' || s[i] > '9' || v > 1000) return -1;
+            v = v * 10 + (s[i] - '0');
+        }
+        return v;
+    }
+    for(size_t k = 0; k < sizeof names / sizeof names[0]; k++){
+        size_t i = 0;
+        for(; i < n && names[k].name[i]; i++){
+            char c = s[i];
+            if(c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+            if(c != names[k].name[i]) break;
+        }
+        if(i == n && !names[k].name[i]) return names[k].lvl;
+    }
+    return -1;
+}
+
+// Chiamata con lock()
+static int mod_set(const char *name, size_t n, int lvl){
+    if(!n || n >= DERR_MODULE_NAME_MAX){ errno = EINVAL; return -1; }
+    char key[DERR_MODULE_NAME_MAX];
+    memcpy(key, name, n); key[n] = 0;
+    int i = mod_find(key);
+    if(i < 0){
+        if(g_nmods >= DERR_MODULE_MAX){ errno = ENOSPC; return -1; }
+        i = g_nmods++;
+        memcpy(g_mods[i].name, key, n + 1);
+    }
+    g_mods[i].level = lvl;
+    return 0;
+}
+
+
+static void write_backtrace(derr_level lvl);
+static void fr_dump_fd(int fd);
+static void crash_fatal_reported(void);
+
+#if DERR_POSIX
+static int syslog_prio(derr_level lvl){
+    switch(lvl){
+        case DERR_DEBUG: return LOG_DEBUG;
+        case DERR_INFO:  return LOG_INFO;
+        case DERR_WARN:  return LOG_WARNING;
+        case DERR_ERROR: return LOG_ERR;
+        case DERR_FATAL: return LOG_CRIT;
+        default:         return LOG_INFO;
+    }
+}
+#endif
+
+static void syslog_sink_write(void *ctx, const derr_record *p){
+    (void)ctx;
+#if DERR_POSIX
+    // "<prog>: <msg> (errno=N) -> strerror" ricavato dalla riga
+    const struct derr_rec *rec = (const struct derr_rec *)p;
+    derr_level lvl = rec->lvl;
+    int sl = syslog_prio(lvl);
+    if(rec->enc != DERR_ENC_TEXT){ syslog(sl, "%.*s", (int)(rec->len - 1), rec->line); return; }
+    const char *body = rec->line + rec->ts_len + 4 + strlen(level_str(lvl)); // salta " [LVL] "
+    int blen = (int)(rec->detail_off - 1 - (size_t)(body - rec->line));
+    if(p->errstr)
+        syslog(sl, "%.*s -> %.*s", blen, body, (int)p->errstr_len, p->errstr);
+    else
+        syslog(sl, "%.*s", blen, body);
+#else
+    (void)p;
+#endif
+}
+
+static void stderr_sink_write(void *ctx, const derr_record *p){
+    (void)ctx;
+    const struct derr_rec *rec = (const struct derr_rec *)p;
+    struct derr_lock *lk = &g_sinks[DERR_SINK_STDERR].lk;
+    // Senza lock se la writev è atomica (<= PIPE_BUF, margine per i codici
+    // colore); i FATAL tengono il lock anche per il backtrace
+    // In modalità non bloccante il buffer di riserva richiede sempre il lock
+#if DERR_POSIX
+    int need_lock = rec->lvl >= DERR_FATAL || rec->len + 32 > PIPE_BUF || DERR_LOAD(&g_nb.on);
+#else
+    int need_lock = 1;
+#endif
+    if(need_lock) dlock(lk);
+    if(rec->lvl >= DERR_FATAL){
+#if DERR_POSIX
+        nb_block(1);
+#endif
+        write_stderr(rec);
+        write_backtrace(rec->lvl);
+        fr_dump_fd(STDERR_FILENO);
+        crash_fatal_reported();
+#if DERR_POSIX
+        nb_block(0);
+#endif
+    } else {
+        write_stderr(rec);
+    }
+    if(need_lock) dunlock(lk);
+}
+
+static void stderr_sink_flush(void *ctx){
+    (void)ctx;
+    fflush(stderr);
+#if DERR_POSIX
+    nb_drain_wait(200);
+#endif
+}
+
+// File opzionale: una fwrite della riga semplice; il flush (un solo write())
+// segue la politica configurata. Stato protetto dal lock del sink file.
+static struct derr_file_state {
+    derr_flush_policy pol;
+    size_t            pending;       // byte scritti dopo l'ultimo flush
+    int               flusher;       // thread periodico attivo
+    int               flusher_stop;
+} g_file = { { DERR_FLUSH_EVERY_RECORD, 0, 0, DERR_ERROR, 0 }, 0, 0, 0 };
+
+static void file_do_flush(FILE *f){
+    fflush(f);
+#if DERR_POSIX && defined(__APPLE__)
+    if(g_file.pol.datasync) fsync(fileno(f));
+#elif DERR_POSIX
+    if(g_file.pol.datasync) fdatasync(fileno(f));
+#endif
+    g_file.pending = 0;
+}
+
+// ---- Rotazione del file gestito (derr_open_log_file) ----
+// Tutto sotto il lock del sink file, tranne la richiesta di riapertura (un flag)
+// e la compressione, che gira su un thread a parte.
+static struct derr_rotate {
+    char    *path;          // NULL = file fornito dall'utente (o assente)
+    size_t   max_bytes;
+    unsigned max_age;
+    unsigned keep;
+    int      compress;
+    size_t   size;          // byte nel file corrente
+    time_t   opened;
+    int      reopen;        // impostato da derr_reopen_log_file() / SIGHUP
+#if DERR_POSIX
+    int              gz_running;
+    int              gz_done;       // impostato dal thread a compressione finita
+    pthread_t        gz_th;
+    char            *gz_file;
+    int              sighup;
+    struct sigaction old_hup;
+#endif
+} g_rot;
+
+#if DERR_POSIX
+extern char **environ;
+
+static void *rot_gzip_main(void *arg){
+    char *file = (char *)arg;
+    char *argv[] = { (char *)"gzip", (char *)"-f", (char *)"--", file, NULL };
+    pid_t pid;
+    if(posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ) == 0){
+        int st;
+        while(waitpid(pid, &st, 0) < 0 && errno == EINTR){}
+    }
+    DERR_STORE(&g_rot.gz_done, 1);
+    return NULL;
+}
+
+static void rot_gzip_wait(void){
+    if(!g_rot.gz_running) return;
+    pthread_join(g_rot.gz_th, NULL);
+    free(g_rot.gz_file); g_rot.gz_file = NULL;
+    g_rot.gz_running = 0;
+}
+
+// 1 se una compressione è ancora in corso; quella finita è raccolta senza attese
+static int rot_gzip_busy(void){
+    if(!g_rot.gz_running) return 0;
+    if(!DERR_LOAD(&g_rot.gz_done)) return 1;
+    rot_gzip_wait();
+    return 0;
+}
+#endif
+
+static FILE *rot_open(const char *path, size_t *size){
+#if DERR_POSIX
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) return NULL;
+    FILE *f = fdopen(fd, "a");
+    if(!f){ close(fd); return NULL; }
+    struct stat st;
+    *size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+#else
+    FILE *f = fopen(path, "a");
+    if(!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long pos = ftell(f);
+    *size = pos > 0 ? (size_t)pos : 0;
+#endif
+    return f;
+}
+
+// Sostituisce il file corrente con uno appena aperto su path (se si riesce)
+static void rot_swap(void){
+    size_t sz;
+    FILE *nf = rot_open(g_rot.path, &sz);
+    if(!nf) return;
+    FILE *old = g_derr.file;
+    if(old){ file_do_flush(old); fclose(old); }
+    g_derr.file = nf;
+    g_rot.size = sz;
+    g_rot.opened = time(NULL);
+}
+
+static void rot_name(char *buf, size_t n, unsigned i, int gz){
+    snprintf(buf, n, "%s.%u%s", g_rot.path, i, gz ? ".gz" : "");
+}
+
+static void rot_rotate(void){
+    char a[4096], b[4096];
+    if(g_derr.file) file_do_flush(g_derr.file);
+    if(!g_rot.keep){
+        remove(g_rot.path);
+    } else {
+        for(int gz = 0; gz < 2; gz++){ rot_name(a, sizeof a, g_rot.keep, gz); remove(a); }
+        for(unsigned i = g_rot.keep - 1; i >= 1; i--)
+            for(int gz = 0; gz < 2; gz++){
+                rot_name(a, sizeof a, i, gz); rot_name(b, sizeof b, i + 1, gz);
+                rename(a, b);
+            }
+        rot_name(a, sizeof a, 1, 0);
+        rename(g_rot.path, a);
+    }
+    rot_swap();
+#if DERR_POSIX
+    if(g_rot.compress && g_rot.keep){
+        g_rot.gz_file = (char *)malloc(strlen(a) + 1);
+        if(g_rot.gz_file){
+            memcpy(g_rot.gz_file, a, strlen(a) + 1);
+            g_rot.gz_done = 0;
+            g_rot.gz_running = pthread_create(&g_rot.gz_th, NULL, rot_gzip_main, g_rot.gz_file) == 0;
+            if(!g_rot.gz_running){ free(g_rot.gz_file); g_rot.gz_file = NULL; }
+        }
+    }
+#endif
+}
+
+// Prima della scrittura di len byte: riapertura richiesta o rotazione dovuta
+static void rot_check(const derr_record *p){
+    if(__atomic_exchange_n(&g_rot.reopen, 0, __ATOMIC_ACQ_REL)){ rot_swap(); return; }
+    if((g_rot.max_bytes && g_rot.size && g_rot.size + p->text_len > g_rot.max_bytes)
+       || (g_rot.max_age && p->ts.tv_sec - g_rot.opened >= (time_t)g_rot.max_age)){
+#if DERR_POSIX
+        // Con gzip ancora su .1 (che alla fine rimuove per nome) i rename non si
+        // possono fare: la rotazione slitta a un record successivo, senza attese
+        if(rot_gzip_busy()) return;
+#endif
+        rot_rotate();
+    }
+}
+
+// Rilascia il file gestito (chiamata con il lock del sink file)
+static void rot_release(void){
+    if(!g_rot.path) return;
+    if(g_derr.file){ file_do_flush(g_derr.file); fclose(g_derr.file); g_derr.file = NULL; }
+#if DERR_POSIX
+    rot_gzip_wait();
+#endif
+    free(g_rot.path); g_rot.path = NULL;
+}
+
+static void file_sink_write(void *ctx, const derr_record *p){
+    (void)ctx;
+    if(g_rot.path) rot_check(p);
+    FILE *f = g_derr.file;
+    if(!f) return;
+    fwrite(p->text, 1, p->text_len, f);
+    g_file.pending += p->text_len;
+    g_rot.size += p->text_len;
+    if(g_file.pol.mode == DERR_FLUSH_EVERY_RECORD || p->level >= g_file.pol.immediate_level
+       || (g_file.pol.mode == DERR_FLUSH_BYTES && g_file.pending >= g_file.pol.bytes))
+        file_do_flush(f);
+}
+
+static void file_sink_flush(void *ctx){
+    (void)ctx;
+    if(g_derr.file) file_do_flush(g_derr.file);
+#if DERR_POSIX
+    (void)rot_gzip_busy();
+#endif
+}
+
+static const derr_sink_vtable g_stderr_vt = { stderr_sink_write, stderr_sink_flush, NULL, DERR_SINK_THREADSAFE };
+static const derr_sink_vtable g_file_vt   = { file_sink_write,   file_sink_flush,   NULL, 0 };
+static const derr_sink_vtable g_syslog_vt = { syslog_sink_write, NULL,              NULL, DERR_SINK_THREADSAFE };
+
+// I predefiniti occupano gli slot 0..2 fin dall'avvio (solo stderr attivo)
+static void sinks_init(void){
+    const derr_sink_vtable *vts[3] = { &g_stderr_vt, &g_file_vt, &g_syslog_vt };
+#if DERR_POSIX
+    for(int i = 0; i < DERR_MAX_SINKS; i++) pthread_mutex_init(&g_sinks[i].lk.mu, NULL);
+#endif
+    for(int i = 0; i < 3; i++){
+        g_sinks[i].vt = vts[i];
+        g_sinks[i].min = DERR_DEBUG;
+        g_sinks[i].builtin = 1;
+    }
+    g_sinks[DERR_SINK_STDERR].active = 1;
+    __atomic_store_n(&g_nsinks, 3, __ATOMIC_RELEASE);
+#if DERR_POSIX
+    fork_init_once();
+#endif
+}
+
+#if DERR_POSIX
+static pthread_once_t g_sinks_once = PTHREAD_ONCE_INIT;
+static void sinks_init_once(void){ pthread_once(&g_sinks_once, sinks_init); }
+#else
+static void sinks_init_once(void){ if(!g_nsinks) sinks_init(); }
+#endif
+
+// Un sink dell'utente può essere rimosso (close, vt e ctx azzerati) mentre un
+// altro thread lo sta per usare: inflight va alzato prima di guardare active
+// e di leggere vt. derr_remove_sink() fa il contrario (active a 0, poi attende
+// inflight), quindi uno dei due vede l'altro. NULL = sink non attivo.
+static const derr_sink_vtable *sink_pin(struct derr_sink *k){
+    if(k->builtin) return __atomic_load_n(&k->active, __ATOMIC_ACQUIRE) ? k->vt : NULL;
+    __atomic_fetch_add(&k->inflight, 1, __ATOMIC_SEQ_CST);
+    if(DERR_LOAD_SC(&k->active)) return k->vt;
+    __atomic_fetch_add(&k->inflight, -1, __ATOMIC_RELEASE);
+    return NULL;
+}
+static void sink_unpin(struct derr_sink *k){
+    if(!k->builtin) __atomic_fetch_add(&k->inflight, -1, __ATOMIC_RELEASE);
+}
+
+static void sink_call(struct derr_sink *k, const struct derr_rec *rec){
+    const derr_sink_vtable *vt = sink_pin(k);
+    if(!vt) return;
+    void *ctx = k->ctx;
+    struct derr_tstats *t = stats_tl();
+    int id = (int)(k - g_sinks);
+    stat_add(&t->sink_records[id], 1);
+    stat_add(&t->sink_bytes[id], rec->pub.text_len);
+    unsigned long long t0 = __atomic_load_n(&g_stats_timing, __ATOMIC_RELAXED) ? stats_ns() : 0;
+    if(vt->flags & DERR_SINK_THREADSAFE) vt->write(ctx, &rec->pub);
+    else {
+        dlock(&k->lk);
+        if(k->active) vt->write(ctx, &rec->pub);
+        dunlock(&k->lk);
+    }
+    sink_unpin(k);
+    if(t0){
+        unsigned long long d = stats_ns() - t0;
+        if(d > __atomic_load_n(&t->max_write_ns, __ATOMIC_RELAXED)) __atomic_store_n(&t->max_write_ns, d, __ATOMIC_RELAXED);
+    }
+}
+
+// Sink che raccolgono record in batch: svuotati quando lo scrittore asincrono
+// ha esaurito la coda
+static void sinks_idle_flush(void){
+    int n = __atomic_load_n(&g_nsinks, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n; i++){
+        struct derr_sink *k = &g_sinks[i];
+        const derr_sink_vtable *vt = sink_pin(k);
+        if(!vt) continue;
+        if((vt->flags & DERR_SINK_IDLE_FLUSH) && vt->flush){
+            dlock(&k->lk);
+            if(k->active) vt->flush(k->ctx);
+            dunlock(&k->lk);
+        }
+        sink_unpin(k);
+    }
+}
+
+#if DERR_POSIX
+static void shm_put(const struct derr_rec *rec);
+static void shm_flush(void);
+#endif
+
+static void dispatch(const struct derr_rec *rec){
+#if DERR_POSIX
+    // Processo figlio: il principale scrive sui sink; i FATAL restano qui (backtrace)
+    if((rec->cfg & DERR_CFG_SHM) && rec->lvl < DERR_FATAL){ shm_put(rec); return; }
+#endif
+    int n = __atomic_load_n(&g_nsinks, __ATOMIC_ACQUIRE);
+    if(!n){ sinks_init_once(); n = g_nsinks; }
+    for(int i = 0; i < n; i++){
+        struct derr_sink *k = &g_sinks[i];
+        if(!__atomic_load_n(&k->active, __ATOMIC_ACQUIRE)) continue;
+        if((int)rec->lvl < __atomic_load_n(&k->min, __ATOMIC_RELAXED)) continue;
+        sink_call(k, rec);
+    }
+}
+
+// ---- Soppressione dei duplicati ----
+// Hash dell'ultimo record (livello negli 8 bit bassi) e ripetizioni contate
+// senza lock; l'avviso parte al primo record diverso o a derr_flush()
+static struct derr_dedup {
+    __attribute__((aligned(64))) unsigned long long last;
+    unsigned long long repeats;
+} g_dedup;
+
+static unsigned long long rec_hash(const struct derr_rec *r){
+    unsigned long long h = 1469598103934665603ull;
+    const unsigned char *p = (const unsigned char *)r->line + r->msg_off;
+    for(size_t i = 0; i < r->msg_len; i++){ h ^= p[i]; h *= 1099511628211ull; }
+    h ^= (unsigned long long)(unsigned)r->errnum * 0x9E3779B97F4A7C15ull;
+    h |= 0x100;   // mai 0 (= "nessun record")
+    return (h & ~0xffull) | ((unsigned)r->lvl & 0xff);
+}
+
+// Record generato dalla libreria stessa (avvisi), inviato direttamente ai sink
+static void notice_emit(derr_level lvl, const char *fmt, ...) __attribute__((format(printf,2,3)));
+static void notice_emit(derr_level lvl, const char *fmt, ...){
+    char inl[256];
+    struct derr_rec r; rec_init(&r, inl, sizeof inl);
+    va_list ap; va_start(ap, fmt);
+    rec_fill(&r, lvl, 0, 0, fmt, ap);
+    va_end(ap);
+    dispatch(&r);
+    rec_reset(&r, inl, sizeof inl);
+}
+
+static void dedup_report(unsigned long long prev){
+    unsigned long long n = __atomic_exchange_n(&g_dedup.repeats, 0, __ATOMIC_ACQ_REL);
+    if(n && prev) notice_emit((derr_level)(prev & 0xff), "messaggio precedente ripetuto %llu volte", n);
+}
+
+static void write_sinks(const struct derr_rec *rec){
+    if(rec->cfg & DERR_CFG_DEDUP){
+        unsigned long long h = rec->lvl < DERR_FATAL ? rec_hash(rec) : 0;
+        unsigned long long prev = __atomic_exchange_n(&g_dedup.last, h, __ATOMIC_ACQ_REL);
+        if(h && prev == h){
+            __atomic_fetch_add(&g_dedup.repeats, 1, __ATOMIC_RELAXED);
+            stat_add(&stats_tl()->suppressed, 1);
+            return;
+        }
+        dedup_report(prev);
+    }
+    dispatch(rec);
+}
+
+// Backtrace sui FATAL (dove disponibile); chiamata con il lock di stderr
+static void write_backtrace(derr_level lvl){
+#if DERR_POSIX && defined(EXECINFO_H) || (defined(__linux__) && !defined(__ANDROID__))
+    void *bt[128];
+    int n = backtrace(bt, 128);
+    if(n > 0){
+        unsigned cfg = cfg_get();
+        const char *c = level_color(lvl, cfg), *r = color_reset(cfg);
+        char hdr[64]; size_t k = 0;
+        memcpy(hdr, "Backtrace (", 11); k = 11;
+        k += put_u64(hdr + k, (unsigned long long)n);
+        memcpy(hdr + k, " frames):", 9); k += 9;
+        struct iovec v[4];
+        DERR_IOV(v, 0, c, strlen(c)); DERR_IOV(v, 1, hdr, k);
+        DERR_IOV(v, 2, r, strlen(r)); DERR_IOV(v, 3, "\n", 1);
+        write_iov(STDERR_FILENO, v, 4);
+        backtrace_symbols_fd(bt, n, STDERR_FILENO);
+        write_iov(STDERR_FILENO, v + 3, 1);
+    }
+#else
+    (void)lvl;
+#endif
+}
+
+// ---- Flush periodico del file ----
+#if DERR_POSIX
+static pthread_t       g_flusher_th;
+static pthread_mutex_t g_flusher_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_flusher_cv = PTHREAD_COND_INITIALIZER;
+
+static void *flusher_main(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&g_flusher_mu);
+    while(!g_file.flusher_stop){
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        unsigned ms = g_file.pol.interval_ms ? g_file.pol.interval_ms : 1000;
+        dl.tv_sec += ms / 1000;
+        dl.tv_nsec += (long)(ms % 1000) * 1000000L;
+        if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&g_flusher_cv, &g_flusher_mu, &dl);
+        if(g_file.flusher_stop) break;
+        pthread_mutex_unlock(&g_flusher_mu);
+
+        struct derr_sink *k = &g_sinks[DERR_SINK_FILE];
+        dlock(&k->lk);
+        if(g_derr.file && g_file.pending) file_do_flush(g_derr.file);
+        dunlock(&k->lk);
+
+        pthread_mutex_lock(&g_flusher_mu);
+    }
+    pthread_mutex_unlock(&g_flusher_mu);
+    return NULL;
+}
+
+static void flusher_stop(void){
+    if(!g_file.flusher) return;
+    pthread_mutex_lock(&g_flusher_mu);
+    g_file.flusher_stop = 1;
+    pthread_cond_signal(&g_flusher_cv);
+    pthread_mutex_unlock(&g_flusher_mu);
+    pthread_join(g_flusher_th, NULL);
+    g_file.flusher = 0;
+}
+#endif
+
+// ---- Sink mmap ----
+#if DERR_POSIX
+struct derr_mseg {
+    char             *base;
+    size_t            size;
+    int               fd;
+    struct derr_mseg *next;        // lista di tutti i descrittori (liberati a close)
+    __attribute__((aligned(64))) size_t off;        // byte riservati (può superare size)
+    __attribute__((aligned(64))) size_t committed;  // byte effettivamente copiati
+};
+
+struct derr_mmap_sink {
+    char              *path;
+    size_t             seg_size;
+    struct derr_mseg  *cur;         // letto senza lock dai writer
+    struct derr_mseg  *spare;       // segmento successivo già allocato
+    struct derr_mseg  *all;
+    unsigned           next_idx;
+    pthread_mutex_t    mu;          // solo per il cambio di segmento
+    unsigned long long dropped;     // righe più grandi di un segmento o senza segmento
+};
+
+static int mseg_name(const struct derr_mmap_sink *ms, unsigned idx, char *buf, size_t n){
+    return snprintf(buf, n, "%s.%06u", ms->path, idx) < (int)n;
+}
+
+// Crea, pre‑alloca e mappa il segmento idx; NULL se fallisce. Con ms->mu.
+static struct derr_mseg *mseg_open(struct derr_mmap_sink *ms){
+    char name[4096];
+    if(!mseg_name(ms, ms->next_idx, name, sizeof name)) return NULL;
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return NULL;
+    ms->next_idx++;
+    if(posix_fallocate(fd, 0, (off_t)ms->seg_size) != 0 && ftruncate(fd, (off_t)ms->seg_size) != 0){
+        close(fd); return NULL;
+    }
+    void *base = mmap(NULL, ms->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED){ close(fd); return NULL; }
+    struct derr_mseg *sg = (struct derr_mseg *)calloc(1, sizeof *sg);
+    if(!sg){ munmap(base, ms->seg_size); close(fd); return NULL; }
+    sg->base = (char *)base; sg->size = ms->seg_size; sg->fd = fd;
+    sg->next = ms->all; ms->all = sg;
+    return sg;
+}
+
+// Attende le copie in corso, smappa e tronca alla lunghezza usata
+static void mseg_retire(struct derr_mseg *sg, size_t used){
+    while(DERR_LOAD(&sg->committed) < used) sched_yield();
+    munmap(sg->base, sg->size);
+    sg->base = NULL;
+    if(ftruncate(sg->fd, (off_t)used) != 0){ /* il file resta pre‑allocato */ }
+    close(sg->fd);
+    sg->fd = -1;
+}
+
+// Eseguito dall'unico writer la cui riserva ha attraversato la fine del
+// segmento: 'used' è esattamente la parte riservata con successo
+static void mmap_roll(struct derr_mmap_sink *ms, struct derr_mseg *sg, size_t used){
+    pthread_mutex_lock(&ms->mu);
+    struct derr_mseg *nx = ms->spare;
+    ms->spare = NULL;
+    if(!nx) nx = mseg_open(ms);
+    DERR_STORE(&ms->cur, nx);
+    pthread_mutex_unlock(&ms->mu);
+
+    mseg_retire(sg, used);
+
+    // Prepara già il prossimo, fuori dal percorso degli altri writer
+    pthread_mutex_lock(&ms->mu);
+    if(!ms->spare && DERR_LOAD(&ms->cur)) ms->spare = mseg_open(ms);
+    pthread_mutex_unlock(&ms->mu);
+}
+
+static void mmap_sink_write(void *ctx, const derr_record *p){
+    struct derr_mmap_sink *ms = (struct derr_mmap_sink *)ctx;
+    size_t len = p->text_len;
+    if(len > ms->seg_size){ DERR_FADD(&ms->dropped, 1); return; }
+    for(;;){
+        struct derr_mseg *sg = DERR_LOAD(&ms->cur);
+        if(!sg){ DERR_FADD(&ms->dropped, 1); return; }
+        size_t o = DERR_FADD(&sg->off, len);
+        if(o + len <= sg->size){
+            memcpy(sg->base + o, p->text, len);
+            DERR_FADD(&sg->committed, len);
+            return;
+        }
+        if(o <= sg->size) mmap_roll(ms, sg, o);
+        else while(DERR_LOAD(&ms->cur) == sg) sched_yield();
+    }
+}
+
+static void mmap_sink_flush(void *ctx){
+    struct derr_mmap_sink *ms = (struct derr_mmap_sink *)ctx;
+    pthread_mutex_lock(&ms->mu);
+    struct derr_mseg *sg = DERR_LOAD(&ms->cur);
+    if(sg && sg->base) msync(sg->base, sg->size, MS_ASYNC);
+    pthread_mutex_unlock(&ms->mu);
+}
+
+// Chiamata da derr_remove_sink quando non ci sono più write in corso
+static void mmap_sink_close(void *ctx){
+    struct derr_mmap_sink *ms = (struct derr_mmap_sink *)ctx;
+    struct derr_mseg *sg = DERR_LOAD(&ms->cur);
+    DERR_STORE(&ms->cur, (struct derr_mseg *)NULL);
+    if(sg){
+        size_t used = DERR_LOAD(&sg->off);
+        mseg_retire(sg, used < sg->size ? used : sg->size);
+    }
+    if(ms->spare){
+        char name[4096];
+        munmap(ms->spare->base, ms->spare->size);
+        close(ms->spare->fd);
+        if(mseg_name(ms, ms->next_idx - 1, name, sizeof name)) unlink(name);
+    }
+    while(ms->all){ struct derr_mseg *n = ms->all->next; free(ms->all); ms->all = n; }
+    pthread_mutex_destroy(&ms->mu);
+    free(ms->path);
+    free(ms);
+}
+
+static const derr_sink_vtable g_mmap_vt = { mmap_sink_write, mmap_sink_flush, mmap_sink_close, DERR_SINK_THREADSAFE };
+#endif
+
+// ---- Log binario ----
+// Flusso:  intestazione  "DERRBIN1" u32(0x01020304) u16 len, nome programma
+//                        (la 'D' iniziale fa da tipo del record)
+//          definizione   'F' u32 id, u32 len, formato
+//          record        'L' u32 id, u8 livello, u8 has_errno, i32 errno,
+//                        i64 sec, u32 nsec, u32 len, argomenti
+// Argomenti: un tag per valore, 'i' i64 / 'u' u64 / 'f' double / 'p' u64 /
+// 's' u32 len + byte. Interi in ordine nativo (il marcatore lo verifica).
+#define DERR_BIN_MAGIC "DERRBIN1"
+
+// Specifica di conversione printf
+struct derr_spec {
+    const char *start;       // '%'
+    size_t      len;         // fino alla conversione inclusa
+    size_t      lm_off;      // offset del modificatore di lunghezza da start
+    int         width_star;
+    int         prec_star;
+    int         has_prec;
+    int         prec;        // se numerica
+    int         lm;
+    char        conv;        // '%' per "%%"
+};
+
+enum { DERR_LM_NONE, DERR_LM_HH, DERR_LM_H, DERR_LM_L, DERR_LM_LL, DERR_LM_J, DERR_LM_Z, DERR_LM_T, DERR_LM_LD };
+
+// Prossima conversione a partire da p; NULL se non ce ne sono altre
+// (un formato troncato dopo '%' conta come fine)
+static const char *fmt_next(const char *p, struct derr_spec *sp){
+    p = strchr(p, '%');
+    if(!p) return NULL;
+    sp->start = p++;
+    if(*p == '%'){ sp->conv = '%'; sp->len = 2; sp->lm_off = 1; return sp->start; }
+    while(*p && strchr("-+ #0'", *p)) p++;
+    sp->width_star = 0;
+    if(*p == '*'){ sp->width_star = 1; p++; }
+    else while(*p >= '0' && *p <= '9') p++;
+    sp->has_prec = sp->prec_star = sp->prec = 0;
+    if(*p == '.'){
+        p++; sp->has_prec = 1;
+        if(*p == '*'){ sp->prec_star = 1; p++; }
+        else while(*p >= '0' && *p <= '9'){ sp->prec = sp->prec * 10 + (*p - '0'); p++; }
+    }
+    sp->lm_off = (size_t)(p - sp->start);
+    sp->lm = DERR_LM_NONE;
+    switch(*p){
+        case 'h': p++; if(*p == 'h'){ p++; sp->lm = DERR_LM_HH; } else sp->lm = DERR_LM_H; break;
+        case 'l': p++; if(*p == 'l'){ p++; sp->lm = DERR_LM_LL; } else sp->lm = DERR_LM_L; break;
+        case 'q': p++; sp->lm = DERR_LM_LL; break;
+        case 'j': p++; sp->lm = DERR_LM_J; break;
+        case 'z': p++; sp->lm = DERR_LM_Z; break;
+        case 't': p++; sp->lm = DERR_LM_T; break;
+        case 'L': p++; sp->lm = DERR_LM_LD; break;
+        default: break;
+    }
+    if(!*p) return NULL;
+    sp->conv = *p;
+    sp->len = (size_t)(p + 1 - sp->start);
+    return sp->start;
+}
+
+static DERR_INLINE void bin_put_tagged(struct derr_rec *b, char tag, const void *v, size_t n){
+    rec_put(b, &tag, 1); rec_put(b, (const char *)v, n);
+}
+static DERR_INLINE void bin_put_i(struct derr_rec *b, long long v){ bin_put_tagged(b, 'i', &v, 8); }
+static DERR_INLINE void bin_put_u(struct derr_rec *b, unsigned long long v){ bin_put_tagged(b, 'u', &v, 8); }
+
+// Serializza gli argomenti descritti da fmt; ritorna 0 se il formato contiene
+// una conversione sconosciuta (gli argomenti successivi non sono leggibili)
+static int bin_pack_args(struct derr_rec *b, const char *fmt, va_list ap){
+    struct derr_spec sp;
+    const char *p = fmt;
+    while(fmt_next(p, &sp)){
+        p = sp.start + sp.len;
+        if(sp.conv == '%') continue;
+        int prec = sp.prec;
+        if(sp.width_star) bin_put_i(b, va_arg(ap, int));
+        if(sp.prec_star){ prec = va_arg(ap, int); bin_put_i(b, prec); }
+        switch(sp.conv){
+            case 'd': case 'i': {
+                long long v;
+                switch(sp.lm){
+                    case DERR_LM_HH: v = (signed char)va_arg(ap, int); break;
+                    case DERR_LM_H:  v = (short)va_arg(ap, int); break;
+                    case DERR_LM_L:  v = va_arg(ap, long); break;
+                    case DERR_LM_LL: v = va_arg(ap, long long); break;
+                    case DERR_LM_J:  v = (long long)va_arg(ap, intmax_t); break;
+                    case DERR_LM_Z:  v = (long long)va_arg(ap, size_t); break;
+                    case DERR_LM_T:  v = (long long)va_arg(ap, ptrdiff_t); break;
+                    default:         v = va_arg(ap, int); break;
+                }
+                bin_put_i(b, v);
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X': {
+                unsigned long long v;
+                switch(sp.lm){
+                    case DERR_LM_HH: v = (unsigned char)va_arg(ap, unsigned); break;
+                    case DERR_LM_H:  v = (unsigned short)va_arg(ap, unsigned); break;
+                    case DERR_LM_L:  v = va_arg(ap, unsigned long); break;
+                    case DERR_LM_LL: v = va_arg(ap, unsigned long long); break;
+                    case DERR_LM_J:  v = (unsigned long long)va_arg(ap, uintmax_t); break;
+                    case DERR_LM_Z:  v = (unsigned long long)va_arg(ap, size_t); break;
+                    case DERR_LM_T:  v = (unsigned long long)va_arg(ap, ptrdiff_t); break;
+                    default:         v = va_arg(ap, unsigned); break;
+                }
+                bin_put_u(b, v);
+                break;
+            }
+            case 'c':
+                bin_put_i(b, (long long)va_arg(ap, int));
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+                double v = sp.lm == DERR_LM_LD ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                bin_put_tagged(b, 'f', &v, 8);
+                break;
+            }
+            case 's': {
+                const char *str = va_arg(ap, const char *);
+                if(sp.lm == DERR_LM_L) str = "?";      // stringhe wide non supportate
+                if(!str) str = "(null)";
+                size_t n = (sp.has_prec && prec >= 0) ? strnlen(str, (size_t)prec) : strlen(str);
+                uint32_t n32 = (uint32_t)n;
+                bin_put_tagged(b, 's', &n32, 4);
+                rec_put(b, str, n);
+                break;
+            }
+            case 'p': {
+                unsigned long long v = (unsigned long long)(uintptr_t)va_arg(ap, void *);
+                bin_put_tagged(b, 'p', &v, 8);
+                break;
+            }
+            case 'n':
+                (void)va_arg(ap, void *);
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Ricostruisce il messaggio da formato e argomenti serializzati, in coda a out
+static void bin_render(struct derr_rec *out, const char *fmt, const unsigned char *a, size_t alen){
+    const unsigned char *end = a + alen;
+    struct derr_spec sp;
+    const char *p = fmt;
+    while(fmt_next(p, &sp)){
+        rec_put(out, p, (size_t)(sp.start - p));
+        p = sp.start + sp.len;
+        if(sp.conv == '%'){ rec_put(out, "%", 1); continue; }
+        if(sp.conv == 'n') continue;
+
+        // Specifica equivalente con '*' sostituiti e lunghezza normalizzata
+        char spec[64]; size_t k = 0;
+        for(size_t i = 0; i < sp.lm_off && k < sizeof spec - 24; i++){
+            if(sp.start[i] == '*'){
+                long long v = 0;
+                if(end - a >= 9 && *a == 'i'){ memcpy(&v, a + 1, 8); a += 9; }
+                k += (size_t)snprintf(spec + k, sizeof spec - k, "%d", (int)v);
+            } else spec[k++] = sp.start[i];
+        }
+        int isint = strchr("diuoxX", sp.conv) != NULL;
+        if(isint){ spec[k++] = 'l'; spec[k++] = 'l'; }
+        spec[k++] = sp.conv; spec[k] = 0;
+
+        if(end - a < 1) break;
+        char tag = (char)*a++;
+        char tmp[512]; int n = -1;
+        if(tag == 's'){
+            uint32_t sl = 0;
+            if(end - a < 4) break;
+            memcpy(&sl, a, 4); a += 4;
+            if((size_t)(end - a) < sl) break;
+            // Copia terminata per snprintf (le stringhe lunghe passano da heap)
+            char *sv = sl < sizeof tmp ? tmp : (char *)malloc(sl + 1);
+            if(!sv) break;
+            memcpy(sv, a, sl); sv[sl] = 0; a += sl;
+            size_t old = out->len;
+            int m = snprintf(NULL, 0, spec, sv);
+            if(m > 0 && rec_reserve(out, old + (size_t)m + 1)){
+                snprintf(out->line + old, (size_t)m + 1, spec, sv);
+                out->len = old + (size_t)m;
+            }
+            if(sv != tmp) free(sv);
+            continue;
+        }
+        if(end - a < 8) break;
+        union { long long i; unsigned long long u; double f; } v;
+        memcpy(&v, a, 8); a += 8;
+        switch(tag){
+            case 'i':
+                if(sp.conv == 'c') n = snprintf(tmp, sizeof tmp, spec, (int)v.i);
+                else if(isint)     n = snprintf(tmp, sizeof tmp, spec, v.i);
+                break;
+            case 'u': n = snprintf(tmp, sizeof tmp, spec, v.u); break;
+            case 'f': n = snprintf(tmp, sizeof tmp, spec, v.f); break;
+            case 'p': n = snprintf(tmp, sizeof tmp, spec, (void *)(uintptr_t)v.u); break;
+            default: break;
+        }
+        if(n > 0) rec_put(out, tmp, (size_t)n < sizeof tmp ? (size_t)n : sizeof tmp - 1);
+    }
+    if(p) rec_puts(out, p);
+}
+
+#if DERR_POSIX
+static void bin_write(const struct derr_rec *b){
+    int fd = DERR_LOAD(&g_bin.fd);
+    if(fd < 0) return;
+    size_t off = 0;
+    while(off < b->len){
+        ssize_t w = write(fd, b->line + off, b->len - off);
+        if(w < 0){ if(errno == EINTR) continue; return; }
+        off += (size_t)w;
+    }
+}
+
+static void bin_define(uint32_t id, const char *fmt){
+    static DERR_TLS char inl[256];
+    struct derr_rec b; rec_init(&b, inl, sizeof inl);
+    uint32_t n = (uint32_t)strlen(fmt);
+    rec_put(&b, "F", 1); rec_put(&b, (const char *)&id, 4);
+    rec_put(&b, (const char *)&n, 4); rec_put(&b, fmt, n);
+    bin_write(&b);
+    rec_reset(&b, inl, sizeof inl);
+}
+
+// Id del formato; alla prima occorrenza scrive il record di definizione.
+// Tabella a indirizzamento aperto senza lock, chiave = puntatore al formato.
+static uint32_t bin_fmt_id(const char *fmt){
+    size_t h = (size_t)(((uintptr_t)fmt >> 3) * 0x9E3779B97F4A7C15ull);
+    for(size_t i = 0; i < DERR_FMT_TABLE; i++){
+        struct derr_fmt_ent *e = &g_bin.tab[(h + i) & (DERR_FMT_TABLE - 1)];
+        const char *cur = DERR_LOAD(&e->fmt);
+        if(!cur){
+            if(DERR_CAS(&e->fmt, &cur, fmt)){
+                // Slot nostro: la definizione precede qualsiasi record che la usa
+                e->id = DERR_FADD(&g_bin.next_id, 1);
+                bin_define(e->id, fmt);
+                DERR_STORE(&e->ready, 1);
+                return e->id;
+            }
+        }
+        if(cur != fmt) continue;
+        while(!DERR_LOAD(&e->ready)) sched_yield();
+        return e->id;
+    }
+    // Tabella piena: definizione ripetuta con un id nuovo a ogni uso
+    uint32_t id = DERR_FADD(&g_bin.next_id, 1);
+    bin_define(id, fmt);
+    return id;
+}
+
+static DERR_TLS struct derr_rec tl_bin;
+static DERR_TLS char tl_bin_inl[512];
+
+// Intestazione del record 'L' nel buffer del thread; ritorna l'offset del campo lunghezza
+static size_t bin_begin(derr_level lvl, int has_errno, int errnum, const char *fmt){
+    if(!tl_bin.line) rec_init(&tl_bin, tl_bin_inl, sizeof tl_bin_inl);
+    struct derr_rec *b = &tl_bin;
+    struct timespec ts; ts_capture(&ts, cfg_get());
+    uint32_t id = bin_fmt_id(fmt);
+    unsigned char l8 = (unsigned char)lvl, e8 = (unsigned char)(has_errno != 0);
+    int32_t en = errnum; int64_t sec = (int64_t)ts.tv_sec; uint32_t ns = (uint32_t)ts.tv_nsec;
+
+    b->len = 0;
+    rec_put(b, "L", 1); rec_put(b, (const char *)&id, 4);
+    rec_put(b, (const char *)&l8, 1); rec_put(b, (const char *)&e8, 1);
+    rec_put(b, (const char *)&en, 4); rec_put(b, (const char *)&sec, 8);
+    rec_put(b, (const char *)&ns, 4);
+    size_t lenpos = b->len;
+    rec_put(b, "\0\0\0\0", 4);
+    return lenpos;
+}
+
+static void bin_finish(size_t lenpos){
+    struct derr_rec *b = &tl_bin;
+    uint32_t alen = (uint32_t)(b->len - lenpos - 4);
+    memcpy(b->line + lenpos, &alen, 4);
+    bin_write(b);
+    // Non trattiene buffer enormi dopo un argomento eccezionale
+    if(b->owned && b->cap > 65536) rec_reset(b, tl_bin_inl, sizeof tl_bin_inl);
+}
+
+static void bin_emit(derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
+    DERR_FADD(&g_bin.inflight, 1);
+    if(DERR_LOAD(&g_bin.fd) >= 0){
+        size_t lenpos = bin_begin(lvl, has_errno, errnum, fmt);
+        bin_pack_args(&tl_bin, fmt, ap);
+        bin_finish(lenpos);
+    }
+    DERR_FADD(&g_bin.inflight, -1);
+}
+
+// Argomenti già serializzati (derr.hpp): copiati come sono
+static void bin_emit_packed(derr_level lvl, int has_errno, int errnum, const char *fmt, const void *args, size_t alen){
+    DERR_FADD(&g_bin.inflight, 1);
+    if(DERR_LOAD(&g_bin.fd) >= 0){
+        size_t lenpos = bin_begin(lvl, has_errno, errnum, fmt);
+        rec_put(&tl_bin, (const char *)args, alen);
+        bin_finish(lenpos);
+    }
+    DERR_FADD(&g_bin.inflight, -1);
+}
+#endif
+
+// Decoder: ricostruisce le righe nel formato testuale standard
+static int bin_read(FILE *in, void *p, size_t n){ return fread(p, 1, n, in) == n; }
+
+int derr_binary_decode(FILE *in, FILE *out){
+    char **fmts = NULL; size_t nf = 0;
+    char *prog = NULL;
+    char inl[1024];
+    struct derr_rec r; rec_init(&r, inl, sizeof inl);
+    unsigned char *args = NULL; size_t acap = 0;
+    int rc = 0, type;
+
+    while((type = fgetc(in)) != EOF){
+        if(type == 'D'){
+            char magic[7]; uint32_t mark; uint16_t pl;
+            if(!bin_read(in, magic, 7) || memcmp(magic, DERR_BIN_MAGIC + 1, 7) != 0
+               || !bin_read(in, &mark, 4) || mark != 0x01020304u || !bin_read(in, &pl, 2)){ rc = -1; break; }
+            free(prog); prog = (char *)malloc((size_t)pl + 1);
+            if(!prog || !bin_read(in, prog, pl)){ rc = -1; break; }
+            prog[pl] = 0;
+            // Nuovo processo: gli id ripartono da zero
+            for(size_t i = 0; i < nf; i++) free(fmts[i]);
+            nf = 0;
+        } else if(type == 'F'){
+            uint32_t id, n;
+            if(!bin_read(in, &id, 4) || !bin_read(in, &n, 4)){ rc = -1; break; }
+            if(id >= nf){
+                size_t nn = (size_t)id + 1;
+                char **t = (char **)realloc(fmts, nn * sizeof *t);
+                if(!t){ rc = -1; break; }
+                for(size_t i = nf; i < nn; i++) t[i] = NULL;
+                fmts = t; nf = nn;
+            }
+            free(fmts[id]);
+            fmts[id] = (char *)malloc((size_t)n + 1);
+            if(!fmts[id] || !bin_read(in, fmts[id], n)){ rc = -1; break; }
+            fmts[id][n] = 0;
+        } else if(type == 'L'){
+            uint32_t id, ns, alen; unsigned char l8, e8; int32_t en; int64_t sec;
+            if(!bin_read(in, &id, 4) || !bin_read(in, &l8, 1) || !bin_read(in, &e8, 1)
+               || !bin_read(in, &en, 4) || !bin_read(in, &sec, 8) || !bin_read(in, &ns, 4)
+               || !bin_read(in, &alen, 4)){ rc = -1; break; }
+            if(alen > acap){
+                unsigned char *t = (unsigned char *)realloc(args, alen);
+                if(!t){ rc = -1; break; }
+                args = t; acap = alen;
+            }
+            if(!bin_read(in, args, alen)){ rc = -1; break; }
+
+            struct timespec ts; ts.tv_sec = (time_t)sec; ts.tv_nsec = (long)ns;
+            r.len = 0;
+            rec_reserve(&r, 64);
+            r.len = ts_format(&ts, r.line, cfg_get());
+            rec_put(&r, " [", 2); rec_puts(&r, level_str((derr_level)l8)); rec_put(&r, "] ", 2);
+            rec_puts(&r, prog ? prog : "program"); rec_put(&r, ": ", 2);
+            if(id < nf && fmts[id]) bin_render(&r, fmts[id], args, alen);
+            else rec_puts(&r, "<formato sconosciuto>");
+            if(e8){
+                const struct derr_errent *ei = errno_info(en);
+                char eb[256];
+                if(!ei) strerror_portable(en, eb, sizeof eb);
+                fprintf(out, "%.*s (errno=%d%s%s)\n        -> %s\n", (int)r.len, r.line, (int)en,
+                        ei && ei->name ? " " : "", ei && ei->name ? ei->name : "", ei ? ei->msg : eb);
+            } else {
+                fprintf(out, "%.*s\n", (int)r.len, r.line);
+            }
+        } else {
+            rc = -1; break;
+        }
+    }
+    for(size_t i = 0; i < nf; i++) free(fmts[i]);
+    free(fmts); free(prog); free(args);
+    rec_reset(&r, inl, sizeof inl);
+    return rc;
+}
+
+// ---- Flight recorder ----
+#if DERR_POSIX
+static DERR_TLS struct derr_fr_ring *tl_fr;
+static pthread_key_t  g_fr_key;
+static pthread_once_t g_fr_once = PTHREAD_ONCE_INIT;
+
+static void fr_release(void *p){ __atomic_store_n(&((struct derr_fr_ring *)p)->used, 0, __ATOMIC_RELEASE); }
+static void fr_key_init(void){ pthread_key_create(&g_fr_key, fr_release); }
+
+// Ring del thread corrente: oltre DERR_FLIGHT_RINGS riusa quello di un thread
+// terminato con la dimensione giusta, altrimenti ne alloca uno nuovo
+static struct derr_fr_ring *fr_acquire(size_t n){
+    if(tl_fr){
+        if(tl_fr->n == n) return tl_fr;
+        fr_release(tl_fr); tl_fr = NULL;
+    }
+    pthread_once(&g_fr_once, fr_key_init);
+    struct derr_fr_ring *r = NULL;
+    if(DERR_LOAD(&g_fr.nrings) >= DERR_FLIGHT_RINGS){
+        for(r = DERR_LOAD(&g_fr.rings); r; r = r->next){
+            int zero = 0;
+            if(r->n == n && DERR_LOAD(&r->used) == 0 && DERR_CAS(&r->used, &zero, 1)) break;
+        }
+    }
+    if(!r){
+        r = (struct derr_fr_ring *)calloc(1, sizeof *r);
+        struct derr_fr_slot *sl = r ? (struct derr_fr_slot *)calloc(n, sizeof *sl) : NULL;
+        if(!sl){ free(r); return NULL; }
+        r->n = n; r->slot = sl; r->used = 1;
+        struct derr_fr_ring *top = DERR_LOAD(&g_fr.rings);
+        do r->next = top; while(!DERR_CAS(&g_fr.rings, &top, r));
+        DERR_FADD(&g_fr.nrings, 1);
+    }
+    r->id = thread_id();
+    DERR_STORE(&r->head, 0);
+    pthread_setspecific(g_fr_key, r);
+    tl_fr = r;
+    return r;
+}
+
+static void fr_record(derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
+    size_t n = DERR_LOAD(&g_fr.n);
+    if(!n) return;
+    struct derr_fr_ring *r = fr_acquire(n);
+    if(!r) return;
+    unsigned long long pos = r->head;
+    struct derr_fr_slot *sl = &r->slot[pos % r->n];
+    __atomic_store_n(&sl->seq, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    struct timespec ts; ts_capture(&ts, cfg_get());
+    sl->sec = (int64_t)ts.tv_sec; sl->nsec = (uint32_t)ts.tv_nsec;
+    sl->lvl = (unsigned char)lvl; sl->has_errno = (unsigned char)(has_errno != 0); sl->errnum = errnum;
+    int m = vsnprintf(sl->msg, sizeof sl->msg, fmt, ap);
+    if(m < 0) m = 0;
+    sl->len = (uint16_t)((size_t)m < sizeof sl->msg ? (size_t)m : sizeof sl->msg - 1);
+    __atomic_store_n(&sl->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+// "YYYY-MM-DDTHH:MM:SS.mmm" senza localtime_r (non async‑signal‑safe):
+// giorni → data civile con l'algoritmo di H. Hinnant
+static size_t fr_ts(char *p, int64_t sec, uint32_t nsec){
+    int utc = (cfg_get() & DERR_CFG_UTC) != 0;
+    if(!utc) sec += g_fr.tz_off;
+    int64_t days = sec >= 0 ? sec / 86400 : -((-sec + 86399) / 86400);
+    int64_t rem = sec - days * 86400;
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int64_t d = doy - (153 * mp + 2) / 5 + 1;
+    int64_t m = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y = yoe + era * 400 + (m <= 2);
+    put_digits(p, (unsigned long)y, 4);          p[4] = '-';
+    put_digits(p + 5, (unsigned long)m, 2);      p[7] = '-';
+    put_digits(p + 8, (unsigned long)d, 2);      p[10] = 'T';
+    put_digits(p + 11, (unsigned long)(rem / 3600), 2);      p[13] = ':';
+    put_digits(p + 14, (unsigned long)(rem / 60 % 60), 2);   p[16] = ':';
+    put_digits(p + 17, (unsigned long)(rem % 60), 2);        p[19] = '.';
+    put_digits(p + 20, (unsigned long)(nsec / 1000000), 3);
+    size_t k = 23;
+    if(utc) p[k++] = 'Z';
+    return k;
+}
+
+static void fr_write(int fd, const char *p, size_t n){
+    while(n){
+        ssize_t w = write(fd, p, n);
+        if(w < 0){ if(errno == EINTR) continue; return; }
+        p += w; n -= (size_t)w;
+    }
+}
+
+// Solo write() e formattazione a mano: utilizzabile da un signal handler.
+// Uno slot riscritto durante la lettura viene saltato (seq cambiato).
+static void fr_dump_fd(int fd){
+    int saved = errno;
+    char buf[DERR_FLIGHT_MSG + 128];
+    for(struct derr_fr_ring *r = DERR_LOAD(&g_fr.rings); r; r = r->next){
+        unsigned long long h = DERR_LOAD(&r->head);
+        if(!h) continue;
+        unsigned long long from = h > r->n ? h - r->n : 0;
+        size_t k = 0;
+        memcpy(buf, "Flight recorder thread #", 24); k = 24;
+        k += put_u64(buf + k, r->id);
+        const char *st = r == tl_fr ? " (corrente)" : DERR_LOAD(&r->used) ? "" : " (terminato)";
+        memcpy(buf + k, st, strlen(st)); k += strlen(st);
+        memcpy(buf + k, ", ultimi ", 9); k += 9;
+        k += put_u64(buf + k, h - from);
+        memcpy(buf + k, " record:\n", 9); k += 9;
+        fr_write(fd, buf, k);
+        for(unsigned long long pos = from; pos < h; pos++){
+            struct derr_fr_slot *sl = &r->slot[pos % r->n];
+            if(__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+            k = 0;
+            buf[k++] = ' '; buf[k++] = ' ';
+            k += fr_ts(buf + k, sl->sec, sl->nsec);
+            buf[k++] = ' '; buf[k++] = '[';
+            const char *ls = level_str((derr_level)sl->lvl);
+            memcpy(buf + k, ls, strlen(ls)); k += strlen(ls);
+            buf[k++] = ']'; buf[k++] = ' ';
+            size_t ml = sl->len < DERR_FLIGHT_MSG ? sl->len : DERR_FLIGHT_MSG - 1;
+            memcpy(buf + k, sl->msg, ml); k += ml;
+            if(sl->has_errno){
+                memcpy(buf + k, " (errno=", 8); k += 8;
+                if(sl->errnum < 0){ buf[k++] = '-'; k += put_u64(buf + k, (unsigned long long)-(long long)sl->errnum); }
+                else k += put_u64(buf + k, (unsigned long long)sl->errnum);
+                const char *en = errno_name(sl->errnum);
+                if(en){ buf[k++] = ' '; memcpy(buf + k, en, strlen(en)); k += strlen(en); }
+                buf[k++] = ')';
+            }
+            buf[k++] = '\n';
+            if(__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) != pos + 1) continue;
+            fr_write(fd, buf, k);
+        }
+    }
+    errno = saved;
+}
+#else
+static void fr_dump_fd(int fd){ (void)fd; }
+#endif
+
+// ---- Arena dei record asincroni ----
+// Ogni thread produttore ritaglia i messaggi lunghi dal proprio chunk corrente
+// senza atomiche; lo scrittore, dopo averli scritti, restituisce i byte con una
+// sottrazione atomica per chunk a ogni passata. Alla chiusura (chunk pieno o
+// thread terminato) il proprietario aggiunge i byte assegnati: chi porta il
+// saldo a zero, una sola volta, rimette il chunk nel pool.
+#if DERR_POSIX
+#define DERR_ARENA_CHUNK (64 * 1024)
+#define DERR_ARENA_MAX   (8u * 1024 * 1024)
+
+struct derr_achunk {
+    struct derr_achunk *next;      // nel pool
+    size_t              size;      // byte utili in data
+    size_t              used;      // scritto solo dal proprietario
+    long long           live;      // byte assegnati (dalla chiusura) meno byte resi; atomico
+    __attribute__((aligned(64))) char data[];
+};
+
+static struct derr_arena {
+    pthread_mutex_t     mu;        // pool e contabilità (solo al cambio di chunk)
+    struct derr_achunk *pool;
+    size_t              chunk;
+    size_t              limit;
+    size_t              bytes;     // memoria allocata per i chunk
+    unsigned long long  truncated, heap;
+} g_arena = { PTHREAD_MUTEX_INITIALIZER, NULL, DERR_ARENA_CHUNK, DERR_ARENA_MAX, 0, 0, 0 };
+
+static DERR_TLS struct derr_achunk *tl_chunk;
+static pthread_key_t  g_arena_key;
+static pthread_once_t g_arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_recycle(struct derr_achunk *c){
+    pthread_mutex_lock(&g_arena.mu);
+    c->next = g_arena.pool; g_arena.pool = c;
+    pthread_mutex_unlock(&g_arena.mu);
+}
+
+// Prima della chiusura il saldo è <= 0: può arrivare a zero solo dopo
+static void arena_free(struct derr_achunk *c, size_t n){
+    if(__atomic_sub_fetch(&c->live, (long long)n, __ATOMIC_ACQ_REL) == 0) arena_recycle(c);
+}
+
+// Chiude il chunk del thread: non riceverà altre allocazioni
+static void arena_seal(struct derr_achunk *c){
+    if(__atomic_add_fetch(&c->live, (long long)c->used, __ATOMIC_ACQ_REL) == 0) arena_recycle(c);
+}
+// Un record emesso da un distruttore TLS successivo prenderà un chunk nuovo
+static void arena_thread_exit(void *p){ tl_chunk = NULL; arena_seal((struct derr_achunk *)p); }
+static void arena_key_init(void){ pthread_key_create(&g_arena_key, arena_thread_exit); }
+
+// Chunk nuovo dal pool o da heap entro il tetto; NULL se il tetto è raggiunto
+static struct derr_achunk *arena_take(void){
+    pthread_mutex_lock(&g_arena.mu);
+    struct derr_achunk *c = g_arena.pool;
+    if(c) g_arena.pool = c->next;
+    else if(g_arena.bytes + g_arena.chunk <= g_arena.limit){
+        void *mem = NULL;
+        if(posix_memalign(&mem, 64, sizeof *c + g_arena.chunk) == 0){
+            c = (struct derr_achunk *)mem;
+            c->size = g_arena.chunk;
+            g_arena.bytes += g_arena.chunk;
+        }
+    }
+    pthread_mutex_unlock(&g_arena.mu);
+    if(c){ c->used = 0; c->live = 0; }
+    return c;
+}
+
+// rec_reserve per gli slot della coda: il blocco esce dal chunk del thread
+static int arena_reserve(struct derr_rec *r, size_t need){
+    size_t nc = r->cap * 2;
+    if(nc < need) nc = need;
+    nc = (nc + 63) & ~(size_t)63;
+    if(nc > __atomic_load_n(&g_arena.chunk, __ATOMIC_RELAXED)){
+        // Più grande di un chunk: heap come per gli altri record
+        char *p = (char *)malloc(nc);
+        if(!p) return 0;
+        memcpy(p, r->line, r->len);
+        if(r->owned == 2) arena_free(r->chunk, r->cap);
+        r->line = p; r->cap = nc; r->owned = 1; r->chunk = NULL;
+        DERR_FADD(&g_arena.heap, 1);
+        return 1;
+    }
+    struct derr_achunk *c = tl_chunk;
+    if(!c || c->size - c->used < nc){
+        if(!c){
+            pthread_once(&g_arena_once, arena_key_init);
+        } else arena_seal(c);
+        c = tl_chunk = arena_take();
+        pthread_setspecific(g_arena_key, c);
+        if(!c){ DERR_FADD(&g_arena.truncated, 1); return 0; }
+    }
+    char *p = c->data + c->used;
+    c->used += nc;
+    memcpy(p, r->line, r->len);
+    if(r->owned == 2) arena_free(r->chunk, r->cap);
+    r->line = p; r->cap = nc; r->owned = 2; r->chunk = c;
+    return 1;
+}
+#endif
+
+// ---- Modalità asincrona ----
+// Ring limitato multi‑produttore (Vyukov): ogni slot ha un numero di sequenza
+// che indica se è libero per il giro corrente o pronto per il consumatore.
+// Il consumatore è il thread scrittore; con DROP_OLDEST anche i produttori
+// possono estrarre (e scartare) lo slot più vecchio.
+#if DERR_POSIX
+#define DERR_ASYNC_INLINE 512
+
+// Record a formattazione differita: in rec.line ci sono gli argomenti nel
+// formato del log binario seguiti dal contesto MDC; formato, timestamp,
+// strerror e riga li produce lo scrittore
+struct derr_defer {
+    int                on;
+    derr_level         lvl;
+    int                has_errno, errnum;
+    const char        *fmt;
+    const derr_site   *site;
+    unsigned           sample;
+    size_t             args_len;
+    struct derr_origin o;
+};
+
+struct derr_aslot {
+    size_t            seq;
+    struct derr_rec   rec;
+    struct derr_defer d;
+    char              inl[DERR_ASYNC_INLINE];   // messaggi più lunghi vanno su heap
+};
+
+static struct derr_async {
+    pthread_mutex_t    mu;
+    pthread_cond_t     wake;         // sveglia lo scrittore
+    pthread_cond_t     drained;      // segnala i thread in derr_flush()
+    pthread_cond_t     space;        // segnala i produttori fermi sul ring pieno
+    struct derr_aslot *slots;
+    size_t             mask;
+    int                running;      // letto senza lock nel percorso caldo
+    int                policy;
+    int                stop;
+    int                sleeping;     // scrittore in attesa sulla condvar
+    int                waiters;      // thread in derr_flush()
+    int                blocked;      // produttori in attesa di uno slot (DERR_OVERFLOW_BLOCK)
+    unsigned long long dropped;
+    // Contatori caldi su cache line separate (niente false sharing)
+    __attribute__((aligned(64))) size_t head;   // prossima posizione da riservare
+    __attribute__((aligned(64))) size_t tail;   // prossima posizione da consumare
+    __attribute__((aligned(64))) size_t done;   // record completati (scritti o scartati)
+    __attribute__((aligned(64))) int inflight;  // produttori dentro il ring (vedi stop)
+} g_async = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+              PTHREAD_COND_INITIALIZER, NULL, 0, 0, DERR_OVERFLOW_BLOCK, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static pthread_t g_async_th;
+
+// Prova a estrarre lo slot più vecchio; NULL se la coda è vuota (o lo slot
+// in testa non è ancora stato pubblicato). *pos riceve la posizione estratta.
+static struct derr_aslot *async_pop(size_t *pos){
+    size_t p = __atomic_load_n(&g_async.tail, __ATOMIC_RELAXED);
+    for(;;){
+        struct derr_aslot *sl = &g_async.slots[p & g_async.mask];
+        size_t seq = DERR_LOAD(&sl->seq);
+        long dif = (long)(seq - (p + 1));
+        if(dif == 0){
+            if(DERR_CAS(&g_async.tail, &p, p + 1)){ *pos = p; return sl; }
+        } else if(dif < 0){
+            return NULL;
+        } else {
+            p = __atomic_load_n(&g_async.tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Byte d'arena resi dallo scrittore, accumulati per chunk
+struct derr_afree {
+    struct derr_achunk *chunk;
+    size_t              bytes;
+};
+static void afree_flush(struct derr_afree *f){
+    if(f->chunk) arena_free(f->chunk, f->bytes);
+    f->chunk = NULL; f->bytes = 0;
+}
+
+// Rilascia uno slot estratto per il giro successivo del ring; con f != NULL
+// la memoria d'arena è resa in blocco da afree_flush()
+static void async_release(struct derr_aslot *sl, size_t pos, struct derr_afree *f){
+    struct derr_rec *r = &sl->rec;
+    if(r->owned == 2 && f){
+        if(f->chunk != r->chunk){ afree_flush(f); f->chunk = r->chunk; }
+        f->bytes += r->cap;
+        r->owned = 0;
+    }
+    if(r->owned) rec_reset(r, sl->inl, sizeof sl->inl);
+    else { r->line = sl->inl; r->cap = sizeof sl->inl; r->len = 0; r->chunk = NULL; }
+    DERR_STORE_SC(&sl->seq, pos + g_async.mask + 1);
+    DERR_FADD(&g_async.done, 1);
+    // Slot liberato, poi "blocked": con l'ordine inverso in async_wait_space()
+    // almeno uno dei due lati vede l'altro
+    if(DERR_LOAD_SC(&g_async.blocked)){
+        pthread_mutex_lock(&g_async.mu);
+        pthread_cond_signal(&g_async.space);     // uno slot libero, un produttore
+        pthread_mutex_unlock(&g_async.mu);
+    }
+}
+
+// Dopo il commit (store seq_cst dello slot): con l'ordine inverso in
+// async_main() produttore o scrittore vede l'altro
+static void async_wake_writer(void){
+    if(!DERR_LOAD_SC(&g_async.sleeping)) return;
+    pthread_mutex_lock(&g_async.mu);
+    pthread_cond_signal(&g_async.wake);
+    pthread_mutex_unlock(&g_async.mu);
+}
+
+// Ring pieno con DERR_OVERFLOW_BLOCK: attesa (limitata) che lo scrittore liberi
+// lo slot sl, che in posizione p aveva il numero di sequenza seq
+static void async_wait_space(struct derr_aslot *sl, size_t seq){
+    async_wake_writer();
+    pthread_mutex_lock(&g_async.mu);
+    __atomic_fetch_add(&g_async.blocked, 1, __ATOMIC_SEQ_CST);
+    if(DERR_LOAD_SC(&sl->seq) == seq){
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_nsec += 10 * 1000000L;
+        if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&g_async.space, &g_async.mu, &dl);
+    }
+    DERR_FADD(&g_async.blocked, -1);
+    pthread_mutex_unlock(&g_async.mu);
+}
+
+// Riserva uno slot secondo la politica di overflow; NULL = record scartato
+static struct derr_aslot *async_reserve(size_t *pos){
+    size_t p = __atomic_load_n(&g_async.head, __ATOMIC_RELAXED);
+    for(;;){
+        struct derr_aslot *sl = &g_async.slots[p & g_async.mask];
+        size_t seq = DERR_LOAD(&sl->seq);
+        long dif = (long)(seq - p);
+        if(dif == 0){
+            if(DERR_CAS(&g_async.head, &p, p + 1)){ *pos = p; return sl; }
+            continue;
+        }
+        if(dif > 0){ p = __atomic_load_n(&g_async.head, __ATOMIC_RELAXED); continue; }
+
+        // Coda piena
+        switch(__atomic_load_n(&g_async.policy, __ATOMIC_RELAXED)){
+            case DERR_OVERFLOW_DROP_NEWEST:
+                DERR_FADD(&g_async.dropped, 1);
+                return NULL;
+            case DERR_OVERFLOW_DROP_OLDEST: {
+                // Lo slot che serve è ancora in coda solo se tail è fermo al giro
+                // precedente; se lo scrittore lo sta scrivendo (o un produttore
+                // non l'ha ancora pubblicato) scartare altri non lo libera:
+                // si scarta il record corrente invece di attendere
+                size_t old;
+                struct derr_aslot *o = NULL;
+                if(__atomic_load_n(&g_async.tail, __ATOMIC_RELAXED) == p - (g_async.mask + 1))
+                    o = async_pop(&old);
+                if(o) async_release(o, old, NULL);
+                DERR_FADD(&g_async.dropped, 1);
+                if(!o) return NULL;
+                break;
+            }
+            default:
+                async_wait_space(sl, seq);
+                break;
+        }
+        p = __atomic_load_n(&g_async.head, __ATOMIC_RELAXED);
+    }
+}
+
+static void async_commit(struct derr_aslot *sl, size_t pos){
+    DERR_STORE_SC(&sl->seq, pos + 1);
+    async_wake_writer();
+}
+
+// Completa uno slot differito: in rec.line ci sono già gli argomenti serializzati
+static void async_defer(struct derr_aslot *sl, unsigned cfg, const derr_site *site, unsigned sample, derr_level lvl,
+                        int has_errno, int errnum, const char *fmt){
+    struct derr_rec *r = &sl->rec;
+    struct derr_defer *d = &sl->d;
+    int json = DERR_CFG_ENC(cfg) == DERR_ENC_JSON;
+    d->args_len = r->len;
+    rec_put(r, json ? tl_ctx.json : tl_ctx.txt, json ? tl_ctx.json_len : tl_ctx.txt_len);
+    d->o.ctx_len = r->len - d->args_len;
+    d->o.cfg = cfg;
+    d->o.tid = thread_id();
+    ts_capture(&d->o.ts, cfg);
+    d->lvl = lvl; d->has_errno = has_errno; d->errnum = errnum;
+    d->fmt = fmt; d->site = site; d->sample = sample;
+    d->on = 1;
+}
+
+// Riempie lo slot: con la formattazione differita il produttore copia solo
+// argomenti (stringhe comprese) e contesto; se il formato ha conversioni che
+// il log binario non sa serializzare il record è costruito subito.
+static void async_fill(struct derr_aslot *sl, const derr_site *site, unsigned sample, derr_level lvl,
+                       int has_errno, int errnum, const char *fmt, va_list *app, const derr_kv *kv, size_t nkv){
+    unsigned cfg = cfg_get();
+    struct derr_defer *d = &sl->d;
+    d->on = 0;
+    // Solo il puntatore al formato arriva allo scrittore: deve essere un letterale
+    if((cfg & DERR_CFG_DEFER) && app && !kv && site && site->static_fmt){
+        struct derr_rec *r = &sl->rec;
+        r->len = 0;
+        va_list aq; va_copy(aq, *app);
+        int ok = bin_pack_args(r, fmt, aq);
+        va_end(aq);
+        if(ok){ async_defer(sl, cfg, site, sample, lvl, has_errno, errnum, fmt); return; }
+    }
+    rec_build(&sl->rec, site, sample, lvl, has_errno, errnum, fmt, app, kv, nkv);
+}
+
+static struct derr_rec *tl_rec_get(void);
+
+// Lato scrittore: messaggio dagli argomenti catturati, poi il record completo
+static void async_write_deferred(struct derr_aslot *sl){
+    struct derr_defer *d = &sl->d;
+    char inl[512];
+    struct derr_rec m; rec_init(&m, inl, sizeof inl);
+    m.len = 0;
+    bin_render(&m, d->fmt, (const unsigned char *)sl->rec.line, d->args_len);
+    if(!rec_reserve(&m, m.len + 1)) m.len = m.cap - 1;
+    m.line[m.len] = 0;
+    d->o.ctx = sl->rec.line + d->args_len;
+    struct derr_rec *out = tl_rec_get();
+    rec_build_at(out, &d->o, d->site, d->sample, d->lvl, d->has_errno, d->errnum, m.line, NULL, NULL, 0);
+    write_sinks(out);
+    rec_reset(&m, inl, sizeof inl);
+}
+
+// 1 se lo slot in testa è pubblicato (async_pop lo estrarrebbe)
+static int async_ready(void){
+    size_t p = DERR_LOAD(&g_async.tail);
+    return DERR_LOAD_SC(&g_async.slots[p & g_async.mask].seq) == p + 1;
+}
+
+// Scrive tutto ciò che è in coda; ritorna il numero di record scritti
+static size_t async_drain(void){
+    size_t n = 0, pos;
+    struct derr_aslot *sl;
+    struct derr_afree f = { NULL, 0 };
+    while((sl = async_pop(&pos)) != NULL){
+        if(sl->d.on) async_write_deferred(sl);
+        else write_sinks(&sl->rec);
+        async_release(sl, pos, &f);
+        n++;
+    }
+    afree_flush(&f);
+    return n;
+}
+
+static void async_notify_drained(void){
+    if(!DERR_LOAD(&g_async.waiters)) return;
+    pthread_mutex_lock(&g_async.mu);
+    pthread_cond_broadcast(&g_async.drained);
+    pthread_mutex_unlock(&g_async.mu);
+}
+
+static void *async_main(void *arg){
+    (void)arg;
+    for(;;){
+        if(async_drain()) sinks_idle_flush();
+        async_notify_drained();
+        // stderr non bloccante: il buffer di riserva si svuota anche senza nuovi record
+        if(DERR_LOAD(&g_nb.on)){
+            struct derr_lock *lk = &g_sinks[DERR_SINK_STDERR].lk;
+            dlock(lk);
+            if(nb_pump()) nb_notice();
+            dunlock(lk);
+        }
+
+        pthread_mutex_lock(&g_async.mu);
+        if(g_async.stop){ pthread_mutex_unlock(&g_async.mu); break; }
+        DERR_STORE_SC(&g_async.sleeping, 1);
+        // Ricontrolla dopo aver pubblicato "sleeping": un produttore che ha
+        // committato prima non ha visto il flag e non ci sveglierà. Si dorme
+        // anche con uno slot riservato ma non ancora pubblicato (produttore
+        // descheduled o morto a metà): il suo commit sveglia, il timeout limita.
+        if(!async_ready()){
+            struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+            dl.tv_nsec += 50 * 1000000L;
+            if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&g_async.wake, &g_async.mu, &dl);
+        }
+        DERR_STORE(&g_async.sleeping, 0);
+        pthread_mutex_unlock(&g_async.mu);
+    }
+    async_drain();
+    async_notify_drained();
+    return NULL;
+}
+
+// Attende che tutti i record accodati finora siano stati scritti
+static void async_wait_drained(void){
+    size_t target = DERR_LOAD(&g_async.head);
+    pthread_mutex_lock(&g_async.mu);
+    DERR_FADD(&g_async.waiters, 1);
+    while((long)(DERR_LOAD(&g_async.done) - target) < 0 && DERR_LOAD(&g_async.running)){
+        pthread_cond_signal(&g_async.wake);
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_nsec += 10 * 1000000L;
+        if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&g_async.drained, &g_async.mu, &dl);
+    }
+    DERR_FADD(&g_async.waiters, -1);
+    pthread_mutex_unlock(&g_async.mu);
+}
+#endif
+
+#if DERR_POSIX
+// ---- Sink syslog / journald su socket datagram ----
+// I record sono copiati in un'arena del sink (protetta dal suo lock) e
+// spediti insieme: subito in modalità sincrona e da ERROR in su, altrimenti a
+// batch pieno o quando lo scrittore asincrono ha svuotato la coda.
+#define DERR_DGRAM_BATCH 32
+#define DERR_DGRAM_ARENA (64 * 1024)
+#define DERR_DGRAM_MAX   8192      // oltre, il messaggio è troncato
+
+struct derr_dgram_sink {
+    int                fd;
+    int                proto;
+    char              *path;
+    char               hdr[256];       // "prog[pid]: " oppure SYSLOG_IDENTIFIER/SYSLOG_PID
+    size_t             hdr_len;
+    size_t             n, used;
+    size_t             off[DERR_DGRAM_BATCH], len[DERR_DGRAM_BATCH];
+    time_t             ts_sec;         // cache del timestamp RFC 3164
+    char               ts_str[16];
+    unsigned long long dropped;
+    char               arena[DERR_DGRAM_ARENA];
+};
+
+// sendmmsg via syscall: la dichiarazione di libc richiede _GNU_SOURCE
+#if defined(__linux__) && defined(SYS_sendmmsg)
+#define DERR_HAVE_SENDMMSG 1
+struct derr_mmsghdr { struct msghdr msg_hdr; unsigned int msg_len; };
+#endif
+
+static int dgram_connect(struct derr_dgram_sink *d){
+    if(d->fd >= 0) close(d->fd);
+    d->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if(d->fd < 0) return -1;
+    fcntl(d->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) | O_NONBLOCK);
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof sa.sun_path, "%s", d->path);
+    if(connect(d->fd, (struct sockaddr *)&sa, sizeof sa) != 0){
+        int e = errno; close(d->fd); d->fd = -1; errno = e; return -1;
+    }
+    return 0;
+}
+
+static void dgram_send(struct derr_dgram_sink *d){
+    size_t i = 0;
+    int retried = 0;
+    while(i < d->n){
+        ssize_t sent;
+#if defined(DERR_HAVE_SENDMMSG)
+        struct derr_mmsghdr mv[DERR_DGRAM_BATCH];
+        struct iovec        iv[DERR_DGRAM_BATCH];
+        size_t cnt = d->n - i;
+        memset(mv, 0, sizeof mv[0] * cnt);
+        for(size_t j = 0; j < cnt; j++){
+            DERR_IOV(iv, j, d->arena + d->off[i + j], d->len[i + j]);
+            mv[j].msg_hdr.msg_iov = &iv[j]; mv[j].msg_hdr.msg_iovlen = 1;
+        }
+        sent = d->fd >= 0 ? (ssize_t)syscall(SYS_sendmmsg, d->fd, mv, (unsigned)cnt, MSG_DONTWAIT) : -1;
+#else
+        sent = d->fd >= 0 && send(d->fd, d->arena + d->off[i], d->len[i], 0) >= 0 ? 1 : -1;
+#endif
+        if(sent > 0){ i += (size_t)sent; continue; }
+        if(sent < 0 && errno == EINTR) continue;
+        // Demone riavviato: una riconnessione, poi si rinuncia al batch
+        if(!retried && (d->fd < 0 || errno == ECONNREFUSED || errno == ENOTCONN || errno == ENOENT)){
+            retried = 1;
+            if(dgram_connect(d) == 0) continue;
+        }
+        DERR_FADD(&d->dropped, (unsigned long long)(d->n - i));    // ENOBUFS, EAGAIN, ...
+        break;
+    }
+    d->n = 0; d->used = 0;
+}
+
+static void dgram_put(struct derr_dgram_sink *d, size_t *k, const char *s, size_t n){
+    size_t room = DERR_DGRAM_MAX - (*k - d->used);
+    if(n > room) n = room;
+    memcpy(d->arena + *k, s, n); *k += n;
+}
+
+static void dgram_sink_write(void *ctx, const derr_record *p){
+    struct derr_dgram_sink *d = (struct derr_dgram_sink *)ctx;
+    const struct derr_rec *rec = (const struct derr_rec *)p;
+    if(d->n == DERR_DGRAM_BATCH || d->used + DERR_DGRAM_MAX > DERR_DGRAM_ARENA) dgram_send(d);
+
+    // Corpo: messaggio, campi e suffisso errno (TEXT) o la riga intera (JSON/logfmt)
+    const char *body; size_t blen;
+    if(rec->enc == DERR_ENC_TEXT){ body = rec->line + rec->msg_off; blen = rec->detail_off - 1 - rec->msg_off; }
+    else { body = rec->line; blen = rec->len - 1; }
+
+    size_t k = d->used;
+    char num[24];
+    int prio = LOG_USER | syslog_prio(rec->lvl);
+    if(d->proto == DERR_SYSLOG_JOURNAL){
+        dgram_put(d, &k, "PRIORITY=", 9);
+        num[0] = (char)('0' + syslog_prio(rec->lvl)); dgram_put(d, &k, num, 1);
+        dgram_put(d, &k, "\n", 1);
+        dgram_put(d, &k, d->hdr, d->hdr_len);
+        // Il messaggio si tronca prima di scriverne la lunghezza: un MESSAGE binario
+        // più corto del dichiarato, o senza '\n' finale, journald lo scarta intero.
+        // Resta posto per intestazione binaria, '\n' e "ERRNO=<n>\n".
+        size_t room = DERR_DGRAM_MAX - (k - d->used) - 16 - 1 - 27;
+        size_t mb = blen < room ? blen : room;
+        size_t es = p->errstr ? 4 + p->errstr_len : 0;
+        if(es > room - mb) es = room - mb;
+        size_t ml = mb + es;
+        if(memchr(body, '\n', mb)){
+            // Forma binaria: "MESSAGE\n" + lunghezza little‑endian a 64 bit + dati
+            unsigned char le[8];
+            for(int b = 0; b < 8; b++) le[b] = (unsigned char)((unsigned long long)ml >> (8 * b));
+            dgram_put(d, &k, "MESSAGE\n", 8); dgram_put(d, &k, (const char *)le, 8);
+        } else dgram_put(d, &k, "MESSAGE=", 8);
+        dgram_put(d, &k, body, mb);
+        if(es){
+            dgram_put(d, &k, " -> ", es < 4 ? es : 4);
+            if(es > 4) dgram_put(d, &k, p->errstr, es - 4);
+        }
+        dgram_put(d, &k, "\n", 1);
+        if(p->has_errno){
+            dgram_put(d, &k, "ERRNO=", 6);
+            dgram_put(d, &k, num, put_u64(num, (unsigned long long)(p->errnum < 0 ? 0 : p->errnum)));
+            dgram_put(d, &k, "\n", 1);
+        }
+    } else {
+        if(p->ts.tv_sec != d->ts_sec){
+            static const char mon[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+            time_t sec = p->ts.tv_sec; struct tm tmv;
+            localtime_r(&sec, &tmv);
+            char *t = d->ts_str;
+            memcpy(t, mon + 3 * tmv.tm_mon, 3); t[3] = ' ';
+            t[4] = tmv.tm_mday < 10 ? ' ' : (char)('0' + tmv.tm_mday / 10); t[5] = (char)('0' + tmv.tm_mday % 10);
+            t[6] = ' ';
+            put_digits(t + 7, (unsigned long)tmv.tm_hour, 2); t[9] = ':';
+            put_digits(t + 10, (unsigned long)tmv.tm_min, 2); t[12] = ':';
+            put_digits(t + 13, (unsigned long)tmv.tm_sec, 2); t[15] = ' ';
+            d->ts_sec = p->ts.tv_sec;
+        }
+        num[0] = '<'; size_t nk = 1 + put_u64(num + 1, (unsigned long long)prio); num[nk++] = '>';
+        dgram_put(d, &k, num, nk);
+        dgram_put(d, &k, d->ts_str, 16);
+        dgram_put(d, &k, d->hdr, d->hdr_len);
+        dgram_put(d, &k, body, blen);
+        if(p->errstr){ dgram_put(d, &k, " -> ", 4); dgram_put(d, &k, p->errstr, p->errstr_len); }
+    }
+    d->off[d->n] = d->used; d->len[d->n] = k - d->used;
+    d->n++; d->used = k;
+
+    if(!DERR_LOAD(&g_async.running) || rec->lvl >= DERR_ERROR || d->n == DERR_DGRAM_BATCH) dgram_send(d);
+}
+
+static void dgram_sink_flush(void *ctx){
+    struct derr_dgram_sink *d = (struct derr_dgram_sink *)ctx;
+    if(d->n) dgram_send(d);
+}
+
+static void dgram_sink_close(void *ctx){
+    struct derr_dgram_sink *d = (struct derr_dgram_sink *)ctx;
+    if(d->fd >= 0) close(d->fd);
+    free(d->path);
+    free(d);
+}
+
+static const derr_sink_vtable g_dgram_vt = { dgram_sink_write, dgram_sink_flush, dgram_sink_close, DERR_SINK_IDLE_FLUSH };
+
+// ---- Sink di rete ----
+// write() (sotto il lock del sink) costruisce il frame già pronto per il filo
+// e lo copia nella coda circolare come [u32 lunghezza][byte]; il thread del
+// sink stacca sotto il mutex un lotto di frame interi e lo spedisce fuori dal
+// lock. Su TCP un lotto fallito resta in sospeso e riparte dopo la
+// riconnessione (un frame può arrivare due volte; ciò che il kernel ha già
+// accettato prima che il peer chiudesse è invece perso).
+#define DERR_NET_BATCH       65536u   // byte per lotto, e frame massimo
+#define DERR_NET_BACKOFF0    100u     // ms, raddoppia a ogni tentativo fallito
+#define DERR_NET_BACKOFF_MAX 30000u
+#define DERR_NET_CONNECT_MS  2000
+#define DERR_NET_BLOCK_MS    100      // attesa massima di spazio con DERR_OVERFLOW_BLOCK
+#define DERR_NET_STALL_MS    5000     // TCP senza progressi: connessione considerata persa
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0                // BSD/macOS: SO_NOSIGPIPE sul socket
+#endif
+
+struct derr_net_sink {
+    pthread_mutex_t    mu;
+    pthread_cond_t     cv;           // frame in coda / stop (thread del sink)
+    pthread_cond_t     space;        // spazio liberato, lotto spedito, connessione persa
+    pthread_t          th;
+    int                tr, fmt;
+    int                fd;           // solo il thread del sink
+    int                up;           // connesso; sotto mu
+    int                connecting;   // tentativo di connessione in corso; sotto mu
+    int                stop;
+    char              *host, *port;
+    char               hostname[256];
+    char               app[64];
+    long               pid;
+    char              *ring;
+    size_t             cap, head, len;
+    size_t             pend;         // byte del lotto in out non ancora spediti
+    unsigned long long dropped;
+    time_t             ts_sec;       // cache di "YYYY-MM-DDTHH:MM:SS" (UTC)
+    char               ts_str[20];
+    struct derr_rec    fr;           // frame in costruzione
+    char               inl[1024];
+    char               out[DERR_NET_BATCH];
+};
+
+static void net_ring_put(struct derr_net_sink *n, size_t pos, const void *s, size_t len){
+    pos %= n->cap;
+    size_t a = n->cap - pos < len ? n->cap - pos : len;
+    memcpy(n->ring + pos, s, a);
+    memcpy(n->ring, (const char *)s + a, len - a);
+}
+
+static void net_ring_get(struct derr_net_sink *n, size_t pos, void *d, size_t len){
+    pos %= n->cap;
+    size_t a = n->cap - pos < len ? n->cap - pos : len;
+    memcpy(d, n->ring + pos, a);
+    memcpy((char *)d + a, n->ring, len - a);
+}
+
+static void net_drop_head(struct derr_net_sink *n){
+    uint32_t fl; net_ring_get(n, n->head, &fl, 4);
+    n->head = (n->head + 4 + fl) % n->cap;
+    n->len -= 4 + fl;
+}
+
+// Stacca frame interi dalla testa della coda in out: su TCP i soli byte del
+// flusso, su UDP con la lunghezza davanti (un datagramma per frame)
+static size_t net_take(struct derr_net_sink *n){
+    size_t k = 0, hl = n->tr == DERR_NET_UDP ? 4 : 0;
+    while(n->len){
+        uint32_t fl; net_ring_get(n, n->head, &fl, 4);
+        if(k + hl + fl > DERR_NET_BATCH) break;
+        if(hl) memcpy(n->out + k, &fl, 4);
+        net_ring_get(n, n->head + 4, n->out + k + hl, fl);
+        k += hl + fl;
+        n->head = (n->head + 4 + fl) % n->cap;
+        n->len -= 4 + fl;
+    }
+    return k;
+}
+
+// Corpo del record come nel sink syslog: messaggio e campi (TEXT) o la riga intera
+static void net_body(const struct derr_rec *rec, const char **s, size_t *n){
+    if(rec->enc == DERR_ENC_TEXT){ *s = rec->line + rec->msg_off; *n = rec->detail_off - 1 - rec->msg_off; }
+    else { *s = rec->line; *n = rec->len - 1; }
+}
+
+static void net_frame(struct derr_net_sink *n, const struct derr_rec *rec){
+    const derr_record *p = &rec->pub;
+    struct derr_rec *f = &n->fr;
+    char num[24];
+    int sev = syslog_prio(rec->lvl);
+    unsigned ms = (unsigned)(p->ts.tv_nsec / 1000000);
+    f->len = 0;
+    if(n->fmt == DERR_NET_GELF){
+        // Nei formati JSON/logfmt msg ed errstr hanno già l'escape JSON
+        int esc = rec->enc == DERR_ENC_TEXT;
+        rec_put(f, "{\"version\":\"1.1\",\"host\":\"", 25);
+        rec_put_json(f, n->hostname, strlen(n->hostname));
+        rec_put(f, "\",\"short_message\":\"", 19);
+        if(esc){ const char *b; size_t bl; net_body(rec, &b, &bl); rec_put_json(f, b, bl); }
+        else rec_put(f, p->msg, p->msg_len);
+        rec_put(f, "\",\"timestamp\":", 14);
+        rec_put(f, num, put_u64(num, (unsigned long long)p->ts.tv_sec));
+        num[0] = '.'; put_digits(num + 1, ms, 3); rec_put(f, num, 4);
+        rec_put(f, ",\"level\":", 9);
+        num[0] = (char)('0' + sev); rec_put(f, num, 1);
+        rec_put(f, ",\"_app\":\"", 9); rec_put_json(f, n->app, strlen(n->app));
+        rec_put(f, "\",\"_pid\":", 9); rec_put(f, num, put_u64(num, (unsigned long long)n->pid));
+        rec_put(f, ",\"_tid\":", 8); rec_put(f, num, put_u64(num, p->tid));
+        if(p->has_errno){
+            rec_put(f, ",\"_errno\":", 10); rec_put_i64(f, p->errnum);
+            if(p->errname){ rec_put(f, ",\"_errname\":\"", 13); rec_puts(f, p->errname); rec_put(f, "\"", 1); }
+            rec_put(f, ",\"_error\":\"", 11);
+            if(esc) rec_put_json(f, p->errstr, p->errstr_len);
+            else rec_put(f, p->errstr, p->errstr_len);
+            rec_put(f, "\"", 1);
+        }
+        rec_put(f, "}", 1);
+        if(n->tr == DERR_NET_TCP) rec_put(f, "", 1);    // terminatore '\0'
+        return;
+    }
+
+    // <PRI>1 TIMESTAMP HOST APP PID - - MSG
+    if(p->ts.tv_sec != n->ts_sec){
+        time_t sec = p->ts.tv_sec; struct tm tmv;
+        gmtime_r(&sec, &tmv);
+        char *t = n->ts_str;
+        put_digits(t, (unsigned long)(tmv.tm_year + 1900), 4); t[4] = '-';
+        put_digits(t + 5, (unsigned long)(tmv.tm_mon + 1), 2); t[7] = '-';
+        put_digits(t + 8, (unsigned long)tmv.tm_mday, 2); t[10] = 'T';
+        put_digits(t + 11, (unsigned long)tmv.tm_hour, 2); t[13] = ':';
+        put_digits(t + 14, (unsigned long)tmv.tm_min, 2); t[16] = ':';
+        put_digits(t + 17, (unsigned long)tmv.tm_sec, 2);
+        n->ts_sec = p->ts.tv_sec;
+    }
+    num[0] = '<'; size_t nk = 1 + put_u64(num + 1, (unsigned long long)(LOG_USER | sev));
+    memcpy(num + nk, ">1 ", 3); nk += 3;
+    rec_put(f, num, nk);
+    rec_put(f, n->ts_str, 19);
+    num[0] = '.'; put_digits(num + 1, ms, 3); num[4] = 'Z'; num[5] = ' ';
+    rec_put(f, num, 6);
+    rec_puts(f, n->hostname); rec_put(f, " ", 1);
+    rec_puts(f, n->app); rec_put(f, " ", 1);
+    rec_put(f, num, put_u64(num, (unsigned long long)n->pid));
+    rec_put(f, " - - ", 5);
+    const char *b; size_t bl; net_body(rec, &b, &bl);
+    rec_put(f, b, bl);
+    if(p->errstr && rec->enc == DERR_ENC_TEXT){ rec_put(f, " -> ", 4); rec_put(f, p->errstr, p->errstr_len); }
+}
+
+static void net_sink_write(void *ctx, const derr_record *p){
+    struct derr_net_sink *n = (struct derr_net_sink *)ctx;
+    net_frame(n, (const struct derr_rec *)p);
+    char pre[24]; size_t pl = 0;
+    if(n->tr == DERR_NET_TCP && n->fmt == DERR_NET_RFC5424){ pl = put_u64(pre, n->fr.len); pre[pl++] = ' '; }
+    size_t fl = pl + n->fr.len, need = 4 + fl;
+    if(need > DERR_NET_BATCH || need > n->cap){ DERR_FADD(&n->dropped, 1); return; }
+
+    // DERR_OVERFLOW_BLOCK attende solo sullo scrittore asincrono, e per poco:
+    // chi chiama derr_log() in modo sincrono non resta fermo sulla rete
+    int can_wait = DERR_LOAD(&g_async.running) && pthread_equal(pthread_self(), g_async_th);
+    struct timespec dl = { 0, 0 };
+    pthread_mutex_lock(&n->mu);
+    while(n->cap - n->len < need){
+        int pol = __atomic_load_n(&g_async.policy, __ATOMIC_RELAXED);
+        if(pol == DERR_OVERFLOW_DROP_OLDEST && n->len){ net_drop_head(n); DERR_FADD(&n->dropped, 1); continue; }
+        if(pol == DERR_OVERFLOW_BLOCK && can_wait && n->up && !n->stop){
+            if(!dl.tv_sec){
+                clock_gettime(CLOCK_REALTIME, &dl);
+                dl.tv_nsec += DERR_NET_BLOCK_MS * 1000000L;
+                if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+            }
+            if(pthread_cond_timedwait(&n->space, &n->mu, &dl) != ETIMEDOUT) continue;
+        }
+        pthread_mutex_unlock(&n->mu);
+        DERR_FADD(&n->dropped, 1);
+        return;
+    }
+    uint32_t l32 = (uint32_t)fl;
+    size_t tail = n->head + n->len;
+    net_ring_put(n, tail, &l32, 4);
+    net_ring_put(n, tail + 4, pre, pl);
+    net_ring_put(n, tail + 4 + pl, n->fr.line, n->fr.len);
+    n->len += need;
+    pthread_cond_signal(&n->cv);
+    pthread_mutex_unlock(&n->mu);
+}
+
+// connect() con timeout: un host che non risponde non blocca il thread per minuti
+static int net_connect(struct derr_net_sink *n){
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = n->tr == DERR_NET_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    if(getaddrinfo(n->host, n->port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for(ai = res; ai && fd < 0; ai = ai->ai_next){
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0) continue;
+        int fl = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+        int rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if(rc != 0 && errno == EINPROGRESS){
+            struct pollfd pf = { fd, POLLOUT, 0 };
+            int err = ETIMEDOUT; socklen_t el = sizeof err;
+            if(poll(&pf, 1, DERR_NET_CONNECT_MS) == 1) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &el);
+            rc = err ? -1 : 0;
+        }
+        if(rc != 0){ close(fd); fd = -1; continue; }
+        fcntl(fd, F_SETFL, fl);
+    }
+    freeaddrinfo(res);
+    if(fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct timeval tv = { 1, 0 };       // send() bloccata si sveglia per vedere stop
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+#ifdef SO_NOSIGPIPE
+    int one = 1; setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+    n->fd = fd;
+    return 0;
+}
+
+// 0 = lotto spedito. UDP non ritenta: un datagramma rifiutato è perso e contato
+static int net_send(struct derr_net_sink *n, size_t len){
+    if(n->tr == DERR_NET_UDP){
+        for(size_t k = 0; k < len;){
+            uint32_t fl; memcpy(&fl, n->out + k, 4);
+            ssize_t w;
+            do w = send(n->fd, n->out + k + 4, fl, MSG_NOSIGNAL); while(w < 0 && errno == EINTR);
+            if(w < 0) DERR_FADD(&n->dropped, 1);
+            k += 4 + fl;
+        }
+        return 0;
+    }
+    // Un collettore che accetta ma non legge: send() torna EAGAIN ogni secondo
+    // (SO_SNDTIMEO); dopo DERR_NET_STALL_MS senza un byte la connessione è persa
+    unsigned stalled_ms = 0;
+    for(size_t k = 0; k < len;){
+        ssize_t w = send(n->fd, n->out + k, len - k, MSG_NOSIGNAL);
+        if(w > 0){ k += (size_t)w; stalled_ms = 0; continue; }
+        if(w < 0 && errno == EINTR) continue;
+        if(w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !DERR_LOAD(&n->stop)
+           && (stalled_ms += 1000) < DERR_NET_STALL_MS) continue;
+        return -1;
+    }
+    return 0;
+}
+
+// Pausa di backoff: i nuovi record non la interrompono, solo stop
+static void net_wait(struct derr_net_sink *n, unsigned ms){
+    struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+    dl.tv_sec += ms / 1000;
+    dl.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if(dl.tv_nsec >= 1000000000L){ dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+    while(!n->stop && pthread_cond_timedwait(&n->cv, &n->mu, &dl) != ETIMEDOUT) {}
+}
+
+static void *net_main(void *arg){
+    struct derr_net_sink *n = (struct derr_net_sink *)arg;
+    unsigned backoff = 0;
+    pthread_mutex_lock(&n->mu);
+    for(;;){
+        if(n->fd < 0){
+            if(n->stop) break;
+            n->connecting = 1;
+            pthread_mutex_unlock(&n->mu);
+            int rc = net_connect(n);
+            pthread_mutex_lock(&n->mu);
+            n->connecting = 0;
+            pthread_cond_broadcast(&n->space);
+            if(rc != 0){
+                backoff = !backoff ? DERR_NET_BACKOFF0
+                        : backoff >= DERR_NET_BACKOFF_MAX / 2 ? DERR_NET_BACKOFF_MAX : backoff * 2;
+                net_wait(n, backoff);
+                continue;
+            }
+            backoff = 0;
+            n->up = 1;
+        }
+        if(!n->pend){
+            if(!n->len){
+                if(n->stop) break;
+                pthread_cond_wait(&n->cv, &n->mu);
+                continue;
+            }
+            n->pend = net_take(n);
+            pthread_cond_broadcast(&n->space);
+        }
+        size_t len = n->pend;
+        pthread_mutex_unlock(&n->mu);
+        int rc = net_send(n, len);
+        pthread_mutex_lock(&n->mu);
+        if(rc == 0) n->pend = 0;
+        else { close(n->fd); n->fd = -1; n->up = 0; }
+        pthread_cond_broadcast(&n->space);
+    }
+    n->up = 0;
+    pthread_cond_broadcast(&n->space);
+    pthread_mutex_unlock(&n->mu);
+    return NULL;
+}
+
+// derr_flush(): attende che la coda sia spedita finché la connessione regge
+// (o è in corso un tentativo, come all'avvio); mai oltre 2 s
+static void net_sink_flush(void *ctx){
+    struct derr_net_sink *n = (struct derr_net_sink *)ctx;
+    struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+    dl.tv_sec += 2;
+    pthread_mutex_lock(&n->mu);
+    while((n->len || n->pend) && (n->up || n->connecting))
+        if(pthread_cond_timedwait(&n->space, &n->mu, &dl) == ETIMEDOUT) break;
+    pthread_mutex_unlock(&n->mu);
+}
+
+static void net_sink_close(void *ctx){
+    struct derr_net_sink *n = (struct derr_net_sink *)ctx;
+    if(n->ring){
+        pthread_mutex_lock(&n->mu);
+        n->stop = 1;
+        pthread_cond_signal(&n->cv);
+        pthread_cond_broadcast(&n->space);
+        pthread_mutex_unlock(&n->mu);
+        pthread_join(n->th, NULL);
+    }
+    if(n->fd >= 0) close(n->fd);
+    rec_reset(&n->fr, n->inl, sizeof n->inl);
+    pthread_cond_destroy(&n->space);
+    pthread_cond_destroy(&n->cv);
+    pthread_mutex_destroy(&n->mu);
+    free(n->ring); free(n->host); free(n->port);
+    free(n);
+}
+
+static const derr_sink_vtable g_net_vt = { net_sink_write, net_sink_flush, net_sink_close, 0 };
+#endif
+
+// ---- Crash handler ----
+// Tutto ciò che serve all'handler è preparato all'installazione: stack
+// alternativo, backtrace() già risolto (il primo uso carica libgcc con dlopen),
+// azioni precedenti da ripristinare.
+#if DERR_POSIX
+static const int g_crash_sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+#define DERR_CRASH_NSIG ((int)(sizeof g_crash_sigs / sizeof g_crash_sigs[0]))
+
+static struct derr_crash {
+    int              installed;
+    int              active;       // un thread sta già riportando un crash
+    int              fatal_done;   // FATAL già riportato (DASSERT → abort)
+    void            *altstack;
+    struct sigaction old[DERR_CRASH_NSIG];
+} g_crash;
+
+static const char *crash_signame(int sig){
+    switch(sig){
+        case SIGSEGV: return "SIGSEGV";
+        case SIGBUS:  return "SIGBUS";
+        case SIGFPE:  return "SIGFPE";
+        case SIGILL:  return "SIGILL";
+        case SIGABRT: return "SIGABRT";
+        default:      return "segnale";
+    }
+}
+
+static void crash_puts(const char *s){ fr_write(STDERR_FILENO, s, strlen(s)); }
+
+static void crash_handler(int sig, siginfo_t *si, void *uc){
+    (void)uc;
+    if(__atomic_exchange_n(&g_crash.active, 1, __ATOMIC_ACQ_REL)){
+        // Un altro thread sta già scrivendo il report: il processo terminerà con lui
+        for(;;) pause();
+    }
+    int fatal_done = DERR_LOAD(&g_crash.fatal_done);
+
+    // stderr di nuovo bloccante; quanto resta nel buffer di riserva esce per primo
+    if(DERR_LOAD(&g_nb.on)){
+        int fl = fcntl(STDERR_FILENO, F_GETFL);
+        if(fl >= 0) fcntl(STDERR_FILENO, F_SETFL, fl & ~O_NONBLOCK);
+        if(g_nb.len) fr_write(STDERR_FILENO, g_nb.buf + g_nb.off, g_nb.len);
+    }
+
+    // Righe accodate e non ancora scritte (modalità asincrona): estratte dal ring
+    // e scritte come testo semplice, senza restituire gli slot (free non è sicura).
+    // Uno slot differito contiene gli argomenti impacchettati, non testo: qui la
+    // resa non si può fare, esce solo il formato.
+    if(DERR_LOAD(&g_async.running) && g_async.slots){
+        size_t pos; struct derr_aslot *sl;
+        while((sl = async_pop(&pos)) != NULL){
+            if(!sl->d.on){ fr_write(STDERR_FILENO, sl->rec.line, sl->rec.len); continue; }
+            crash_puts("["); crash_puts(level_str(sl->d.lvl));
+            crash_puts("] <record differito, argomenti non resi> ");
+            crash_puts(sl->d.fmt ? sl->d.fmt : "");
+            crash_puts("\n");
+        }
+    }
+
+    char buf[128]; size_t k = 0;
+    const char *prog = prog_name();
+    crash_puts("*** "); crash_puts(prog); crash_puts(": ricevuto "); crash_puts(crash_signame(sig));
+    if(sig != SIGABRT && si){
+        uintptr_t a = (uintptr_t)si->si_addr;
+        memcpy(buf, " (indirizzo 0x", 14); k = 14;
+        char hex[2 * sizeof a]; size_t n = 0;
+        do { hex[n++] = "0123456789abcdef"[a & 15]; a >>= 4; } while(a);
+        while(n) buf[k++] = hex[--n];
+        buf[k++] = ')';
+        fr_write(STDERR_FILENO, buf, k);
+    }
+    crash_puts(" ***\n");
+
+    if(!fatal_done){
+#if defined(EXECINFO_H) || (defined(__linux__) && !defined(__ANDROID__))
+        void *bt[128];
+        int n = backtrace(bt, 128);
+        if(n > 0){
+            k = 11; memcpy(buf, "Backtrace (", 11);
+            k += put_u64(buf + k, (unsigned long long)n);
+            memcpy(buf + k, " frames):\n", 10); k += 10;
+            fr_write(STDERR_FILENO, buf, k);
+            backtrace_symbols_fd(bt, n, STDERR_FILENO);
+        }
+#endif
+        fr_dump_fd(STDERR_FILENO);
+    }
+
+    // Handler precedente (o default) e nuovo invio: core dump / exit status corretti
+    for(int i = 0; i < DERR_CRASH_NSIG; i++)
+        if(g_crash_sigs[i] == sig) sigaction(sig, &g_crash.old[i], NULL);
+    raise(sig);
+}
+#endif
+
+// Record per‑thread del percorso sincrono: parte dal buffer inline, l'eventuale
+// capacità cresciuta resta al thread (liberata all'uscita del thread)
+#define DERR_TL_INLINE 2048
+static DERR_TLS struct derr_rec tl_rec;
+static DERR_TLS char tl_rec_inl[DERR_TL_INLINE];
+
+#if DERR_POSIX
+static pthread_key_t  g_rec_key;
+static pthread_once_t g_rec_once = PTHREAD_ONCE_INIT;
+static void tl_rec_free(void *p){ struct derr_rec *r = (struct derr_rec *)p; if(r->owned){ free(r->line); r->owned = 0; } }
+static void tl_rec_key_init(void){ pthread_key_create(&g_rec_key, tl_rec_free); }
+#endif
+
+static struct derr_rec *tl_rec_get(void){
+    if(!tl_rec.line){
+        rec_init(&tl_rec, tl_rec_inl, sizeof tl_rec_inl);
+#if DERR_POSIX
+        pthread_once(&g_rec_once, tl_rec_key_init);
+        pthread_setspecific(g_rec_key, &tl_rec);
+#endif
+    }
+    return &tl_rec;
+}
+
+// Destinazioni che non passano dai sink: log binario e flight recorder
+static void side_emit(derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
+#if DERR_POSIX
+    // Log binario: niente formattazione sul chiamante
+    if((int)lvl >= __atomic_load_n(&g_bin.min, __ATOMIC_RELAXED) && DERR_LOAD(&g_bin.fd) >= 0){
+        va_list aq; va_copy(aq, ap);
+        bin_emit(lvl, has_errno, errnum, fmt, aq);
+        va_end(aq);
+    }
+    if((int)lvl >= __atomic_load_n(&g_fr.min, __ATOMIC_RELAXED)){
+        va_list aq; va_copy(aq, ap);
+        fr_record(lvl, has_errno, errnum, fmt, aq);
+        va_end(aq);
+    }
+#else
+    (void)lvl; (void)has_errno; (void)errnum; (void)fmt; (void)ap;
+#endif
+}
+
+static int side_wants(derr_level lvl){
+#if DERR_POSIX
+    return ((int)lvl >= __atomic_load_n(&g_bin.min, __ATOMIC_RELAXED) && DERR_LOAD(&g_bin.fd) >= 0)
+        || (int)lvl >= __atomic_load_n(&g_fr.min, __ATOMIC_RELAXED);
+#else
+    (void)lvl; return 0;
+#endif
+}
+
+static void side_emitf(derr_level lvl, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); side_emit(lvl, 0, 0, fmt, ap); va_end(ap);
+}
+
+// Record verso i sink: accodato in modalità asincrona, altrimenti scritto qui
+static void emit_build(const derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum, const char *fmt, va_list *app,
+                       const derr_kv *kv, size_t nkv){
+#if DERR_POSIX
+    if(DERR_LOAD(&g_async.running)){
+        if(lvl < DERR_FATAL){
+            // inflight impedisce a derr_async_stop() di liberare il ring sotto di noi
+            DERR_FADD(&g_async.inflight, 1);
+            if(DERR_LOAD(&g_async.running)){
+                size_t pos;
+                struct derr_aslot *sl = async_reserve(&pos);
+                if(sl){
+                    async_fill(sl, site, sample, lvl, has_errno, errnum, fmt, app, kv, nkv);
+                    async_commit(sl, pos);
+                }
+                DERR_FADD(&g_async.inflight, -1);
+                return;
+            }
+            DERR_FADD(&g_async.inflight, -1);
+        } else {
+            // FATAL: prima tutto ciò che è in coda, poi il record (con backtrace)
+            async_wait_drained();
+        }
+    }
+#endif
+
+    struct derr_rec *rec = tl_rec_get();
+    rec_build(rec, site, sample, lvl, has_errno, errnum, fmt, app, kv, nkv);
+    write_sinks(rec);
+}
+
+// eff/text: soglie globali o quelle del modulo risolte nel derr_site
+static void vemit_at(const derr_site *site, unsigned sample, derr_level lvl, int eff, int text, int has_errno, int errnum, const char *fmt, va_list ap){
+    struct derr_tstats *t = stats_tl();
+    if((int)lvl < eff){ stat_add(&t->filtered, 1); return; }
+    stat_level(t->emitted, lvl);
+    side_emit(lvl, has_errno, errnum, fmt, ap);
+    if((int)lvl < text) return;
+    va_list aq; va_copy(aq, ap);
+    emit_build(site, sample, lvl, has_errno, errnum, fmt, &aq, NULL, 0);
+    va_end(aq);
+}
+
+static void vemit(derr_level lvl, int has_errno, int errnum, const char *fmt, va_list ap){
+    // La soglia iniziale è DEBUG: il primo record passa di qui e applica DERR_LEVELS
+    mods_env_load();
+    vemit_at(NULL, 0, lvl, __atomic_load_n(&derr_g_hot.min_level, __ATOMIC_RELAXED),
+             __atomic_load_n(&derr_g_hot.text_min, __ATOMIC_RELAXED), has_errno, errnum, fmt, ap);
+}
+
+static void vemit_site(derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum,
+                       const char *fmt, va_list ap){
+    mods_env_load();
+    unsigned long long c = __atomic_load_n(&site->mod_cache, __ATOMIC_ACQUIRE);
+    if(c >> 32) vemit_at(site, sample, lvl, (int)(c & 0xffu), (int)((c >> 8) & 0xffu), has_errno, errnum, fmt, ap);
+    else vemit_at(site, sample, lvl, __atomic_load_n(&derr_g_hot.min_level, __ATOMIC_RELAXED),
+                  __atomic_load_n(&derr_g_hot.text_min, __ATOMIC_RELAXED), has_errno, errnum, fmt, ap);
+}
+
+static void emit_kv(derr_level lvl, const char *msg, const derr_kv *kv, size_t n){
+    struct derr_tstats *ts = stats_tl();
+    mods_env_load();
+    if(!derr_level_enabled(lvl)){ stat_add(&ts->filtered, 1); return; }
+    stat_level(ts->emitted, lvl);
+    if(!msg) msg = "";
+    if(side_wants(lvl)){
+        // Log binario e flight recorder ricevono la forma testuale "msg k=v ..."
+        char inl[512];
+        struct derr_rec t; rec_init(&t, inl, sizeof inl);
+        rec_puts(&t, msg);
+        rec_put_fields(&t, kv, n, DERR_ENC_TEXT);
+        t.line[t.len] = 0;
+        side_emitf(lvl, "%s", t.line);
+        rec_reset(&t, inl, sizeof inl);
+    }
+    if((int)lvl < __atomic_load_n(&derr_g_hot.text_min, __ATOMIC_RELAXED)) return;
+    emit_build(NULL, 0, lvl, 0, 0, msg, NULL, kv, n);
+}
+
+// ---- Implementazioni API ----
+void derr_set_program_name(const char *name){ __atomic_store_n(&g_derr.progname, name, __ATOMIC_RELEASE); }
+void derr_set_min_level(derr_level lvl){
+    mods_env_load();
+    lock();
+    sinks_init_once();
+    g_user_min = (int)lvl;
+    recompute_threshold();
+    unlock();
+}
+static int mods_apply(const char *spec){
+    int rc = 0;
+    lock();
+    sinks_init_once();
+    for(const char *p = spec; *p;){
+        while(*p == ',' || *p == ' ') p++;
+        const char *e = p;
+        while(*e && *e != ',') e++;
+        const char *end = e;
+        while(end > p && end[-1] == ' ') end--;
+        if(end > p){
+            const char *eq = (const char *)memchr(p, '=', (size_t)(end - p));
+            int lvl = eq ? level_parse(eq + 1, (size_t)(end - eq - 1)) : level_parse(p, (size_t)(end - p));
+            if(lvl < 0){ errno = EINVAL; rc = -1; }
+            else if(!eq) g_user_min = lvl;
+            else if(mod_set(p, (size_t)(eq - p), lvl) != 0) rc = -1;
+        }
+        p = e;
+    }
+    recompute_threshold();
+    unlock();
+    return rc;
+}
+
+#if DERR_POSIX
+static pthread_once_t g_mods_once = PTHREAD_ONCE_INIT;
+static void mods_env_parse(void){
+    const char *spec = getenv("DERR_LEVELS");
+    if(spec && *spec) mods_apply(spec);
+}
+static void mods_env_load(void){ pthread_once(&g_mods_once, mods_env_parse); }
+#else
+static void mods_env_load(void){
+    static int done;
+    if(done) return;
+    done = 1;
+    const char *spec = getenv("DERR_LEVELS");
+    if(spec && *spec) mods_apply(spec);
+}
+#endif
+
+static int clamp_level(int l){ return l < 0 ? 0 : l > 255 ? 255 : l; }
+
+int derr_set_module_level(const char *module, derr_level lvl){
+    if(!module){ errno = EINVAL; return -1; }
+    mods_env_load();
+    lock();
+    sinks_init_once();
+    int rc = mod_set(module, strlen(module), (int)lvl);
+    recompute_threshold();
+    unlock();
+    return rc;
+}
+int derr_set_module_levels(const char *spec){
+    if(!spec){ errno = EINVAL; return -1; }
+    mods_env_load();
+    return mods_apply(spec);
+}
+derr_level derr_get_module_level(const char *module){
+    mods_env_load();
+    lock();
+    int i = module ? mod_find(module) : -1;
+    int l = i >= 0 ? g_mods[i].level : g_user_min;
+    unlock();
+    return (derr_level)l;
+}
+void derr_clear_module_levels(void){
+    mods_env_load();
+    lock();
+    sinks_init_once();
+    g_nmods = 0;
+    recompute_threshold();
+    unlock();
+}
+
+// Risolve la soglia del modulo per un punto di chiamata e la mette in cache
+unsigned long long derr_module_resolve_(derr_site *site, const char *module){
+    mods_env_load();
+    lock();
+    sinks_init_once();
+    int i = mod_find(module);
+    int eff, text;
+    thresholds(i >= 0 ? g_mods[i].level : g_user_min, &eff, &text);
+    unsigned long long c = (unsigned long long)__atomic_load_n(&derr_g_hot.mod_gen, __ATOMIC_RELAXED) << 32
+                         | (unsigned long long)clamp_level(text) << 8 | (unsigned long long)clamp_level(eff);
+    __atomic_store_n(&site->mod_cache, c, __ATOMIC_RELEASE);
+    unlock();
+    return c;
+}
+
+void derr_enable_color(int enable){ cfg_set(DERR_CFG_COLOR, enable ? DERR_CFG_COLOR : 0); }
+void derr_set_timestamp_utc(int use_utc){ cfg_set(DERR_CFG_UTC, use_utc ? DERR_CFG_UTC : 0); }
+void derr_set_timestamp_format(derr_ts_format fmt){
+    cfg_set(0xfu << DERR_CFG_TS_SHIFT, ((unsigned)fmt & 0xfu) << DERR_CFG_TS_SHIFT);
+}
+void derr_set_timestamp_coarse(int enable){ cfg_set(DERR_CFG_COARSE, enable ? DERR_CFG_COARSE : 0); }
+void derr_set_log_file(FILE *fp){
+    lock();
+    sinks_init_once();
+    // Attende eventuali scritture in corso sul file precedente
+    struct derr_sink *k = &g_sinks[DERR_SINK_FILE];
+    dlock(&k->lk);
+    if(g_rot.path && g_derr.file != fp) rot_release();
+    if(g_derr.file && g_derr.file != fp) file_do_flush(g_derr.file);
+    g_derr.file = fp;
+    __atomic_store_n(&k->active, fp != NULL, __ATOMIC_RELEASE);
+    dunlock(&k->lk);
+    recompute_threshold();
+    unlock();
+}
+
+int derr_open_log_file(const char *path, size_t max_bytes, unsigned max_age_s, unsigned keep){
+    if(!path || !*path){ errno = EINVAL; return -1; }
+    size_t plen = strlen(path);
+    char *cp = (char *)malloc(plen + 1);
+    if(!cp){ errno = ENOMEM; return -1; }
+    memcpy(cp, path, plen + 1);
+    size_t sz;
+    FILE *f = rot_open(cp, &sz);
+    if(!f){ int e = errno; free(cp); errno = e; return -1; }
+
+    lock();
+    sinks_init_once();
+    struct derr_sink *k = &g_sinks[DERR_SINK_FILE];
+    dlock(&k->lk);
+    rot_release();
+    if(g_derr.file) file_do_flush(g_derr.file);
+    g_rot.path = cp;
+    g_rot.max_bytes = max_bytes; g_rot.max_age = max_age_s; g_rot.keep = keep;
+    g_rot.size = sz; g_rot.opened = time(NULL);
+    DERR_STORE(&g_rot.reopen, 0);
+    g_derr.file = f;
+    __atomic_store_n(&k->active, 1, __ATOMIC_RELEASE);
+    dunlock(&k->lk);
+    recompute_threshold();
+    unlock();
+    return 0;
+}
+
+void derr_set_log_compress(int enable){
+    struct derr_sink *k = &g_sinks[DERR_SINK_FILE];
+    lock();
+    sinks_init_once();
+    dlock(&k->lk);
+    g_rot.compress = enable ? 1 : 0;
+    dunlock(&k->lk);
+    unlock();
+}
+
+void derr_reopen_log_file(void){ DERR_STORE(&g_rot.reopen, 1); }
+
+#if DERR_POSIX
+static void rot_sighup(int sig, siginfo_t *si, void *uc){
+    DERR_STORE(&g_rot.reopen, 1);
+    const struct sigaction *o = &g_rot.old_hup;
+    if(o->sa_flags & SA_SIGINFO){ if(o->sa_sigaction) o->sa_sigaction(sig, si, uc); }
+    else if(o->sa_handler != SIG_DFL && o->sa_handler != SIG_IGN) o->sa_handler(sig);
+}
+
+int derr_reopen_on_sighup(int enable){
+    lock();
+    int rc = 0;
+    if(enable && !g_rot.sighup){
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_sigaction = rot_sighup;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        rc = sigaction(SIGHUP, &sa, &g_rot.old_hup);
+        if(rc == 0) g_rot.sighup = 1;
+    } else if(!enable && g_rot.sighup){
+        rc = sigaction(SIGHUP, &g_rot.old_hup, NULL);
+        if(rc == 0) g_rot.sighup = 0;
+    }
+    unlock();
+    return rc;
+}
+#else
+int derr_reopen_on_sighup(int enable){ (void)enable; errno = ENOSYS; return -1; }
+#endif
+
+void derr_enable_stderr(int enable){
+    lock();
+    sinks_init_once();
+    __atomic_store_n(&g_sinks[DERR_SINK_STDERR].active, enable ? 1 : 0, __ATOMIC_RELEASE);
+    recompute_threshold();
+    unlock();
+}
+void derr_set_include_errno_details(int enable){ cfg_set(DERR_CFG_ERRNO, enable ? DERR_CFG_ERRNO : 0); }
+void derr_set_max_message_size(size_t bytes){
+    __atomic_store_n(&g_derr.max_message, bytes ? bytes : DERR_DEFAULT_MAX_MESSAGE, __ATOMIC_RELAXED);
+}
+const char *derr_errno_name(int errnum){ return errno_name(errnum); }
+void derr_errno_cache_reset(void){ DERR_FADD(&g_err_gen, 1); }
+
+void derr_use_syslog(int enable){
+#if DERR_POSIX
+    lock();
+    if(enable && !g_derr.use_syslog){
+        openlog(prog_name(), LOG_CONS|LOG_PID, LOG_USER);
+        g_derr.use_syslog = 1;
+    } else if(!enable && g_derr.use_syslog){
+        closelog(); g_derr.use_syslog = 0;
+    }
+    sinks_init_once();
+    __atomic_store_n(&g_sinks[DERR_SINK_SYSLOG].active, g_derr.use_syslog, __ATOMIC_RELEASE);
+    recompute_threshold();
+    unlock();
+#else
+    (void)enable; // no‑op su non POSIX
+#endif
+}
+
+void derr_log(derr_level lvl, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); vemit(lvl, 0, 0, fmt, ap); va_end(ap);
+}
+// Le macro arrivano qui solo se il campionamento del livello le ha scelte
+void derr_log_site_(derr_site *site, derr_level lvl, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); vemit_site(site, derr_level_rate_(lvl), lvl, 0, 0, fmt, ap); va_end(ap);
+}
+void derr_log_errno_site_(derr_site *site, derr_level lvl, int errnum, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); vemit_site(site, derr_level_rate_(lvl), lvl, 1, errnum, fmt, ap); va_end(ap);
+}
+void derr_log_sampled_(derr_site *site, unsigned rate, derr_level lvl, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); vemit_site(site, rate, lvl, 0, 0, fmt, ap); va_end(ap);
+}
+
+#if DERR_POSIX
+static void fr_recordf(derr_level lvl, int has_errno, int errnum, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); fr_record(lvl, has_errno, errnum, fmt, ap); va_end(ap);
+}
+
+// Formattazione differita senza va_list: gli argomenti vanno nello slot come sono
+static int async_defer_packed(const derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum,
+                              const char *fmt, const void *args, size_t alen){
+    unsigned cfg = cfg_get();
+    if(!(cfg & DERR_CFG_DEFER) || lvl >= DERR_FATAL || !DERR_LOAD(&g_async.running)) return 0;
+    int done = 0;
+    DERR_FADD(&g_async.inflight, 1);
+    if(DERR_LOAD(&g_async.running)){
+        size_t pos;
+        struct derr_aslot *sl = async_reserve(&pos);
+        if(sl){
+            sl->rec.len = 0;
+            rec_put(&sl->rec, (const char *)args, alen);
+            async_defer(sl, cfg, site, sample, lvl, has_errno, errnum, fmt);
+            async_commit(sl, pos);
+        }
+        done = 1;
+    }
+    DERR_FADD(&g_async.inflight, -1);
+    return done;
+}
+#endif
+
+// Come vemit_site, con gli argomenti serializzati da derr.hpp: il log binario
+// e la coda differita li copiano, gli altri percorsi li rendono con bin_render
+void derr_log_packed_(derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum,
+                      const char *fmt, const void *args, size_t alen){
+    mods_env_load();
+    unsigned long long c = __atomic_load_n(&site->mod_cache, __ATOMIC_ACQUIRE);
+    int eff  = c >> 32 ? (int)(c & 0xffu) : __atomic_load_n(&derr_g_hot.min_level, __ATOMIC_RELAXED);
+    int text = c >> 32 ? (int)((c >> 8) & 0xffu) : __atomic_load_n(&derr_g_hot.text_min, __ATOMIC_RELAXED);
+    struct derr_tstats *t = stats_tl();
+    if((int)lvl < eff){ stat_add(&t->filtered, 1); return; }
+    stat_level(t->emitted, lvl);
+    if(!sample) sample = derr_level_rate_(lvl);
+#if DERR_POSIX
+    if((int)lvl >= __atomic_load_n(&g_bin.min, __ATOMIC_RELAXED) && DERR_LOAD(&g_bin.fd) >= 0)
+        bin_emit_packed(lvl, has_errno, errnum, fmt, args, alen);
+    int fr = (int)lvl >= __atomic_load_n(&g_fr.min, __ATOMIC_RELAXED);
+    if(!fr && (int)lvl >= text && async_defer_packed(site, sample, lvl, has_errno, errnum, fmt, args, alen)) return;
+#else
+    int fr = 0;
+#endif
+    if((int)lvl < text && !fr) return;
+
+    char inl[512];
+    struct derr_rec m; rec_init(&m, inl, sizeof inl);
+    bin_render(&m, fmt, (const unsigned char *)args, alen);
+    if(!rec_reserve(&m, m.len + 1)) m.len = m.cap - 1;
+    m.line[m.len] = 0;
+#if DERR_POSIX
+    if(fr) fr_recordf(lvl, has_errno, errnum, "%s", m.line);
+#endif
+    if((int)lvl >= text) emit_build(site, sample, lvl, has_errno, errnum, m.line, NULL, NULL, 0);
+    rec_reset(&m, inl, sizeof inl);
+}
+
+int derr_set_sampling(derr_level lvl, unsigned rate){
+    int i = (int)lvl / 10 - 1;
+    if((int)lvl % 10 || i < 0 || i >= 4){ errno = EINVAL; return -1; }
+    __atomic_store_n(&derr_g_hot.sample[i], rate > 1 ? rate : 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void derr_log_kva(derr_level lvl, const char *msg, const derr_kv *kv, size_t n){
+    emit_kv(lvl, msg, kv, n);
+}
+
+void derr_log_kvl(derr_level lvl, const char *msg, ...){
+    if(!derr_level_enabled(lvl)){ stat_add(&stats_tl()->filtered, 1); return; }
+    derr_kv kv[DERR_KV_MAX]; size_t n = 0;
+    va_list ap; va_start(ap, msg);
+    for(;;){
+        derr_kv f = va_arg(ap, derr_kv);
+        if(f.type == DERR_KV_T_END) break;
+        if(n < DERR_KV_MAX) kv[n++] = f;
+    }
+    va_end(ap);
+    emit_kv(lvl, msg, kv, n);
+}
+
+void derr_set_encoder(derr_encoder enc){
+    cfg_set(0xfu << DERR_CFG_ENC_SHIFT, ((unsigned)enc & 0xfu) << DERR_CFG_ENC_SHIFT);
+}
+
+int derr_ctx_push(const char *key, const char *fmt, ...){
+    char v[DERR_CTX_BYTES];
+    va_list ap; va_start(ap, fmt);
+    vsnprintf(v, sizeof v, fmt, ap);
+    va_end(ap);
+    derr_kv kv = derr_kv_s_(key, v);
+    return ctx_push(&kv);
+}
+int derr_ctx_push_kv(derr_kv field){ return ctx_push(&field); }
+void derr_ctx_pop(void){
+    struct derr_ctx *c = &tl_ctx;
+    if(c->depth <= 0) return;
+    c->depth--;
+    c->txt_len = c->txt_mark[c->depth]; c->json_len = c->json_mark[c->depth];
+}
+void derr_ctx_clear(void){ tl_ctx.depth = 0; tl_ctx.txt_len = tl_ctx.json_len = 0; }
+
+unsigned derr_thread_id(void){ return thread_id(); }
+void derr_set_thread_id(int enable){ cfg_set(DERR_CFG_TID, enable ? DERR_CFG_TID : 0); }
+void derr_set_source_location(int enable){ cfg_set(DERR_CFG_SRC, enable ? DERR_CFG_SRC : 0); }
+
+void derr_log_errno(derr_level lvl, int errnum, const char *fmt, ...){
+    va_list ap; va_start(ap, fmt); vemit(lvl, 1, errnum, fmt, ap); va_end(ap);
+}
+
+void derr_flush(void){
+#if DERR_POSIX
+    if(DERR_LOAD(&g_async.running)) async_wait_drained();
+    shm_flush();
+#endif
+    if(__atomic_load_n(&g_dedup.repeats, __ATOMIC_RELAXED)) dedup_report(DERR_LOAD(&g_dedup.last));
+    int n = __atomic_load_n(&g_nsinks, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n; i++){
+        struct derr_sink *k = &g_sinks[i];
+        const derr_sink_vtable *vt = sink_pin(k);
+        if(!vt) continue;
+        if(vt->flush){
+            dlock(&k->lk);
+            if(k->active) vt->flush(k->ctx);
+            dunlock(&k->lk);
+        }
+        sink_unpin(k);
+    }
+}
+
+int derr_set_file_flush_policy(const derr_flush_policy *pol){
+    derr_flush_policy def = { DERR_FLUSH_EVERY_RECORD, 0, 0, DERR_ERROR, 0 };
+    if(!pol) pol = &def;
+#if !DERR_POSIX
+    if(pol->mode == DERR_FLUSH_INTERVAL){ errno = ENOSYS; return -1; }
+#endif
+    lock();
+    sinks_init_once();
+#if DERR_POSIX
+    flusher_stop();
+#endif
+    struct derr_sink *k = &g_sinks[DERR_SINK_FILE];
+    dlock(&k->lk);
+    g_file.pol = *pol;
+    if(g_derr.file) file_do_flush(g_derr.file);
+    dunlock(&k->lk);
+#if DERR_POSIX
+    if(pol->mode == DERR_FLUSH_INTERVAL){
+        g_file.flusher_stop = 0;
+        int rc = pthread_create(&g_flusher_th, NULL, flusher_main, NULL);
+        if(rc != 0){ unlock(); errno = rc; return -1; }
+        g_file.flusher = 1;
+    }
+#endif
+    unlock();
+    return 0;
+}
+
+#if DERR_POSIX
+int derr_add_mmap_sink(const char *path, size_t segment_bytes, derr_level min){
+    if(!path || segment_bytes < 4096){ errno = EINVAL; return -1; }
+    struct derr_mmap_sink *ms = (struct derr_mmap_sink *)calloc(1, sizeof *ms);
+    if(!ms){ errno = ENOMEM; return -1; }
+    ms->path = strdup(path);
+    ms->seg_size = segment_bytes;
+    pthread_mutex_init(&ms->mu, NULL);
+    if(!ms->path){ free(ms); errno = ENOMEM; return -1; }
+
+    // Non sovrascrive segmenti di esecuzioni precedenti
+    char name[4096]; struct stat st;
+    while(mseg_name(ms, ms->next_idx, name, sizeof name) && stat(name, &st) == 0) ms->next_idx++;
+
+    ms->cur = mseg_open(ms);
+    if(ms->cur) ms->spare = mseg_open(ms);
+    if(!ms->cur){
+        int e = errno;
+        free(ms->path); free(ms);
+        errno = e; return -1;
+    }
+    int id = derr_add_sink(&g_mmap_vt, ms, min);
+    if(id < 0){ int e = errno; mmap_sink_close(ms); errno = e; }
+    return id;
+}
+
+// Intestazione fissa, costruita una volta (e di nuovo nel figlio dopo fork())
+static void dgram_header(struct derr_dgram_sink *d){
+    const char *prog = prog_name();
+    const char *slash = strrchr(prog, '/');
+    if(slash) prog = slash + 1;
+    int n = d->proto == DERR_SYSLOG_JOURNAL
+        ? snprintf(d->hdr, sizeof d->hdr, "SYSLOG_IDENTIFIER=%s\nSYSLOG_PID=%ld\n", prog, (long)getpid())
+        : snprintf(d->hdr, sizeof d->hdr, "%s[%ld]: ", prog, (long)getpid());
+    d->hdr_len = n > 0 && (size_t)n < sizeof d->hdr ? (size_t)n : 0;
+}
+
+int derr_add_syslog_socket_sink(const char *path, derr_syslog_proto proto, derr_level min){
+    if(!path) path = proto == DERR_SYSLOG_JOURNAL ? "/run/systemd/journal/socket" : "/dev/log";
+    struct derr_dgram_sink *d = (struct derr_dgram_sink *)calloc(1, sizeof *d);
+    if(!d){ errno = ENOMEM; return -1; }
+    d->fd = -1; d->proto = (int)proto; d->ts_sec = (time_t)-1;
+    d->path = strdup(path);
+    if(!d->path){ free(d); errno = ENOMEM; return -1; }
+    if(dgram_connect(d) != 0){ int e = errno; dgram_sink_close(d); errno = e; return -1; }
+    dgram_header(d);
+
+    int id = derr_add_sink(&g_dgram_vt, d, min);
+    if(id < 0){ int e = errno; dgram_sink_close(d); errno = e; }
+    return id;
+}
+
+unsigned long long derr_syslog_socket_dropped(int sink){
+    if(sink < 0 || sink >= DERR_MAX_SINKS || g_sinks[sink].vt != &g_dgram_vt) return 0;
+    return DERR_LOAD(&((struct derr_dgram_sink *)g_sinks[sink].ctx)->dropped);
+}
+
+int derr_add_net_sink(const char *host, const char *port, derr_net_transport tr,
+                      derr_net_format fmt, size_t buffer_bytes, derr_level min){
+    if(!host || !port){ errno = EINVAL; return -1; }
+    struct derr_net_sink *n = (struct derr_net_sink *)calloc(1, sizeof *n);
+    if(!n){ errno = ENOMEM; return -1; }
+    pthread_mutex_init(&n->mu, NULL);
+    pthread_cond_init(&n->cv, NULL);
+    pthread_cond_init(&n->space, NULL);
+    rec_init(&n->fr, n->inl, sizeof n->inl);
+    n->fd = -1; n->tr = (int)tr; n->fmt = (int)fmt; n->ts_sec = (time_t)-1;
+    n->cap = buffer_bytes ? buffer_bytes : (size_t)1 << 20;
+    n->host = strdup(host); n->port = strdup(port);
+    char *ring = n->host && n->port ? (char *)malloc(n->cap) : NULL;
+    if(!ring){ net_sink_close(n); errno = ENOMEM; return -1; }
+
+    if(gethostname(n->hostname, sizeof n->hostname - 1) != 0 || !n->hostname[0]) strcpy(n->hostname, "-");
+    const char *prog = prog_name();
+    const char *slash = strrchr(prog, '/');
+    snprintf(n->app, sizeof n->app, "%s", slash ? slash + 1 : prog);
+    n->pid = (long)getpid();
+
+    n->ring = ring;
+    int rc = pthread_create(&n->th, NULL, net_main, n);
+    if(rc != 0){ n->ring = NULL; free(ring); net_sink_close(n); errno = rc; return -1; }
+    int id = derr_add_sink(&g_net_vt, n, min);
+    if(id < 0){ int e = errno; net_sink_close(n); errno = e; }
+    return id;
+}
+unsigned long long derr_net_dropped(int sink){
+    if(sink < 0 || sink >= DERR_MAX_SINKS || g_sinks[sink].vt != &g_net_vt) return 0;
+    return DERR_LOAD(&((struct derr_net_sink *)g_sinks[sink].ctx)->dropped);
+}
+#else
+int derr_add_mmap_sink(const char *path, size_t segment_bytes, derr_level min){
+    (void)path; (void)segment_bytes; (void)min;
+    errno = ENOSYS; return -1;
+}
+int derr_add_syslog_socket_sink(const char *path, derr_syslog_proto proto, derr_level min){
+    (void)path; (void)proto; (void)min;
+    errno = ENOSYS; return -1;
+}
+unsigned long long derr_syslog_socket_dropped(int sink){ (void)sink; return 0; }
+int derr_add_net_sink(const char *host, const char *port, derr_net_transport tr,
+                      derr_net_format fmt, size_t buffer_bytes, derr_level min){
+    (void)host; (void)port; (void)tr; (void)fmt; (void)buffer_bytes; (void)min;
+    errno = ENOSYS; return -1;
+}
+unsigned long long derr_net_dropped(int sink){ (void)sink; return 0; }
+#endif
+
+#if DERR_POSIX
+int derr_binary_open(const char *path, derr_level min){
+    derr_binary_close();
+    if(!g_bin.tab){
+        g_bin.tab = (struct derr_fmt_ent *)calloc(DERR_FMT_TABLE, sizeof *g_bin.tab);
+        if(!g_bin.tab){ errno = ENOMEM; return -1; }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) return -1;
+
+    const char *pn = prog_name();
+    uint32_t mark = 0x01020304u; uint16_t pl = (uint16_t)strnlen(pn, 65535);
+    char hdr[8 + 4 + 2];
+    memcpy(hdr, DERR_BIN_MAGIC, 8); memcpy(hdr + 8, &mark, 4); memcpy(hdr + 12, &pl, 2);
+    if(write(fd, hdr, sizeof hdr) != (ssize_t)sizeof hdr || write(fd, pn, pl) != (ssize_t)pl){
+        int e = errno; close(fd); errno = e; return -1;
+    }
+
+    lock();
+    sinks_init_once();
+    memset(g_bin.tab, 0, DERR_FMT_TABLE * sizeof *g_bin.tab);
+    g_bin.next_id = 0;
+    __atomic_store_n(&g_bin.min, (int)min, __ATOMIC_RELAXED);
+    DERR_STORE(&g_bin.fd, fd);
+    recompute_threshold();
+    unlock();
+    return 0;
+}
+
+void derr_binary_close(void){
+    lock();
+    int fd = g_bin.fd;
+    if(fd >= 0){
+        DERR_STORE(&g_bin.fd, -1);
+        __atomic_store_n(&g_bin.min, DERR_FATAL + 1, __ATOMIC_RELAXED);
+        recompute_threshold();
+        while(DERR_LOAD(&g_bin.inflight)) sched_yield();
+        close(fd);
+    }
+    unlock();
+}
+#else
+int  derr_binary_open(const char *path, derr_level min){ (void)path; (void)min; errno = ENOSYS; return -1; }
+void derr_binary_close(void){}
+#endif
+
+#if DERR_POSIX
+int derr_flight_recorder_enable(size_t records, derr_level min){
+    if(records > (1u << 24)){ errno = EINVAL; return -1; }
+    lock();
+    sinks_init_once();
+    if(records){
+        time_t now = time(NULL); struct tm g;
+        gmtime_r(&now, &g); g.tm_isdst = -1;
+        g_fr.tz_off = (long)difftime(now, mktime(&g));
+    }
+    __atomic_store_n(&g_fr.min, records ? (int)min : DERR_FATAL + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_fr.n, records, __ATOMIC_RELEASE);
+    recompute_threshold();
+    unlock();
+    return 0;
+}
+void derr_flight_recorder_dump(int fd){ fr_dump_fd(fd); }
+
+int derr_set_stderr_nonblocking(size_t spill_bytes){
+    lock();
+    sinks_init_once();
+    struct derr_lock *lk = &g_sinks[DERR_SINK_STDERR].lk;
+    char *nbuf = spill_bytes ? (char *)malloc(spill_bytes) : NULL;
+    if(spill_bytes && !nbuf){ unlock(); errno = ENOMEM; return -1; }
+    dlock(lk);
+    if(g_nb.on){
+        // Svuota il vecchio buffer e ripristina i flag originali
+        nb_block(1);
+        fcntl(STDERR_FILENO, F_SETFL, g_nb.saved_flags);
+        free(g_nb.buf);
+        g_nb.buf = NULL; g_nb.cap = g_nb.off = g_nb.len = 0;
+        g_nb.blocking = 0;
+        DERR_STORE(&g_nb.on, 0);
+    }
+    int rc = 0;
+    if(nbuf){
+        int fl = fcntl(STDERR_FILENO, F_GETFL);
+        if(fl < 0 || fcntl(STDERR_FILENO, F_SETFL, fl | O_NONBLOCK) < 0){
+            rc = -1; free(nbuf);
+        } else {
+            g_nb.saved_flags = fl;
+            g_nb.buf = nbuf; g_nb.cap = spill_bytes;
+            DERR_STORE(&g_nb.on, 1);
+        }
+    }
+    int e = errno;
+    dunlock(lk);
+    unlock();
+    errno = e;
+    return rc;
+}
+unsigned long long derr_stderr_dropped(void){ return DERR_LOAD(&g_nb.dropped); }
+
+static void crash_fatal_reported(void){ DERR_STORE(&g_crash.fatal_done, 1); }
+
+int derr_install_crash_handler(void){
+    lock();
+    if(g_crash.installed){ unlock(); return 0; }
+#if defined(EXECINFO_H) || (defined(__linux__) && !defined(__ANDROID__))
+    void *warm[2];
+    backtrace(warm, 2);
+#endif
+    size_t sz = (size_t)SIGSTKSZ;
+    if(sz < 65536) sz = 65536;
+    void *stk = malloc(sz);
+    if(!stk){ unlock(); errno = ENOMEM; return -1; }
+    stack_t ss;
+    memset(&ss, 0, sizeof ss);
+    ss.ss_sp = stk; ss.ss_size = sz; ss.ss_flags = 0;
+    if(sigaltstack(&ss, NULL) != 0){ int e = errno; free(stk); unlock(); errno = e; return -1; }
+    g_crash.altstack = stk;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = crash_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    for(int i = 0; i < DERR_CRASH_NSIG; i++){
+        if(sigaction(g_crash_sigs[i], &sa, &g_crash.old[i]) != 0){
+            int e = errno;
+            while(i-- > 0) sigaction(g_crash_sigs[i], &g_crash.old[i], NULL);
+            unlock(); errno = e; return -1;
+        }
+    }
+    g_crash.installed = 1;
+    unlock();
+    return 0;
+}
+#else
+int derr_flight_recorder_enable(size_t records, derr_level min){ (void)records; (void)min; errno = ENOSYS; return -1; }
+void derr_flight_recorder_dump(int fd){ (void)fd; }
+int derr_set_stderr_nonblocking(size_t spill_bytes){ (void)spill_bytes; errno = ENOSYS; return -1; }
+unsigned long long derr_stderr_dropped(void){ return 0; }
+static void crash_fatal_reported(void){}
+int derr_install_crash_handler(void){ errno = ENOSYS; return -1; }
+#endif
+
+static unsigned long long mono_ns(void){
+    struct timespec t;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+    return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+}
+
+int derr_ratelimit_allow(derr_site *site, derr_level lvl, unsigned burst, unsigned per_sec){
+    if(!burst && !per_sec){
+        burst = __atomic_load_n(&g_derr.rl_burst, __ATOMIC_RELAXED);
+        per_sec = __atomic_load_n(&g_derr.rl_per_sec, __ATOMIC_RELAXED);
+    }
+    if(!per_sec) return 1;
+    if(!burst) burst = 1;
+
+    // GCRA: un record ogni T ns, con anticipo massimo di (burst-1)*T
+    unsigned long long T = 1000000000ull / per_sec;
+    if(!T) T = 1;
+    unsigned long long tol = (unsigned long long)(burst - 1) * T;
+    unsigned long long now = mono_ns();
+    unsigned long long tat = DERR_LOAD(&site->rl_tat);
+    for(;;){
+        unsigned long long base = tat > now ? tat : now;
+        if(base - now > tol){
+            __atomic_fetch_add(&site->rl_suppressed, 1, __ATOMIC_RELAXED);
+            stat_add(&stats_tl()->suppressed, 1);
+            return 0;
+        }
+        if(DERR_CAS(&site->rl_tat, &tat, base + T)) break;
+    }
+    unsigned long long n = __atomic_exchange_n(&site->rl_suppressed, 0, __ATOMIC_ACQ_REL);
+    if(n) derr_log(lvl, "rate limit: %llu messaggi soppressi da questo punto", n);
+    return 1;
+}
+
+void derr_set_default_ratelimit(unsigned burst, unsigned per_sec){
+    __atomic_store_n(&g_derr.rl_burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_derr.rl_per_sec, per_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&derr_g_hot.rl_default, per_sec != 0, __ATOMIC_RELAXED);
+}
+
+void derr_set_dedup(int enable){ cfg_set(DERR_CFG_DEDUP, enable ? DERR_CFG_DEDUP : 0); }
+
+int derr_add_sink(const derr_sink_vtable *vt, void *ctx, derr_level min){
+    if(!vt || !vt->write){ errno = EINVAL; return -1; }
+    lock();
+    sinks_init_once();
+    int id = -1;
+    // Riusa gli slot liberati (mai quelli predefiniti)
+    for(int i = DERR_SINK_SYSLOG + 1; i < g_nsinks; i++)
+        if(!g_sinks[i].vt){ id = i; break; }
+    if(id < 0){
+        if(g_nsinks >= DERR_MAX_SINKS){ unlock(); errno = ENOSPC; return -1; }
+        id = g_nsinks;
+    }
+    struct derr_sink *k = &g_sinks[id];
+    // inflight non si azzera: un thread può ancora tenerlo alzato per un attimo
+    // sullo slot vecchio (sink_pin), e lo riabbassa lui
+    k->vt = vt; k->ctx = ctx;
+    __atomic_store_n(&k->min, (int)min, __ATOMIC_RELAXED);
+    __atomic_store_n(&k->active, 1, __ATOMIC_RELEASE);
+    if(id == g_nsinks) __atomic_store_n(&g_nsinks, id + 1, __ATOMIC_RELEASE);
+    recompute_threshold();
+    unlock();
+    return id;
+}
+
+int derr_remove_sink(int id){
+    lock();
+    sinks_init_once();
+    if(id < 0 || id >= g_nsinks || !g_sinks[id].vt){ unlock(); errno = EINVAL; return -1; }
+    struct derr_sink *k = &g_sinks[id];
+    if(k->builtin){
+        unlock();
+        if(id == DERR_SINK_FILE) derr_set_log_file(NULL);
+        else if(id == DERR_SINK_SYSLOG) derr_use_syslog(0);
+        else derr_enable_stderr(0);
+        return 0;
+    }
+    // Dopo lo stop nessun nuovo write parte; si attendono quelli in corso
+    // (scritture e flush tengono inflight, vedi sink_pin)
+    dlock(&k->lk);
+    DERR_STORE_SC(&k->active, 0);
+    dunlock(&k->lk);
+    while(DERR_LOAD_SC(&k->inflight)) sched_yield();
+    if(k->vt->flush) k->vt->flush(k->ctx);
+    if(k->vt->close) k->vt->close(k->ctx);
+    k->vt = NULL; k->ctx = NULL;
+    recompute_threshold();
+    unlock();
+    return 0;
+}
+
+int derr_set_sink_level(int id, derr_level min){
+    lock();
+    sinks_init_once();
+    if(id < 0 || id >= g_nsinks || !g_sinks[id].vt){ unlock(); errno = EINVAL; return -1; }
+    __atomic_store_n(&g_sinks[id].min, (int)min, __ATOMIC_RELAXED);
+    recompute_threshold();
+    unlock();
+    return 0;
+}
+
+unsigned long long derr_sink_contention(int sink){
+    if(sink < 0 || sink >= DERR_MAX_SINKS) return 0;
+    return __atomic_load_n(&g_sinks[sink].lk.contended, __ATOMIC_RELAXED);
+}
+
+#if DERR_POSIX
+int derr_async_start(size_t capacity){
+    fork_init_once();
+    pthread_mutex_lock(&g_async.mu);
+    if(g_async.running){ pthread_mutex_unlock(&g_async.mu); return 0; }
+
+    size_t cap = 2;
+    while(cap < capacity) cap <<= 1;
+    struct derr_aslot *slots = (struct derr_aslot *)malloc(cap * sizeof *slots);
+    if(!slots){ pthread_mutex_unlock(&g_async.mu); errno = ENOMEM; return -1; }
+    for(size_t i = 0; i < cap; i++){
+        slots[i].seq = i;
+        rec_init(&slots[i].rec, slots[i].inl, sizeof slots[i].inl);
+        slots[i].rec.arena = 1;
+    }
+
+    g_async.slots = slots;
+    g_async.mask = cap - 1;
+    g_async.head = g_async.tail = g_async.done = 0;
+    g_async.stop = 0;
+    int rc = pthread_create(&g_async_th, NULL, async_main, NULL);
+    if(rc != 0){
+        g_async.slots = NULL; free(slots);
+        pthread_mutex_unlock(&g_async.mu);
+        errno = rc; return -1;
+    }
+    static int atexit_done = 0;
+    if(!atexit_done){ atexit(derr_async_stop); atexit_done = 1; }
+    DERR_STORE(&g_async.running, 1);
+    pthread_mutex_unlock(&g_async.mu);
+    return 0;
+}
+
+void derr_async_stop(void){
+    pthread_mutex_lock(&g_async.mu);
+    if(!g_async.running){ pthread_mutex_unlock(&g_async.mu); return; }
+    // Da qui i nuovi record tornano sincroni; quelli in coda li scrive il thread
+    DERR_STORE(&g_async.running, 0);
+    g_async.stop = 1;
+    pthread_cond_signal(&g_async.wake);
+    pthread_mutex_unlock(&g_async.mu);
+
+    pthread_join(g_async_th, NULL);
+    // Produttori entrati nel ring prima dello stop
+    while(DERR_LOAD(&g_async.inflight) || DERR_LOAD(&g_async.done) != DERR_LOAD(&g_async.head)){
+        if(!async_drain()) sched_yield();
+    }
+
+    pthread_mutex_lock(&g_async.mu);
+    free(g_async.slots); g_async.slots = NULL;
+    pthread_mutex_unlock(&g_async.mu);
+    derr_flush();
+}
+
+void derr_async_set_overflow(derr_overflow policy){ __atomic_store_n(&g_async.policy, (int)policy, __ATOMIC_RELAXED); }
+unsigned long long derr_async_dropped(void){ return DERR_LOAD(&g_async.dropped); }
+
+int derr_async_set_arena(size_t chunk_bytes, size_t max_bytes){
+    if(!chunk_bytes) chunk_bytes = DERR_ARENA_CHUNK;
+    if(!max_bytes) max_bytes = DERR_ARENA_MAX;
+    if(chunk_bytes < 4096 || max_bytes < chunk_bytes){ errno = EINVAL; return -1; }
+    pthread_mutex_lock(&g_async.mu);
+    if(g_async.running){ pthread_mutex_unlock(&g_async.mu); errno = EBUSY; return -1; }
+    pthread_mutex_lock(&g_arena.mu);
+    // I chunk liberi di un'altra dimensione non servono più
+    if(chunk_bytes != g_arena.chunk){
+        struct derr_achunk *c = g_arena.pool, *keep = NULL;
+        while(c){
+            struct derr_achunk *n = c->next;
+            if(c->size != chunk_bytes){ g_arena.bytes -= c->size; free(c); }
+            else { c->next = keep; keep = c; }
+            c = n;
+        }
+        g_arena.pool = keep;
+    }
+    __atomic_store_n(&g_arena.chunk, chunk_bytes, __ATOMIC_RELAXED);
+    g_arena.limit = max_bytes;
+    pthread_mutex_unlock(&g_arena.mu);
+    pthread_mutex_unlock(&g_async.mu);
+    return 0;
+}
+#else
+int  derr_async_start(size_t capacity){ (void)capacity; errno = ENOSYS; return -1; }
+void derr_async_stop(void){}
+void derr_async_set_overflow(derr_overflow policy){ (void)policy; }
+unsigned long long derr_async_dropped(void){ return 0; }
+int  derr_async_set_arena(size_t chunk_bytes, size_t max_bytes){
+    (void)chunk_bytes; (void)max_bytes; errno = ENOSYS; return -1;
+}
+#endif
+void derr_async_set_deferred(int enable){ cfg_set(DERR_CFG_DEFER, enable ? DERR_CFG_DEFER : 0); }
+
+// ---- fork() ----
+// prepare prende i lock nell'ordine usato dal resto della libreria
+// (configurazione, coda, arena, ring condiviso, sink, stato interno dei sink,
+// flush periodico): nessun altro thread resta a metà di una sezione critica.
+// Nel figlio esiste solo il thread che ha chiamato fork(): i lock si
+// rilasciano, le condvar si reinizializzano (potrebbero avere attese di thread
+// che non esistono più), lo stato che appartiene al padre si scarta e i
+// thread della libreria ripartono.
+#if DERR_POSIX
+#define DERR_SHM_SLOTS    4096
+#define DERR_SHM_LINE     1024
+#define DERR_SHM_POLL_MS  2          // attesa del thread di svuotamento a ring vuoto
+#define DERR_SHM_STALL_MS 1000       // slot riservato e mai pubblicato (figlio morto): saltato
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Regione condivisa: intestazione e slot di dimensione fissa (Vyukov, come la
+// coda asincrona). I produttori sono i figli; il consumatore è il principale.
+struct derr_shm_hdr {
+    size_t             slot_size;    // byte per slot, intestazione compresa
+    size_t             mask;
+    unsigned long long dropped;
+    __attribute__((aligned(64))) size_t head;
+    __attribute__((aligned(64))) size_t tail;
+} __attribute__((aligned(64)));
+
+// Record già formattato: gli offset descrivono line come in struct derr_rec
+struct derr_shm_slot {
+    size_t          seq;
+    int             lvl, show_errno, errnum, enc;
+    unsigned        cfg, tid, sample;
+    struct timespec ts;
+    uint32_t        ts_off, ts_n, ts_len, msg_off, msg_len, detail_off, es_off, es_len, len;
+    char            line[];
+};
+
+static struct derr_shm {
+    struct derr_shm_hdr *hdr;        // NULL = nessun ring
+    size_t               map_len;
+    size_t               line_max;   // byte di riga per slot (senza lo zero finale)
+    int                  owner;      // processo principale: thread di svuotamento attivo
+    int                  stop;
+    pthread_t            th;
+    pthread_mutex_t      mu;         // consumatore (thread o derr_flush) e start/stop
+    size_t               stall_pos;
+    unsigned long long   stall_ns;   // 0 = nessuno slot in attesa
+} g_shm = { NULL, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+
+static DERR_INLINE struct derr_shm_slot *shm_slot(struct derr_shm_hdr *h, size_t pos){
+    return (struct derr_shm_slot *)((char *)(h + 1) + (pos & h->mask) * h->slot_size);
+}
+
+// Lato figlio: ring pieno = record perso, mai attese sul principale
+static void shm_put(const struct derr_rec *r){
+    struct derr_shm_hdr *h = g_shm.hdr;
+    size_t p = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+    struct derr_shm_slot *sl;
+    for(;;){
+        sl = shm_slot(h, p);
+        long dif = (long)(DERR_LOAD(&sl->seq) - p);
+        if(dif == 0){
+            if(DERR_CAS(&h->head, &p, p + 1)) break;
+        } else if(dif > 0){
+            p = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+        } else {
+            DERR_FADD(&h->dropped, 1);
+            return;
+        }
+    }
+    const derr_record *pub = &r->pub;
+    size_t len = r->len < g_shm.line_max ? r->len : g_shm.line_max;
+    memcpy(sl->line, r->line, len);
+    if(len < r->len) sl->line[len - 1] = '\n';
+    sl->line[len] = 0;
+    sl->lvl = (int)r->lvl; sl->show_errno = r->show_errno; sl->errnum = r->errnum; sl->enc = r->enc;
+    sl->cfg = r->cfg & ~DERR_CFG_SHM; sl->tid = pub->tid; sl->sample = pub->sample_rate;
+    sl->ts = pub->ts;
+    sl->ts_off = (uint32_t)(pub->ts_str - r->line); sl->ts_n = (uint32_t)pub->ts_len;
+    sl->ts_len = (uint32_t)r->ts_len;
+    sl->msg_off = (uint32_t)r->msg_off; sl->msg_len = (uint32_t)r->msg_len;
+    sl->detail_off = (uint32_t)r->detail_off;
+    sl->es_off = pub->errstr ? (uint32_t)(pub->errstr - r->line) : 0;
+    sl->es_len = (uint32_t)pub->errstr_len;
+    sl->len = (uint32_t)len;
+    // Il principale può aver saltato lo slot nel frattempo (vedi shm_drain)
+    size_t exp = p;
+    if(!__atomic_compare_exchange_n(&sl->seq, &exp, p + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        DERR_FADD(&h->dropped, 1);
+}
+
+static DERR_INLINE size_t shm_clamp(uint32_t v, size_t max){ return v < max ? v : max; }
+
+// Vista struct derr_rec sullo slot, senza copie. Il contenuto arriva da un
+// altro processo: gli offset sono ricondotti dentro la riga.
+static void shm_unpack(struct derr_rec *r, struct derr_shm_slot *sl){
+    size_t len = shm_clamp(sl->len, g_shm.line_max);
+    sl->line[len] = 0;
+    rec_init(r, sl->line, len + 1);
+    r->len = len;
+    r->lvl = sl->lvl < DERR_DEBUG ? DERR_DEBUG : sl->lvl >= DERR_FATAL ? DERR_ERROR : (derr_level)sl->lvl;
+    r->show_errno = sl->show_errno != 0;
+    r->errnum = sl->errnum;
+    r->enc = sl->enc == DERR_ENC_JSON || sl->enc == DERR_ENC_LOGFMT ? sl->enc : DERR_ENC_TEXT;
+    r->cfg = sl->cfg & ~DERR_CFG_SHM;
+    r->ts_len = shm_clamp(sl->ts_len, len);
+    r->msg_off = shm_clamp(sl->msg_off, len);
+    r->msg_len = shm_clamp(sl->msg_len, len - r->msg_off);
+    r->detail_off = sl->detail_off ? shm_clamp(sl->detail_off, len) : len;
+    size_t ts_off = shm_clamp(sl->ts_off, len), es_off = shm_clamp(sl->es_off, len);
+
+    derr_record *p = &r->pub;
+    const struct derr_errent *ei = r->show_errno ? errno_info(r->errnum) : NULL;
+    p->level = r->lvl;
+    p->ts = sl->ts;
+    p->ts_str = r->line + ts_off; p->ts_len = shm_clamp(sl->ts_n, len - ts_off);
+    p->msg = r->line + r->msg_off; p->msg_len = r->msg_len;
+    p->has_errno = r->show_errno; p->errnum = r->errnum;
+    p->errstr = r->show_errno ? r->line + es_off : NULL;
+    p->errstr_len = r->show_errno ? shm_clamp(sl->es_len, len - es_off) : 0;
+    p->errname = ei ? ei->name : NULL;
+    p->file = NULL; p->line = 0; p->func = NULL;     // puntatori dell'altro processo
+    p->tid = sl->tid;
+    p->text = r->line; p->text_len = len;
+    p->sample_rate = sl->sample ? sl->sample : 1;
+}
+
+// Scrive sui sink i record pubblicati; con g_shm.mu. Ritorna quanti.
+static size_t shm_drain(void){
+    struct derr_shm_hdr *h = g_shm.hdr;
+    size_t n = 0;
+    for(;;){
+        size_t p = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+        struct derr_shm_slot *sl = shm_slot(h, p);
+        size_t seq = DERR_LOAD(&sl->seq);
+        if(seq != p + 1){
+            // Vuoto, oppure riservato da un figlio e non ancora pubblicato:
+            // oltre DERR_SHM_STALL_MS il figlio è considerato morto e lo slot saltato
+            if(seq != p || DERR_LOAD(&h->head) == p){ g_shm.stall_ns = 0; break; }
+            unsigned long long now = stats_ns();
+            if(!g_shm.stall_ns || g_shm.stall_pos != p){ g_shm.stall_pos = p; g_shm.stall_ns = now; break; }
+            if(now - g_shm.stall_ns < DERR_SHM_STALL_MS * 1000000ull) break;
+            size_t exp = p;
+            if(!DERR_CAS(&sl->seq, &exp, p + h->mask + 1)) continue;   // pubblicato proprio ora
+            DERR_FADD(&h->dropped, 1);
+            DERR_STORE(&h->tail, p + 1);
+            g_shm.stall_ns = 0;
+            continue;
+        }
+        struct derr_rec r;
+        shm_unpack(&r, sl);
+        dispatch(&r);
+        DERR_STORE(&sl->seq, p + h->mask + 1);
+        DERR_STORE(&h->tail, p + 1);
+        n++;
+    }
+    return n;
+}
+
+static void *shm_main(void *arg){
+    (void)arg;
+    for(;;){
+        pthread_mutex_lock(&g_shm.mu);
+        size_t n = shm_drain();
+        int stop = g_shm.stop;
+        pthread_mutex_unlock(&g_shm.mu);
+        if(stop) break;
+        if(n) sinks_idle_flush();
+        else { struct timespec d = { 0, DERR_SHM_POLL_MS * 1000000L }; nanosleep(&d, NULL); }
+    }
+    return NULL;
+}
+
+static void shm_flush(void){
+    if(!DERR_LOAD(&g_shm.owner)) return;
+    pthread_mutex_lock(&g_shm.mu);
+    if(g_shm.owner) shm_drain();
+    pthread_mutex_unlock(&g_shm.mu);
+}
+
+static void fork_prepare(void){
+    sinks_init_once();
+    pthread_mutex_lock(&g_derr.mu);
+    pthread_mutex_lock(&g_async.mu);
+    pthread_mutex_lock(&g_arena.mu);
+    pthread_mutex_lock(&g_shm.mu);
+    for(int i = 0; i < DERR_MAX_SINKS; i++) pthread_mutex_lock(&g_sinks[i].lk.mu);
+    for(int i = 0; i < DERR_MAX_SINKS; i++){
+        const derr_sink_vtable *vt = g_sinks[i].vt;
+        if(vt == &g_net_vt) pthread_mutex_lock(&((struct derr_net_sink *)g_sinks[i].ctx)->mu);
+        else if(vt == &g_mmap_vt) pthread_mutex_lock(&((struct derr_mmap_sink *)g_sinks[i].ctx)->mu);
+    }
+    pthread_mutex_lock(&g_flusher_mu);
+    // Il buffer stdio del file verrebbe scritto due volte, dal padre e dal figlio
+    if(g_derr.file && g_file.pending) file_do_flush(g_derr.file);
+}
+
+static void fork_unlock(void){
+    pthread_mutex_unlock(&g_flusher_mu);
+    for(int i = DERR_MAX_SINKS - 1; i >= 0; i--){
+        const derr_sink_vtable *vt = g_sinks[i].vt;
+        if(vt == &g_net_vt) pthread_mutex_unlock(&((struct derr_net_sink *)g_sinks[i].ctx)->mu);
+        else if(vt == &g_mmap_vt) pthread_mutex_unlock(&((struct derr_mmap_sink *)g_sinks[i].ctx)->mu);
+    }
+    for(int i = DERR_MAX_SINKS - 1; i >= 0; i--) pthread_mutex_unlock(&g_sinks[i].lk.mu);
+    pthread_mutex_unlock(&g_shm.mu);
+    pthread_mutex_unlock(&g_arena.mu);
+    pthread_mutex_unlock(&g_async.mu);
+    pthread_mutex_unlock(&g_derr.mu);
+}
+
+// Coda del padre scartata (la scrive il padre), scrittore nuovo
+static void fork_child_async(void){
+    pthread_cond_init(&g_async.wake, NULL);
+    pthread_cond_init(&g_async.drained, NULL);
+    pthread_cond_init(&g_async.space, NULL);
+    // I chunk in uso restano al padre; quello di questo thread non va chiuso
+    if(tl_chunk){ pthread_setspecific(g_arena_key, NULL); tl_chunk = NULL; }
+    g_arena.bytes = 0;
+    for(struct derr_achunk *c = g_arena.pool; c; c = c->next) g_arena.bytes += c->size;
+
+    if(!g_async.running) return;
+    for(size_t i = 0; i <= g_async.mask; i++){
+        struct derr_aslot *sl = &g_async.slots[i];
+        if(sl->rec.owned == 1) free(sl->rec.line);
+        rec_init(&sl->rec, sl->inl, sizeof sl->inl);
+        sl->rec.arena = 1;
+        sl->d.on = 0;
+        sl->seq = i;
+    }
+    g_async.head = g_async.tail = g_async.done = 0;
+    g_async.inflight = g_async.sleeping = g_async.waiters = g_async.blocked = 0;
+    g_async.stop = 0;
+    if(pthread_create(&g_async_th, NULL, async_main, NULL) != 0){
+        free(g_async.slots); g_async.slots = NULL;
+        g_async.running = 0;
+    }
+}
+
+static void fork_child_sinks(void){
+    for(int i = 0; i < DERR_MAX_SINKS; i++){
+        struct derr_sink *k = &g_sinks[i];
+        k->inflight = 0;
+        if(k->vt == &g_mmap_vt){
+            k->active = 0;       // i segmenti e gli offset sono del padre
+        } else if(k->vt == &g_dgram_vt){
+            struct derr_dgram_sink *d = (struct derr_dgram_sink *)k->ctx;
+            d->n = d->used = 0;
+            dgram_header(d);
+        } else if(k->vt == &g_net_vt){
+            // La connessione del padre non si condivide: il figlio ne apre una sua
+            struct derr_net_sink *n = (struct derr_net_sink *)k->ctx;
+            pthread_cond_init(&n->cv, NULL);
+            pthread_cond_init(&n->space, NULL);
+            if(n->fd >= 0) close(n->fd);
+            n->fd = -1; n->up = 0;
+            n->connecting = 1;       // derr_flush() attende il primo tentativo
+            n->head = n->len = n->pend = 0;
+            n->pid = (long)getpid();
+            if(!n->stop && pthread_create(&n->th, NULL, net_main, n) != 0){
+                k->active = 0;
+                n->stop = 1; n->ring = NULL;     // net_sink_close: nessun thread da attendere
+            }
+        }
+    }
+    g_nb.len = g_nb.off = 0; g_nb.pending = 0;
+    g_dedup.last = g_dedup.repeats = 0;
+    if(g_rot.gz_running){ free(g_rot.gz_file); g_rot.gz_file = NULL; g_rot.gz_running = 0; g_rot.gz_done = 0; }
+    pthread_cond_init(&g_flusher_cv, NULL);
+    if(g_file.flusher && pthread_create(&g_flusher_th, NULL, flusher_main, NULL) != 0) g_file.flusher = 0;
+}
+
+static void fork_child(void){
+    fork_child_async();
+    fork_child_sinks();
+    if(g_shm.hdr){
+        // Principale o figlio ancora collegato: i record vanno nel ring
+        if(g_shm.owner || (cfg_get() & DERR_CFG_SHM)) cfg_set(DERR_CFG_SHM, DERR_CFG_SHM);
+        g_shm.owner = 0;
+        g_shm.stall_ns = 0;
+    }
+    fork_unlock();
+}
+
+static pthread_once_t g_fork_once = PTHREAD_ONCE_INIT;
+static void fork_register(void){ pthread_atfork(fork_prepare, fork_unlock, fork_child); }
+static void fork_init_once(void){ pthread_once(&g_fork_once, fork_register); }
+
+int derr_shm_start(size_t slots, size_t slot_bytes){
+    if(!slots) slots = DERR_SHM_SLOTS;
+    if(!slot_bytes) slot_bytes = DERR_SHM_LINE;
+    if(slot_bytes < 128 || slot_bytes > ((size_t)1 << 20) || slots > ((size_t)1 << 24)){ errno = EINVAL; return -1; }
+    sinks_init_once();
+    pthread_mutex_lock(&g_shm.mu);
+    if(g_shm.hdr){ pthread_mutex_unlock(&g_shm.mu); errno = EBUSY; return -1; }
+    size_t cap = 2;
+    while(cap < slots) cap <<= 1;
+    size_t ssz = (sizeof(struct derr_shm_slot) + slot_bytes + 1 + 63) & ~(size_t)63;
+    size_t len = sizeof(struct derr_shm_hdr) + cap * ssz;
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED){ pthread_mutex_unlock(&g_shm.mu); errno = ENOMEM; return -1; }
+    struct derr_shm_hdr *h = (struct derr_shm_hdr *)mem;    // già azzerata
+    h->slot_size = ssz;
+    h->mask = cap - 1;
+    for(size_t i = 0; i < cap; i++) shm_slot(h, i)->seq = i;
+
+    g_shm.hdr = h;
+    g_shm.map_len = len;
+    g_shm.line_max = slot_bytes;
+    g_shm.stop = 0;
+    g_shm.stall_ns = 0;
+    int rc = pthread_create(&g_shm.th, NULL, shm_main, NULL);
+    if(rc != 0){
+        g_shm.hdr = NULL; munmap(mem, len);
+        pthread_mutex_unlock(&g_shm.mu);
+        errno = rc; return -1;
+    }
+    static int atexit_done = 0;
+    if(!atexit_done){ atexit(derr_shm_stop); atexit_done = 1; }
+    DERR_STORE(&g_shm.owner, 1);
+    pthread_mutex_unlock(&g_shm.mu);
+    return 0;
+}
+
+void derr_shm_stop(void){
+    pthread_mutex_lock(&g_shm.mu);
+    if(!g_shm.hdr){ pthread_mutex_unlock(&g_shm.mu); return; }
+    if(!g_shm.owner){
+        // Figlio: i record già costruiti possono ancora puntare al ring, che
+        // resta mappato fino all'uscita
+        cfg_set(DERR_CFG_SHM, 0);
+        pthread_mutex_unlock(&g_shm.mu);
+        return;
+    }
+    g_shm.stop = 1;
+    pthread_mutex_unlock(&g_shm.mu);
+    pthread_join(g_shm.th, NULL);
+
+    pthread_mutex_lock(&g_shm.mu);
+    shm_drain();
+    DERR_STORE(&g_shm.owner, 0);
+    munmap(g_shm.hdr, g_shm.map_len);
+    g_shm.hdr = NULL;
+    pthread_mutex_unlock(&g_shm.mu);
+    derr_flush();
+}
+
+unsigned long long derr_shm_dropped(void){
+    struct derr_shm_hdr *h = __atomic_load_n(&g_shm.hdr, __ATOMIC_ACQUIRE);
+    return h ? DERR_LOAD(&h->dropped) : 0;
+}
+#else
+int  derr_shm_start(size_t slots, size_t slot_bytes){ (void)slots; (void)slot_bytes; errno = ENOSYS; return -1; }
+void derr_shm_stop(void){}
+unsigned long long derr_shm_dropped(void){ return 0; }
+#endif
+
+static void stats_sum(derr_stats *st, const struct derr_tstats *t){
+    for(int i = 0; i < DERR_STATS_LEVELS; i++) st->emitted[i] += __atomic_load_n(&t->emitted[i], __ATOMIC_RELAXED);
+    st->filtered   += __atomic_load_n(&t->filtered, __ATOMIC_RELAXED);
+    st->suppressed += __atomic_load_n(&t->suppressed, __ATOMIC_RELAXED);
+    for(int i = 0; i < DERR_MAX_SINKS; i++){
+        st->sink_records[i] += __atomic_load_n(&t->sink_records[i], __ATOMIC_RELAXED);
+        st->sink_bytes[i]   += __atomic_load_n(&t->sink_bytes[i], __ATOMIC_RELAXED);
+    }
+    st->lock_waits   += __atomic_load_n(&t->lock_waits, __ATOMIC_RELAXED);
+    st->lock_wait_ns += __atomic_load_n(&t->lock_wait_ns, __ATOMIC_RELAXED);
+    unsigned long long m = __atomic_load_n(&t->max_write_ns, __ATOMIC_RELAXED);
+    if(m > st->max_write_ns) st->max_write_ns = m;
+}
+
+void derr_get_stats(derr_stats *st){
+    if(!st) return;
+    memset(st, 0, sizeof *st);
+    stats_sum(st, &g_stats_shared);
+    for(const struct derr_tstats *t = __atomic_load_n(&g_stats_list, __ATOMIC_ACQUIRE); t; t = t->next) stats_sum(st, t);
+    // Le perdite hanno già contatori propri, aggiornati fuori dal percorso caldo
+    st->dropped = derr_async_dropped() + derr_stderr_dropped() + derr_shm_dropped();
+    for(int i = 0; i < DERR_MAX_SINKS; i++) st->dropped += derr_syslog_socket_dropped(i) + derr_net_dropped(i);
+#if DERR_POSIX
+    pthread_mutex_lock(&g_arena.mu);
+    st->arena_bytes = g_arena.bytes;
+    st->arena_limit = g_arena.limit;
+    pthread_mutex_unlock(&g_arena.mu);
+    st->arena_truncated = DERR_LOAD(&g_arena.truncated);
+    st->arena_heap = DERR_LOAD(&g_arena.heap);
+#endif
+}
+
+void derr_set_stats_timing(int enable){ __atomic_store_n(&g_stats_timing, enable ? 1 : 0, __ATOMIC_RELAXED); }
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,358 @@
+// derr.hpp - Frontend C++17 per derr.h con formato verificato a compile time
+//
+//   #include "derr.hpp"        // DERR_IMPLEMENTATION e DERR_MODULE_NAME come per derr.h
+//
+//   DERR_CXX_INFO("richiesta {} completata in {:.3f} ms", id, ms);
+//   DERR_CXX_WARN("%s: %d tentativi", host, n);          // stile printf, tipi verificati
+//   DERR_CXX_ERROR_ERRNO(errno, "open {}", path);
+//
+// Il formato (letterale) è analizzato a compile time: numero e tipo degli
+// argomenti sono verificati con static_assert e un formato "{}" diventa, una
+// volta per punto di chiamata, il formato printf equivalente. Gli argomenti
+// sono serializzati dal loro tipo C++ direttamente nella forma del log
+// binario, senza va_list: log binario e formattazione differita li copiano
+// così come sono, gli altri percorsi li rendono come il decoder. Stato,
+// sink, livelli, moduli e campionamento sono quelli di derr.h; le macro C
+// restano disponibili.
+//
+// Un formato che contiene '{' è in stile {} ("{{" e "}}" per le graffe, '%'
+// letterale); altrimenti è printf (i modificatori di lunghezza non contano:
+// vale il tipo dell'argomento). Segnaposto:
+//   {}  oppure  {:[<>][+ ][#][0][larghezza][.precisione][tipo]}
+// con tipo fra d i u o x X c e E f F g G a A s p; niente indici né nomi.
+// Tipi: interi ed enum, char (%c), bool ("true"/"false"), float e double
+// (long double come double), const char*, std::string, std::string_view,
+// puntatori (%p). Predefiniti: d, u, c, s, g, s, p.
+
+#ifndef DERR_HPP
+#define DERR_HPP
+
+#if __cplusplus < 201703L
+#error "derr.hpp richiede C++17"
+#endif
+
+#include "derr.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace derr {
+namespace detail {
+
+// Classe dell'argomento, dal tipo
+enum kind : unsigned char { K_INT, K_UINT, K_CHAR, K_BOOL, K_FLT, K_CSTR, K_STR, K_PTR, K_BAD };
+
+template<class T> constexpr kind kind_of(){
+    if constexpr (std::is_same_v<T, bool>) return K_BOOL;
+    else if constexpr (std::is_same_v<T, char>) return K_CHAR;
+    else if constexpr (std::is_enum_v<T>) return kind_of<std::underlying_type_t<T>>();
+    else if constexpr (std::is_integral_v<T>) return std::is_signed_v<T> ? K_INT : K_UINT;
+    else if constexpr (std::is_floating_point_v<T>) return K_FLT;
+    else if constexpr (std::is_same_v<T, const char *> || std::is_same_v<T, char *>) return K_CSTR;
+    else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) return K_STR;
+    else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) return K_PTR;
+    else return K_BAD;
+}
+
+enum error : unsigned char { E_OK, E_ARGS_FEW, E_ARGS_MANY, E_TYPE, E_SPEC, E_BRACE };
+
+// Tag del log binario per un argomento di classe k sotto la conversione conv;
+// 'b' = bool scritto come stringa, 0 = incompatibili
+constexpr char tag_for(kind k, char conv){
+    switch(conv){
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            return k == K_INT || k == K_CHAR || k == K_BOOL ? 'i' : k == K_UINT ? 'u' : 0;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            return k == K_FLT ? 'f' : 0;
+        case 's':
+            return k == K_CSTR || k == K_STR ? 's' : k == K_BOOL ? 'b' : 0;
+        case 'p':
+            return k == K_PTR || k == K_CSTR ? 'p' : 0;
+        default:
+            return 0;
+    }
+}
+
+constexpr char default_conv(kind k){
+    switch(k){
+        case K_INT:  return 'd';
+        case K_UINT: return 'u';
+        case K_CHAR: return 'c';
+        case K_FLT:  return 'g';
+        case K_PTR:  return 'p';
+        default:     return 's';
+    }
+}
+
+constexpr bool is_digit(char c){ return c >= '0' && c <= '9'; }
+
+constexpr std::size_t cstrlen(const char *s){
+    std::size_t n = 0;
+    while(s[n]) n++;
+    return n;
+}
+
+// Esito dell'analisi: formato printf (solo per lo stile {}), tag per argomento
+template<std::size_t N, std::size_t M>
+struct parsed {
+    char        fmt[N] = {};
+    char        tag[M + 1] = {};
+    bool        printf_style = false;
+    error       err = E_OK;
+};
+
+template<std::size_t N, std::size_t M>
+constexpr parsed<N, M> parse_printf(const char *s, const kind *k){
+    parsed<N, M> r;
+    r.printf_style = true;
+    std::size_t a = 0;
+    for(std::size_t i = 0; s[i]; i++){
+        if(s[i] != '%') continue;
+        if(s[++i] == '%') continue;
+        while(s[i] == '-' || s[i] == '+' || s[i] == ' ' || s[i] == '#' || s[i] == '0' || s[i] == '\'') i++;
+        for(int part = 0; part < 2; part++){          // larghezza, poi precisione
+            if(part == 1){ if(s[i] != '.') break; i++; }
+            if(s[i] == '*'){
+                if(a >= M){ r.err = E_ARGS_FEW; return r; }
+                if(tag_for(k[a], 'd') != 'i' && tag_for(k[a], 'd') != 'u'){ r.err = E_TYPE; return r; }
+                r.tag[a++] = 'i';
+                i++;
+            } else while(is_digit(s[i])) i++;
+        }
+        int nl = 0;                                    // %ls e %lc sono wide: non supportati
+        while(s[i] == 'h' || s[i] == 'l' || s[i] == 'q' || s[i] == 'j' || s[i] == 'z' || s[i] == 't' || s[i] == 'L')
+            nl += s[i++] == 'l';
+        char conv = s[i];
+        if(!conv || conv == 'n' || (nl == 1 && (conv == 's' || conv == 'c'))){ r.err = E_SPEC; return r; }
+        if(a >= M){ r.err = E_ARGS_FEW; return r; }
+        char t = tag_for(k[a], conv);
+        if(!t){ r.err = tag_for(K_INT, conv) || tag_for(K_FLT, conv) || tag_for(K_CSTR, conv) ? E_TYPE : E_SPEC; return r; }
+        r.tag[a++] = t;
+    }
+    if(a != M) r.err = E_ARGS_MANY;
+    return r;
+}
+
+template<std::size_t N, std::size_t M>
+constexpr parsed<N, M> parse_braces(const char *s, const kind *k){
+    parsed<N, M> r;
+    std::size_t o = 0, a = 0;
+    for(std::size_t i = 0; s[i]; i++){
+        char c = s[i];
+        if(c == '%'){ r.fmt[o++] = '%'; r.fmt[o++] = '%'; continue; }
+        if(c == '}'){
+            if(s[i + 1] != '}'){ r.err = E_BRACE; return r; }
+            r.fmt[o++] = '}'; i++;
+            continue;
+        }
+        if(c != '{'){ r.fmt[o++] = c; continue; }
+        if(s[i + 1] == '{'){ r.fmt[o++] = '{'; i++; continue; }
+
+        if(a >= M){ r.err = E_ARGS_FEW; return r; }
+        r.fmt[o++] = '%';
+        char conv = 0;
+        i++;
+        if(s[i] == ':'){
+            i++;
+            if(s[i] == '<'){ r.fmt[o++] = '-'; i++; }
+            else if(s[i] == '>') i++;
+            while(s[i] == '+' || s[i] == ' ' || s[i] == '#' || s[i] == '0') r.fmt[o++] = s[i++];
+            while(is_digit(s[i])) r.fmt[o++] = s[i++];
+            if(s[i] == '.'){
+                r.fmt[o++] = s[i++];
+                if(!is_digit(s[i])){ r.err = E_SPEC; return r; }
+                while(is_digit(s[i])) r.fmt[o++] = s[i++];
+            }
+            if(s[i] && s[i] != '}') conv = s[i++];
+        }
+        if(s[i] != '}'){ r.err = E_SPEC; return r; }   // indici, nomi, '^', specifica troncata
+        if(!conv) conv = default_conv(k[a]);
+        char t = tag_for(k[a], conv);
+        if(!t){ r.err = tag_for(K_INT, conv) || tag_for(K_FLT, conv) || tag_for(K_CSTR, conv) ? E_TYPE : E_SPEC; return r; }
+        r.fmt[o++] = conv;
+        r.tag[a++] = t;
+    }
+    if(a != M) r.err = E_ARGS_MANY;
+    return r;
+}
+
+template<std::size_t N, std::size_t M>
+constexpr parsed<N, M> parse(const char *s, const kind *k){
+    for(std::size_t i = 0; s[i]; i++)
+        if(s[i] == '{') return parse_braces<N, M>(s, k);
+    return parse_printf<N, M>(s, k);
+}
+
+template<class... A> constexpr bool all_supported(){ return ((kind_of<A>() != K_BAD) && ... && true); }
+
+// Analisi fatta una volta per punto di chiamata (F è la struct locale della macro)
+template<class F, class... A>
+struct site_format {
+    static constexpr kind kinds[sizeof...(A) + 1] = { kind_of<A>()..., K_BAD };
+    static constexpr std::size_t len = cstrlen(F::str());
+    static constexpr parsed<2 * len + 1, sizeof...(A)> spec = parse<2 * len + 1, sizeof...(A)>(F::str(), kinds);
+};
+
+// ---- Serializzazione ----
+inline std::string_view str_of(const char *s){ return s ? std::string_view(s) : std::string_view("(null)"); }
+inline std::string_view str_of(const std::string &s){ return s; }
+inline std::string_view str_of(std::string_view s){ return s; }
+inline std::string_view str_of(bool b){ return b ? std::string_view("true") : std::string_view("false"); }
+
+template<char T, class V> inline std::size_t arg_size(const V &v){
+    if constexpr (T == 's' || T == 'b') return 5 + str_of(v).size();
+    else { (void)v; return 9; }
+}
+
+template<char T, class V> inline char *arg_put(char *p, const V &v){
+    *p++ = T == 'b' ? 's' : T;
+    if constexpr (T == 's' || T == 'b'){
+        std::string_view s = str_of(v);
+        uint32_t n = (uint32_t)s.size();
+        std::memcpy(p, &n, 4);
+        std::memcpy(p + 4, s.data(), s.size());
+        return p + 4 + s.size();
+    } else {
+        if constexpr (T == 'i'){ long long x = (long long)v; std::memcpy(p, &x, 8); }
+        else if constexpr (T == 'u'){ unsigned long long x = (unsigned long long)v; std::memcpy(p, &x, 8); }
+        else if constexpr (T == 'f'){ double x = (double)v; std::memcpy(p, &x, 8); }
+        else {
+            unsigned long long x = (unsigned long long)(uintptr_t)(const void *)v;
+            std::memcpy(p, &x, 8);
+        }
+        return p + 8;
+    }
+}
+
+template<class S, std::size_t... I, class... A>
+inline void emit(std::index_sequence<I...>, derr_site *site, unsigned sample, derr_level lvl, int has_errno,
+                 int errnum, const char *fmt, const A &...a){
+    std::size_t need = (std::size_t)0 + (arg_size<S::spec.tag[I]>(a) + ... + 0);
+    char stack[512];
+    char *buf = need <= sizeof stack ? stack : (char *)std::malloc(need);
+    if(!buf) return;
+    char *p = buf;
+    ((p = arg_put<S::spec.tag[I]>(p, a)), ...);
+    derr_log_packed_(site, sample, lvl, has_errno, errnum, fmt, buf, (std::size_t)(p - buf));
+    if(buf != stack) std::free(buf);
+}
+
+template<class F, class... A>
+inline void log(derr_site *site, unsigned sample, derr_level lvl, int has_errno, int errnum,
+                const char *, const A &...a){
+    static_assert(all_supported<std::decay_t<A>...>(), "derr: tipo di argomento non supportato");
+    using S = site_format<F, std::decay_t<A>...>;
+    static_assert(S::spec.err != E_ARGS_FEW, "derr: più segnaposto che argomenti");
+    static_assert(S::spec.err != E_ARGS_MANY, "derr: più argomenti che segnaposto");
+    static_assert(S::spec.err != E_TYPE, "derr: argomento incompatibile con la conversione");
+    static_assert(S::spec.err != E_SPEC, "derr: segnaposto o conversione non supportati");
+    static_assert(S::spec.err != E_BRACE, "derr: '}' senza '{' (per la graffa usare \"}}\")");
+    const char *fmt = S::spec.printf_style ? F::str() : S::spec.fmt;
+    emit<S>(std::index_sequence_for<A...>{}, site, sample, lvl, has_errno, errnum, fmt, a...);
+}
+
+} // namespace detail
+} // namespace derr
+
+// ---- Macro ----
+// Il primo argomento è il formato letterale: diventa il valore di una
+// funzione constexpr di una struct locale, unica per punto di chiamata.
+#define DERR_CXX_FMT_(f, ...) f
+#define DERR_CXX_CALL_(sample, lvl, has_errno, err, ...) do { \
+    struct derr_fmt_ { static constexpr const char *str(){ return DERR_CXX_FMT_(__VA_ARGS__, 0); } }; \
+    ::derr::detail::log<derr_fmt_>(&derr_site_, (sample), (lvl), (has_errno), (err), __VA_ARGS__); \
+} while(0)
+
+#define DERR_CXX_LOG_(mod, lvl, has_errno, err, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    if(derr_module_enabled_(&derr_site_, (mod), (lvl)) && derr_level_sample_(lvl) \
+       && derr_site_allow_(&derr_site_, (lvl))) \
+        DERR_CXX_CALL_(0, (lvl), (has_errno), (err), __VA_ARGS__); \
+} while(0)
+#define DERR_CXX_LOG_RL_(lvl, burst, per_sec, has_errno, err, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    if(derr_module_enabled_(&derr_site_, DERR_MODULE_NAME, (lvl)) && derr_level_sample_(lvl) \
+       && derr_ratelimit_allow(&derr_site_, (lvl), (burst), (per_sec))) \
+        DERR_CXX_CALL_(0, (lvl), (has_errno), (err), __VA_ARGS__); \
+} while(0)
+#define DERR_CXX_LOG_SAMPLED_(lvl, rate, ...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    if(derr_module_enabled_(&derr_site_, DERR_MODULE_NAME, (lvl))){ \
+        unsigned derr_rate_ = (unsigned)(rate); \
+        if(derr_sample_(derr_rate_) && derr_site_allow_(&derr_site_, (lvl))) \
+            DERR_CXX_CALL_(derr_rate_ > 1 ? derr_rate_ : 1, (lvl), 0, 0, __VA_ARGS__); \
+    } \
+} while(0)
+// Sotto DERR_COMPILE_MIN_LEVEL: il formato è verificato ma la chiamata non esiste
+#define DERR_CXX_DISCARD_(lvl, ...) do { if(0) DERR_CXX_LOG_(DERR_MODULE_NAME, (lvl), 0, 0, __VA_ARGS__); } while(0)
+
+#define DERR_CXX_MODULE_LOG(mod, lvl, ...)            DERR_CXX_LOG_((mod), (lvl), 0, 0, __VA_ARGS__)
+#define DERR_CXX_MODULE_LOG_ERRNO(mod, lvl, err, ...) DERR_CXX_LOG_((mod), (lvl), 1, (err), __VA_ARGS__)
+
+#if DERR_COMPILE_MIN_LEVEL <= 10
+  #define DERR_CXX_DEBUG(...)                   DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_DEBUG, 0, 0, __VA_ARGS__)
+  #define DERR_CXX_DEBUG_ERRNO(err, ...)        DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_DEBUG, 1, (err), __VA_ARGS__)
+  #define DERR_CXX_DEBUG_RATELIMITED(b, r, ...) DERR_CXX_LOG_RL_(DERR_DEBUG, (b), (r), 0, 0, __VA_ARGS__)
+  #define DERR_CXX_DEBUG_SAMPLED(rate, ...)     DERR_CXX_LOG_SAMPLED_(DERR_DEBUG, (rate), __VA_ARGS__)
+#else
+  #define DERR_CXX_DEBUG(...)                   DERR_CXX_DISCARD_(DERR_DEBUG, __VA_ARGS__)
+  #define DERR_CXX_DEBUG_ERRNO(err, ...)        do { if(0){ (void)(err); DERR_CXX_DISCARD_(DERR_DEBUG, __VA_ARGS__); } } while(0)
+  #define DERR_CXX_DEBUG_RATELIMITED(b, r, ...) DERR_CXX_DISCARD_(DERR_DEBUG, __VA_ARGS__)
+  #define DERR_CXX_DEBUG_SAMPLED(rate, ...)     DERR_CXX_DISCARD_(DERR_DEBUG, __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 20
+  #define DERR_CXX_INFO(...)                    DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_INFO, 0, 0, __VA_ARGS__)
+  #define DERR_CXX_INFO_ERRNO(err, ...)         DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_INFO, 1, (err), __VA_ARGS__)
+  #define DERR_CXX_INFO_RATELIMITED(b, r, ...)  DERR_CXX_LOG_RL_(DERR_INFO, (b), (r), 0, 0, __VA_ARGS__)
+  #define DERR_CXX_INFO_SAMPLED(rate, ...)      DERR_CXX_LOG_SAMPLED_(DERR_INFO, (rate), __VA_ARGS__)
+#else
+  #define DERR_CXX_INFO(...)                    DERR_CXX_DISCARD_(DERR_INFO, __VA_ARGS__)
+  #define DERR_CXX_INFO_ERRNO(err, ...)         do { if(0){ (void)(err); DERR_CXX_DISCARD_(DERR_INFO, __VA_ARGS__); } } while(0)
+  #define DERR_CXX_INFO_RATELIMITED(b, r, ...)  DERR_CXX_DISCARD_(DERR_INFO, __VA_ARGS__)
+  #define DERR_CXX_INFO_SAMPLED(rate, ...)      DERR_CXX_DISCARD_(DERR_INFO, __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 30
+  #define DERR_CXX_WARN(...)                    DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_WARN, 0, 0, __VA_ARGS__)
+  #define DERR_CXX_WARN_ERRNO(err, ...)         DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_WARN, 1, (err), __VA_ARGS__)
+  #define DERR_CXX_WARN_RATELIMITED(b, r, ...)  DERR_CXX_LOG_RL_(DERR_WARN, (b), (r), 0, 0, __VA_ARGS__)
+  #define DERR_CXX_WARN_SAMPLED(rate, ...)      DERR_CXX_LOG_SAMPLED_(DERR_WARN, (rate), __VA_ARGS__)
+#else
+  #define DERR_CXX_WARN(...)                    DERR_CXX_DISCARD_(DERR_WARN, __VA_ARGS__)
+  #define DERR_CXX_WARN_ERRNO(err, ...)         do { if(0){ (void)(err); DERR_CXX_DISCARD_(DERR_WARN, __VA_ARGS__); } } while(0)
+  #define DERR_CXX_WARN_RATELIMITED(b, r, ...)  DERR_CXX_DISCARD_(DERR_WARN, __VA_ARGS__)
+  #define DERR_CXX_WARN_SAMPLED(rate, ...)      DERR_CXX_DISCARD_(DERR_WARN, __VA_ARGS__)
+#endif
+#if DERR_COMPILE_MIN_LEVEL <= 40
+  #define DERR_CXX_ERROR(...)                   DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_ERROR, 0, 0, __VA_ARGS__)
+  #define DERR_CXX_ERROR_ERRNO(err, ...)        DERR_CXX_LOG_(DERR_MODULE_NAME, DERR_ERROR, 1, (err), __VA_ARGS__)
+  #define DERR_CXX_ERROR_RATELIMITED(b, r, ...) DERR_CXX_LOG_RL_(DERR_ERROR, (b), (r), 0, 0, __VA_ARGS__)
+  #define DERR_CXX_ERROR_SAMPLED(rate, ...)     DERR_CXX_LOG_SAMPLED_(DERR_ERROR, (rate), __VA_ARGS__)
+#else
+  #define DERR_CXX_ERROR(...)                   DERR_CXX_DISCARD_(DERR_ERROR, __VA_ARGS__)
+  #define DERR_CXX_ERROR_ERRNO(err, ...)        do { if(0){ (void)(err); DERR_CXX_DISCARD_(DERR_ERROR, __VA_ARGS__); } } while(0)
+  #define DERR_CXX_ERROR_RATELIMITED(b, r, ...) DERR_CXX_DISCARD_(DERR_ERROR, __VA_ARGS__)
+  #define DERR_CXX_ERROR_SAMPLED(rate, ...)     DERR_CXX_DISCARD_(DERR_ERROR, __VA_ARGS__)
+#endif
+
+// Errori fatali (escono dal programma), come DIE e DIE_ERRNO
+#define DERR_CXX_DIE(...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    DERR_CXX_CALL_(0, DERR_FATAL, 0, 0, __VA_ARGS__); \
+    derr_flush(); \
+    exit(EXIT_FAILURE); \
+} while(0)
+#define DERR_CXX_DIE_ERRNO(...) do { \
+    static derr_site derr_site_ = DERR_SITE_INIT_; \
+    int derr_errno_ = errno; \
+    DERR_CXX_CALL_(0, DERR_FATAL, 1, derr_errno_, __VA_ARGS__); \
+    derr_flush(); \
+    exit(EXIT_FAILURE); \
+} while(0)
+
+#endif // DERR_HPP
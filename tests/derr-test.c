@@ -0,0 +1,453 @@
+// derr-test.c - Test di comportamento di derr.h
+// gcc -O2 -pthread -rdynamic derr-test.c -o derr-test && ./derr-test
+// gcc -O1 -g -fsanitize=thread -pthread derr-test.c -o derr-test-tsan && ./derr-test-tsan ring sink
+//
+// Uso: derr-test [test ...]   (senza argomenti: tutti)
+//
+// Ogni test usa sink propri che catturano i record; stderr resta spento.
+// Esce con 0 se tutti i test selezionati passano, 1 altrimenti.
+
+#define DERR_IMPLEMENTATION
+#include "../derr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char test_dir[256];            // directory temporanea dei file di prova
+
+static const char *test_name;
+static void fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("FALLITO %s: ", test_name);
+    vprintf(fmt, ap);
+    putchar('\n');
+    va_end(ap);
+}
+#define CHECK(c, ...) do { if (!(c)) { fail(__VA_ARGS__); return -1; } } while (0)
+
+// ---- Sink di cattura ----
+// Copia messaggio ed errno di ogni record; write serializzata dalla libreria.
+// hold ferma lo scrittore dentro write (HOLD_WRITE) o nel flush d'inattività
+// (HOLD_FLUSH), dove non ha in mano alcuno slot; held dice che è fermo.
+#define CAP_MAX 4096
+enum { HOLD_NONE, HOLD_WRITE, HOLD_FLUSH };
+typedef struct capture {
+    int    n;
+    char  *msg[CAP_MAX];
+    int    errnum[CAP_MAX];
+    int    hold, held;
+    int    slow;                  // pausa ogni tanti record (costringe la coda a riempirsi)
+} capture;
+
+static void cap_hold(capture *c, int where) {
+    if (__atomic_load_n(&c->hold, __ATOMIC_ACQUIRE) != where) return;
+    __atomic_store_n(&c->held, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&c->hold, __ATOMIC_ACQUIRE) == where) usleep(200);
+}
+static void cap_wait_held(capture *c) {
+    while (!__atomic_load_n(&c->held, __ATOMIC_ACQUIRE)) usleep(200);
+}
+
+static void cap_write(void *ctx, const derr_record *r) {
+    capture *c = (capture *)ctx;
+    cap_hold(c, HOLD_WRITE);
+    if (c->slow && c->n % 8 == 0) usleep(20);
+    if (c->n < CAP_MAX) {
+        char *m = (char *)malloc(r->msg_len + 1);
+        memcpy(m, r->msg, r->msg_len);
+        m[r->msg_len] = 0;
+        c->msg[c->n] = m;
+        c->errnum[c->n] = r->has_errno ? r->errnum : 0;
+    }
+    c->n++;
+}
+static void cap_flush(void *ctx) { cap_hold((capture *)ctx, HOLD_FLUSH); }
+static const derr_sink_vtable cap_vt = { cap_write, cap_flush, NULL, DERR_SINK_IDLE_FLUSH };
+
+static int cap_add(capture *c) {
+    memset(c, 0, sizeof *c);
+    return derr_add_sink(&cap_vt, c, DERR_DEBUG);
+}
+static void cap_free(capture *c) {
+    for (int i = 0; i < c->n && i < CAP_MAX; i++) free(c->msg[i]);
+    c->n = 0;
+}
+
+// Numero dopo il prefisso ("rec 12" → 12), -1 se assente
+static long msg_id(const char *m, const char *prefix) {
+    size_t n = strlen(prefix);
+    return strncmp(m, prefix, n) ? -1 : strtol(m + n, NULL, 10);
+}
+
+// ---- Modalità asincrona: record scritti e scartati per politica ----
+typedef struct producer {
+    pthread_t th;
+    int       base, count;
+} producer;
+
+static void *produce(void *arg) {
+    producer *p = (producer *)arg;
+    for (int i = 0; i < p->count; i++) derr_log(DERR_INFO, "rec %d", p->base + i);
+    return NULL;
+}
+
+static int test_async_block(void) {
+    capture c;
+    int id = cap_add(&c);
+    c.slow = 1;
+    derr_async_set_overflow(DERR_OVERFLOW_BLOCK);
+    CHECK(derr_async_start(16) == 0, "derr_async_start: %s", strerror(errno));
+    unsigned long long d0 = derr_async_dropped();
+    producer pr[4];
+    for (int i = 0; i < 4; i++) {
+        pr[i].base = i * 1000; pr[i].count = 1000;
+        pthread_create(&pr[i].th, NULL, produce, &pr[i]);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(pr[i].th, NULL);
+    derr_flush();
+    derr_async_stop();
+    derr_remove_sink(id);
+
+    CHECK(derr_async_dropped() == d0, "BLOCK ha scartato %llu record", derr_async_dropped() - d0);
+    CHECK(c.n == 4000, "scritti %d record su 4000", c.n);
+    // Ordine per produttore preservato
+    long last[4] = { -1, -1, -1, -1 };
+    for (int i = 0; i < c.n; i++) {
+        long v = msg_id(c.msg[i], "rec ");
+        CHECK(v >= 0 && v < 4000, "record inatteso '%s'", c.msg[i]);
+        CHECK(v > last[v / 1000], "record %ld dopo %ld", v, last[v / 1000]);
+        last[v / 1000] = v;
+    }
+    cap_free(&c);
+    return 0;
+}
+
+// Ring da 16 pieno con lo scrittore fermo dove indica hold; il primo record
+// ("primo") lo porta lì, gli altri 1000 seguono la politica. I record scritti
+// restano in c, gli scartati in *dropped.
+static int async_drop_run(derr_overflow pol, int hold, capture *c, unsigned long long *dropped) {
+    int id = cap_add(c);
+    c->hold = hold;
+    derr_async_set_overflow(pol);
+    CHECK(derr_async_start(16) == 0, "derr_async_start: %s", strerror(errno));
+    unsigned long long d0 = derr_async_dropped();
+    derr_log(DERR_INFO, "primo");
+    cap_wait_held(c);
+    producer p = { 0, 0, 1000 };
+    produce(&p);                  // non deve mai attendere lo scrittore
+    __atomic_store_n(&c->hold, HOLD_NONE, __ATOMIC_RELEASE);
+    derr_flush();
+    derr_async_stop();
+    derr_remove_sink(id);
+    derr_async_set_overflow(DERR_OVERFLOW_BLOCK);
+    *dropped = derr_async_dropped() - d0;
+
+    CHECK(c->n >= 1 && !strcmp(c->msg[0], "primo"), "primo record perso");
+    CHECK(c->n - 1 + *dropped == 1000, "scritti %d + scartati %llu != 1000", c->n - 1, *dropped);
+    long prev = -1;
+    for (int i = 1; i < c->n; i++) {
+        long v = msg_id(c->msg[i], "rec ");
+        CHECK(v > prev, "ordine: %ld dopo %ld", v, prev);
+        prev = v;
+    }
+    return 0;
+}
+
+// Scrittore fermo nel flush: il ring contiene solo record in coda
+static int async_drop(derr_overflow pol, long first) {
+    capture c;
+    unsigned long long dropped;
+    if (async_drop_run(pol, HOLD_FLUSH, &c, &dropped)) return -1;
+    CHECK(c.n == 17, "scritti %d record con coda da 16", c.n - 1);
+    for (int i = 1; i < c.n; i++)
+        CHECK(msg_id(c.msg[i], "rec ") == first + i - 1, "record %d: '%s', atteso rec %ld", i, c.msg[i], first + i - 1);
+    cap_free(&c);
+    return 0;
+}
+static int test_async_drop_newest(void) { return async_drop(DERR_OVERFLOW_DROP_NEWEST, 0); }
+
+static int test_async_drop_oldest(void) {
+    if (async_drop(DERR_OVERFLOW_DROP_OLDEST, 984)) return -1;
+    // Scrittore fermo dentro write su "primo": lo slot che servirebbe è suo e
+    // scartare altri non lo libera; il produttore scarta il record corrente
+    capture c;
+    unsigned long long dropped;
+    if (async_drop_run(DERR_OVERFLOW_DROP_OLDEST, HOLD_WRITE, &c, &dropped)) return -1;
+    CHECK(c.n == 16, "scritti %d record con lo scrittore fermo", c.n - 1);
+    cap_free(&c);
+    return 0;
+}
+
+// ---- Formattazione differita: stesso messaggio della formattazione immediata ----
+static void deferred_calls(void) {
+    char buf[32];
+    strcpy(buf, "originale");
+    DERR_INFO("interi %d %u %ld %lld %zu %x %#o", -7, 7u, -70000L, 1LL << 40, (size_t)12345, 255u, 8u);
+    DERR_INFO("reali %5.2f %e %g %.0f", 3.14159, 1e-9, 0.5, 2.5);
+    DERR_INFO("stringhe [%s] [%10s] [%-4s] [%.3s] %c %%", buf, "dx", "sx", "troncata", 'z');
+    DERR_INFO("larghezza variabile [%*d] [%.*s]", 6, 42, 2, "abc");
+    DERR_WARN("puntatore %p nullo %s", (void *)0x1234, "ok");
+    DERR_ERROR_ERRNO(ENOENT, "apertura di %s", buf);
+    strcpy(buf, "cambiata");      // le stringhe sono copiate per valore alla chiamata
+    char dyn[64];
+    snprintf(dyn, sizeof dyn, "formato non letterale %%d");
+    derr_log(DERR_INFO, dyn, 5);  // formattato subito anche in modalità differita
+    memset(dyn, 0, sizeof dyn);
+}
+
+static int test_deferred(void) {
+    capture a, b;
+    int id = cap_add(&a);
+    deferred_calls();
+    derr_remove_sink(id);
+
+    id = cap_add(&b);
+    derr_async_set_deferred(1);
+    CHECK(derr_async_start(64) == 0, "derr_async_start: %s", strerror(errno));
+    deferred_calls();
+    derr_flush();
+    derr_async_stop();
+    derr_async_set_deferred(0);
+    derr_remove_sink(id);
+
+    CHECK(a.n == 7 && b.n == a.n, "record: immediati %d, differiti %d", a.n, b.n);
+    for (int i = 0; i < a.n; i++) {
+        CHECK(!strcmp(a.msg[i], b.msg[i]), "record %d: '%s' != '%s'", i, a.msg[i], b.msg[i]);
+        CHECK(a.errnum[i] == b.errnum[i], "record %d: errno %d != %d", i, a.errnum[i], b.errnum[i]);
+    }
+    CHECK(!strcmp(b.msg[5], "apertura di originale") && b.errnum[5] == ENOENT, "errno: '%s'", b.msg[5]);
+    CHECK(!strcmp(b.msg[6], "formato non letterale 5"), "formato non letterale: '%s'", b.msg[6]);
+    cap_free(&a);
+    cap_free(&b);
+    return 0;
+}
+
+// ---- Log binario: codifica e derr_binary_decode ----
+static int test_binary(void) {
+    char path[300], out[300];
+    snprintf(path, sizeof path, "%s/bin.log", test_dir);
+    snprintf(out, sizeof out, "%s/bin.txt", test_dir);
+    CHECK(derr_binary_open(path, DERR_DEBUG) == 0, "derr_binary_open: %s", strerror(errno));
+    char big[3000];
+    memset(big, 'x', sizeof big - 1);
+    big[sizeof big - 1] = 0;
+    DERR_DEBUG("binario %d %u %s", -1, 2u, "tre");
+    DERR_INFO("reale %.3f esadecimale %x carattere %c", 2.5, 0xabcu, 'q');
+    DERR_ERROR_ERRNO(EACCES, "permesso negato su %s", "/etc/shadow");
+    derr_log(DERR_WARN, "lungo %s fine", big);
+    derr_binary_close();
+
+    FILE *in = fopen(path, "rb"), *o = fopen(out, "w+");
+    CHECK(in && o, "apertura file: %s", strerror(errno));
+    int rc = derr_binary_decode(in, o);
+    fclose(in);
+    CHECK(rc == 0, "derr_binary_decode = %d", rc);
+    rewind(o);
+    static char text[16384];
+    size_t n = fread(text, 1, sizeof text - 1, o);
+    text[n] = 0;
+    fclose(o);
+
+    const char *want[] = {
+        "[DEBUG]", "binario -1 2 tre",
+        "[INFO]", "reale 2.500 esadecimale abc carattere q",
+        "[ERROR]", "permesso negato su /etc/shadow", "EACCES",
+        "[WARN]", "lungo xxxx", "xxxx fine",
+    };
+    const char *p = text;
+    for (size_t i = 0; i < sizeof want / sizeof want[0]; i++) {
+        const char *q = strstr(p, want[i]);
+        CHECK(q, "'%s' assente (o fuori ordine) nel testo decodificato", want[i]);
+        p = q + strlen(want[i]);
+    }
+    remove(path);
+    remove(out);
+    return 0;
+}
+
+// ---- Rotazione: nomi .1 ... .keep, nessun record perso o fuori posto ----
+static int read_ids(const char *path, long *lo, long *hi, long *size) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    *lo = -1; *hi = -1;
+    while (fgets(line, sizeof line, f)) {
+        const char *m = strstr(line, "riga ");
+        if (!m) continue;
+        long v = strtol(m + 5, NULL, 10);
+        if (*lo < 0) *lo = v;
+        if (*hi >= 0 && v != *hi + 1) { fclose(f); return -2; }
+        *hi = v;
+    }
+    *size = ftell(f);
+    fclose(f);
+    return 0;
+}
+
+static int test_rotation(void) {
+    char path[300], name[320];
+    snprintf(path, sizeof path, "%s/rot.log", test_dir);
+    CHECK(derr_open_log_file(path, 1024, 0, 3) == 0, "derr_open_log_file: %s", strerror(errno));
+    for (int i = 0; i < 200; i++) DERR_INFO("riga %d", i);
+    derr_set_log_file(NULL);
+
+    long next = 200;              // dal file corrente verso il più vecchio
+    for (int k = 0; k <= 4; k++) {
+        if (k) snprintf(name, sizeof name, "%s.%d", path, k);
+        else snprintf(name, sizeof name, "%s", path);
+        long lo, hi, size;
+        int rc = read_ids(name, &lo, &hi, &size);
+        if (k == 4) { CHECK(rc == -1, "%s non doveva esistere (keep = 3)", name); break; }
+        CHECK(rc == 0, rc == -1 ? "%s mancante" : "%s: righe non consecutive", name);
+        CHECK(lo >= 0 && hi == next - 1, "%s: righe %ld..%ld, attesa fine a %ld", name, lo, hi, next - 1);
+        CHECK(size <= 1024, "%s: %ld byte oltre max_bytes", name, size);
+        next = lo;
+        remove(name);
+    }
+    return 0;
+}
+
+// ---- Ring asincrono sotto carico (da eseguire anche con TSan) ----
+static unsigned long long ring_count;
+static void ring_write(void *ctx, const derr_record *r) { (void)ctx; (void)r; __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED); }
+static const derr_sink_vtable ring_vt = { ring_write, NULL, NULL, DERR_SINK_THREADSAFE };
+
+static void *ring_producer(void *arg) {
+    producer *p = (producer *)arg;
+    for (int i = 0; i < p->count; i++) {
+        if (i & 1) DERR_INFO("ring %d %s", p->base + i, "differito");
+        else derr_log(DERR_INFO, "ring %d", p->base + i);
+    }
+    return NULL;
+}
+
+static int test_ring(void) {
+    __atomic_store_n(&ring_count, 0, __ATOMIC_RELAXED);
+    int id = derr_add_sink(&ring_vt, NULL, DERR_DEBUG);
+    derr_async_set_deferred(1);
+    CHECK(derr_async_start(64) == 0, "derr_async_start: %s", strerror(errno));
+    producer pr[6];
+    for (int i = 0; i < 6; i++) {
+        pr[i].base = i * 20000; pr[i].count = 20000;
+        pthread_create(&pr[i].th, NULL, ring_producer, &pr[i]);
+    }
+    for (int i = 0; i < 6; i++) pthread_join(pr[i].th, NULL);
+    derr_flush();
+    unsigned long long n = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    derr_async_stop();
+    derr_async_set_deferred(0);
+    derr_remove_sink(id);
+    CHECK(n == 120000, "scritti %llu record su 120000", n);
+    return 0;
+}
+
+// ---- Aggiunta e rimozione di sink mentre altri thread scrivono e svuotano ----
+typedef struct stress_ctx {
+    int  magic;
+    long n;
+} stress_ctx;
+#define STRESS_MAGIC 0x5eed
+
+static int stress_bad;
+static void stress_write(void *ctx, const derr_record *r) {
+    stress_ctx *x = (stress_ctx *)ctx;
+    (void)r;
+    if (x->magic != STRESS_MAGIC) __atomic_store_n(&stress_bad, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&x->n, 1, __ATOMIC_RELAXED);
+}
+static void stress_flush(void *ctx) {
+    if (((stress_ctx *)ctx)->magic != STRESS_MAGIC) __atomic_store_n(&stress_bad, 1, __ATOMIC_RELAXED);
+}
+static void stress_close(void *ctx) {
+    stress_ctx *x = (stress_ctx *)ctx;
+    x->magic = 0;
+    free(x);
+}
+static const derr_sink_vtable stress_ts_vt = { stress_write, stress_flush, stress_close, DERR_SINK_THREADSAFE };
+static const derr_sink_vtable stress_lk_vt = { stress_write, stress_flush, stress_close, 0 };
+
+static int stress_stop;
+static void *stress_logger(void *arg) {
+    (void)arg;
+    for (long i = 0; !__atomic_load_n(&stress_stop, __ATOMIC_ACQUIRE); i++) derr_log(DERR_INFO, "stress %ld", i);
+    return NULL;
+}
+static void *stress_flusher(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&stress_stop, __ATOMIC_ACQUIRE)) derr_flush();
+    return NULL;
+}
+
+static int test_sink(void) {
+    pthread_t th[4];
+    __atomic_store_n(&stress_stop, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < 3; i++) pthread_create(&th[i], NULL, stress_logger, NULL);
+    pthread_create(&th[3], NULL, stress_flusher, NULL);
+    int err = 0;
+    for (int i = 0; i < 5000 && !err; i++) {
+        stress_ctx *x = (stress_ctx *)malloc(sizeof *x);
+        x->magic = STRESS_MAGIC; x->n = 0;
+        int id = derr_add_sink(i & 1 ? &stress_ts_vt : &stress_lk_vt, x, DERR_DEBUG);
+        if (id < 0) { err = errno; free(x); break; }
+        if (derr_remove_sink(id) != 0) err = errno;
+    }
+    __atomic_store_n(&stress_stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 4; i++) pthread_join(th[i], NULL);
+    CHECK(!err, "add/remove: %s", strerror(err));
+    CHECK(!__atomic_load_n(&stress_bad, __ATOMIC_RELAXED), "write o flush su un sink già chiuso");
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    { "async-block",       test_async_block },
+    { "async-drop-newest", test_async_drop_newest },
+    { "async-drop-oldest", test_async_drop_oldest },
+    { "differita",         test_deferred },
+    { "binario",           test_binary },
+    { "rotazione",         test_rotation },
+    { "ring",              test_ring },
+    { "sink",              test_sink },
+};
+#define NTESTS ((int)(sizeof tests / sizeof tests[0]))
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        int ok = 0;
+        for (int t = 0; t < NTESTS; t++) ok |= !strcmp(argv[i], tests[t].name);
+        if (!ok) {
+            fprintf(stderr, "%s: test sconosciuto '%s'\ntest:", argv[0], argv[i]);
+            for (int t = 0; t < NTESTS; t++) fprintf(stderr, " %s", tests[t].name);
+            fputc('\n', stderr);
+            return 2;
+        }
+    }
+    snprintf(test_dir, sizeof test_dir, "/tmp/derr-test.XXXXXX");
+    if (!mkdtemp(test_dir)) { perror("mkdtemp"); return 1; }
+    derr_set_program_name("derr-test");
+    derr_enable_stderr(0);
+
+    int failed = 0, run = 0;
+    for (int t = 0; t < NTESTS; t++) {
+        int selected = argc == 1;
+        for (int i = 1; i < argc; i++) selected |= !strcmp(argv[i], tests[t].name);
+        if (!selected) continue;
+        test_name = tests[t].name;
+        run++;
+        if (tests[t].run() == 0) printf("ok      %s\n", tests[t].name);
+        else failed++;
+        fflush(stdout);
+    }
+    rmdir(test_dir);
+    printf("%d test, %d falliti\n", run, failed);
+    return failed != 0;
+}
@@ -0,0 +1,28 @@
+// derr-decode.c - Converte un log binario di derr.h (derr_binary_open) in testo
+// gcc -O2 derr-decode.c -o derr-decode
+//
+// Uso: derr-decode [file.bin]     (senza argomenti legge da stdin)
+
+#define DERR_IMPLEMENTATION
+#include "../derr.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    FILE *in = stdin;
+    if (argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))) {
+        fprintf(stderr, "uso: %s [file.bin]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2 && !(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    int rc = derr_binary_decode(in, stdout);
+    if (rc != 0) fprintf(stderr, "%s: flusso binario non valido o troncato\n", argv[0]);
+
+    if (in != stdin) fclose(in);
+    return rc != 0;
+}